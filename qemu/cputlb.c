@@ -111,6 +111,73 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     tb_flush_jmp_cache(cpu, addr);
 }
 
+static inline bool tlb_addr_in_range(target_ulong tlb_addr,
+                                     target_ulong start, target_ulong end)
+{
+    target_ulong page = tlb_addr & TARGET_PAGE_MASK;
+
+    return !(tlb_addr & TLB_INVALID_MASK) && page >= start && page < end;
+}
+
+/* Invalidate the entries mapping virtual pages in [start, end) and
+   return how many were dropped.  Walks the TLB once, so the cost does
+   not depend on the size of the range.  */
+int tlb_flush_range(CPUState *cpu, target_ulong start, target_ulong end)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int i;
+    int mmu_idx;
+    int n = 0;
+    bool full;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_range: " TARGET_FMT_lx "-" TARGET_FMT_lx "\n",
+           start, end);
+#endif
+    start &= TARGET_PAGE_MASK;
+
+    /* Large pages are not tracked per entry: if one overlaps the range,
+       every entry has to go.  */
+    full = env->tlb_flush_mask != 0 &&
+           env->tlb_flush_addr < end &&
+           start <= (env->tlb_flush_addr | ~env->tlb_flush_mask);
+    if (full) {
+        start = 0;
+        end = -1;
+    }
+
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            CPUTLBEntry *tlb_entry = &env->tlb_table[mmu_idx][i];
+            target_ulong addr;
+
+            if (tlb_addr_in_range(tlb_entry->addr_read, start, end)) {
+                addr = tlb_entry->addr_read;
+            } else if (tlb_addr_in_range(tlb_entry->addr_write, start, end)) {
+                addr = tlb_entry->addr_write;
+            } else if (tlb_addr_in_range(tlb_entry->addr_code, start, end)) {
+                addr = tlb_entry->addr_code;
+            } else {
+                continue;
+            }
+            memset(tlb_entry, -1, sizeof(*tlb_entry));
+            if (!full) {
+                tb_flush_jmp_cache(cpu, addr & TARGET_PAGE_MASK);
+            }
+            n++;
+        }
+    }
+
+    if (full) {
+        tlb_flush(cpu, 1);
+    }
+    return n;
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
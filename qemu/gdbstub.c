@@ -1409,6 +1409,10 @@ void gdb_exit(CPUArchState *env, int code)
   char buf[4];
 
   if(guest_ins_count == 1) tcg_plugin_cpus_stopped();
+#if defined(TARGET_I386)
+  sgx_mtrace_close();
+  sgx_trace_close();
+#endif
 
   s = gdbserver_state;
   if (!s) {
@@ -1500,6 +1504,10 @@ void gdb_signalled(CPUArchState *env, int sig)
     char buf[4];
 
     if(guest_ins_count == 1) tcg_plugin_cpus_stopped();
+#if defined(TARGET_I386)
+    sgx_mtrace_close();
+    sgx_trace_close();
+#endif
 
     s = gdbserver_state;
     if (gdbserver_fd < 0 || s->fd < 0) {
@@ -109,6 +109,8 @@ void configure_icount(const char *option);
 extern int use_icount;
 
 extern int guest_ins_count;
+extern const char *sgx_profile_path;
+extern const char *sgx_mtrace_path;
 
 #include "qemu/osdep.h"
 #include "qemu/bswap.h"
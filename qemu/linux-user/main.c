@@ -37,6 +37,8 @@
 char *exec_path;
 
 int guest_ins_count;
+const char *sgx_profile_path;
+const char *sgx_mtrace_path;
 int singlestep;
 const char *filename;
 const char *argv0;
@@ -3655,6 +3657,47 @@ static void handle_arg_icount(const char *arg)
     guest_ins_count = 1;
 }
 
+static void handle_arg_sgx_profile(const char *arg)
+{
+    /* the profile is built on the instruction counter */
+    guest_ins_count = 1;
+    sgx_profile_path = arg;
+}
+
+static void handle_arg_sgx_mtrace(const char *arg)
+{
+    /* records carry the instruction count of their vcpu */
+    guest_ins_count = 1;
+    sgx_mtrace_path = arg;
+}
+
+static void handle_arg_sgx_trace(const char *arg)
+{
+    if (sgx_trace_enable(arg) < 0) {
+        sgx_trace_help();
+        exit(is_help_option(arg) ? 0 : 1);
+    }
+}
+
+static void handle_arg_sgx_trace_file(const char *arg)
+{
+    sgx_trace_path = arg;
+}
+
+static void handle_arg_epc_pages(const char *arg)
+{
+    char *p;
+    char buf[64];
+
+    sgx_epc_pages = strtol(arg, &p, 0);
+    if (*p != '\0' || sgx_epc_pages <= 0 || sgx_epc_pages > 65536) {
+        usage();
+    }
+    /* the guest-side SGX kernel sizes its EPC from the same variable */
+    snprintf(buf, sizeof(buf), "QEMU_EPC_PAGES=%d", sgx_epc_pages);
+    envlist_setenv(envlist, buf);
+}
+
 struct qemu_argument {
     const char *argv;
     const char *env;
@@ -3691,6 +3734,19 @@ static const struct qemu_argument arg_table[] = {
 #endif
     {"i",	   "",		       false, handle_arg_icount,
      "",	   "count the number of executed guest instructions"},
+    {"sgx-profile", "QEMU_SGX_PROFILE", true, handle_arg_sgx_profile,
+     "file",       "write an instruction profile of host and enclave code "
+     "to 'file' as folded stacks"},
+    {"sgx-mtrace", "QEMU_SGX_MTRACE",  true,  handle_arg_sgx_mtrace,
+     "file",       "record enclave memory accesses and EPC paging "
+     "to 'file' (see user/sgx-mtrace)"},
+    {"sgx-trace",  "QEMU_SGX_TRACE",   true,  handle_arg_sgx_trace,
+     "item[,...]", "record the sgx_dbg() messages of these filters "
+     "(use '-sgx-trace help' for a list, see user/sgx-trace)"},
+    {"sgx-trace-file", "QEMU_SGX_TRACE_FILE", true, handle_arg_sgx_trace_file,
+     "file",       "write -sgx-trace records to 'file' (default qemu-sgx.trace)"},
+    {"epc-pages",  "QEMU_EPC_PAGES",   true,  handle_arg_epc_pages,
+     "pages",      "size of the SGX EPC in 4KB pages (default 1500)"},
     {"d",          "QEMU_LOG",         true,  handle_arg_log,
      "item[,...]", "enable logging of specified items "
      "(use '-d help' for a list of items)"},
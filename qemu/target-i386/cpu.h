@@ -155,6 +155,7 @@
 #define HF_SVMI_SHIFT       21 /* SVM intercepts are active */
 #define HF_OSFXSR_SHIFT     22 /* CR4.OSFXSR */
 #define HF_SMAP_SHIFT       23 /* CR4.SMAP */
+#define HF_SGX_SHIFT        24 /* SGX enclave mode (copy of CR_ENCLAVE_MODE) */
 
 #define HF_CPL_MASK          (3 << HF_CPL_SHIFT)
 #define HF_SOFTMMU_MASK      (1 << HF_SOFTMMU_SHIFT)
@@ -178,6 +179,7 @@
 #define HF_SVMI_MASK         (1 << HF_SVMI_SHIFT)
 #define HF_OSFXSR_MASK       (1 << HF_OSFXSR_SHIFT)
 #define HF_SMAP_MASK         (1 << HF_SMAP_SHIFT)
+#define HF_SGX_MASK          (1 << HF_SGX_SHIFT)
 
 /* hflags2 */
 
@@ -825,6 +827,37 @@ typedef struct CREGS {
     uint64_t CR_SEAL_FUSES[2];          // 128 PACKAGE
 } _cregs;
 
+/* Largest EPC accepted by ENCLS_OSGX_INIT, in pages (-epc-pages) */
+extern int sgx_epc_pages;
+
+/* EID of the enclave being executed, -1 outside of enclave mode */
+struct CPUX86State;
+int64_t sgx_active_eid(struct CPUX86State *env);
+
+/* Flush and close the -sgx-mtrace file, see sgx-mtrace.c */
+void sgx_mtrace_close(void);
+
+/* sgx_dbg() tracepoints (-sgx-trace, -sgx-trace-file), see sgx-trace.c */
+extern const char *sgx_trace_path;
+int sgx_trace_enable(const char *cats);
+void sgx_trace_help(void);
+void sgx_trace_close(void);
+
+/* Direct-mapped cache of validated EPC pages and their EPCM permissions */
+#define SGX_PERM_CACHE_BITS 6
+#define SGX_PERM_CACHE_SIZE (1 << SGX_PERM_CACHE_BITS)
+
+typedef struct SGXPermCacheEntry {
+    target_ulong page;
+    uint32_t perms;                     /* 0 if the entry is empty */
+} SGXPermCacheEntry;
+
+/* Per-vcpu AES-GCM state for EWB/ELDB, see sgx_helper.c */
+typedef struct SGXPageCrypto SGXPageCrypto;
+
+/* Per-vcpu -sgx-mtrace ring, see sgx-mtrace.c */
+typedef struct SGXMTrace SGXMTrace;
+
 typedef struct CPUX86State {
     /* standard registers */
     target_ulong regs[CPU_NB_REGS];
@@ -854,6 +887,12 @@ typedef struct CPUX86State {
 
     /* cregs for SGX specific code */
     _cregs cregs; 	/* CREGs maintained by processor */
+    /* EPC range checked inline by the translator (size 0 until OSGX_INIT) */
+    target_ulong sgx_epc_base;
+    target_ulong sgx_epc_size;
+    SGXPermCacheEntry sgx_perm_cache[SGX_PERM_CACHE_SIZE];
+    SGXPageCrypto *sgx_page_crypto;
+    SGXMTrace *sgx_mtrace;
 
     int32_t a20_mask;
 
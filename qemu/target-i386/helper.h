@@ -237,3 +237,6 @@ DEF_HELPER_3(mem_access, void, env, tl, int)
 
 /* For memory execution protection */
 DEF_HELPER_2(mem_execute, void, env, tl)
+
+/* Enclave access to EPC outside its ELRANGE */
+DEF_HELPER_2(sgx_range_fault, void, env, tl)
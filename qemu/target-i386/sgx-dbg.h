@@ -20,8 +20,18 @@
 # endif
 #endif
 
+// Every filter below, in bit order for -sgx-trace
+#define SGX_DBG_CATEGORIES(X)                   \
+    X(welcome) X(ttrace) X(mtrace) X(trace)     \
+    X(info) X(warn) X(dbg) X(err) X(rsa)        \
+    X(test) X(eenter) X(eadd)
+
+#define TRACE_MAX_ARGS  8                       // per -sgx-trace record
+
 #ifdef SGX_DEBUG
 
+#if defined(SGX_KERNEL) || defined(SGX_USERLIB)
+
  enum { sgx_dbg_welcome  = 1 }; // welcome
  enum { sgx_dbg_ttrace   = 0 }; // verbose trace msg
  enum { sgx_dbg_mtrace   = 0 }; // memory trace msg
@@ -47,6 +57,73 @@
         }                                       \
     } while( 0 )
 
+#else
+
+//
+// In qemu, the enums only say what goes to stderr: the filters that
+// fire on every enclave entry or memory access are off, so that the
+// emulator does not run at the speed of the terminal. Any filter can
+// be recorded at run time instead, see sgx-trace.h. The standalone
+// -DUNITTEST builds do not link sgx-trace.c and keep stderr only.
+//
+#ifndef UNITTEST
+#include "sgx-trace.h"
+#endif
+
+ enum { sgx_dbg_welcome  = 1 }; // welcome
+ enum { sgx_dbg_ttrace   = 0 }; // verbose trace msg
+ enum { sgx_dbg_mtrace   = 0 }; // memory trace msg
+ enum { sgx_dbg_trace    = 0 }; // light trace msg
+ enum { sgx_dbg_info     = 0 }; // info
+ enum { sgx_dbg_warn     = 1 }; // warning
+ enum { sgx_dbg_dbg      = 0 }; // dbg msg
+ enum { sgx_dbg_err      = 1 }; // err msg
+ enum { sgx_dbg_rsa      = 0 }; // rsa-related msg
+ enum { sgx_dbg_test     = 1 }; // unit test msg
+ enum { sgx_dbg_eenter   = 0 }; // sgx eenter instruction
+ enum { sgx_dbg_eadd     = 0 }; // sgx eadd instruction
+
+#ifdef UNITTEST
+
+# define sgx_dbg( filter, msg, ... )            \
+    do {                                        \
+        if ( sgx_dbg_##filter ) {               \
+            fprintf(stderr, __SGX_DEBUG_MARK    \
+                    "> %s(%d): " msg            \
+                    "\n",                       \
+                    __FUNCTION__,               \
+                    __LINE__,                   \
+                    ##__VA_ARGS__ );            \
+        }                                       \
+    } while( 0 )
+
+#else
+
+# define sgx_dbg( filter, msg, ... )            \
+    do {                                        \
+        if ( sgx_dbg_##filter ) {               \
+            fprintf(stderr, __SGX_DEBUG_MARK    \
+                    "> %s(%d): " msg            \
+                    "\n",                       \
+                    __FUNCTION__,               \
+                    __LINE__,                   \
+                    ##__VA_ARGS__ );            \
+        }                                       \
+        if ( sgx_trace_on( filter ) ) {         \
+            static sgx_trace_site_t __site = {  \
+                .cat  = SGX_TRACE_##filter,     \
+                .line = __LINE__,               \
+                .fmt  = msg,                    \
+            };                                  \
+            sgx_trace(&__site, __FUNCTION__,    \
+                      ##__VA_ARGS__ );          \
+        }                                       \
+    } while( 0 )
+
+#endif
+
+#endif
+
 # define sgx_ifdbg( filter, statements )        \
     do {                                        \
         if ( sgx_dbg_##filter ) {               \
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sgx.h"
+#include "sgx-dbg.h"
+#include "sgx-epcm.h"
+
+typedef struct {
+    uint64_t page;                      //!< epcPageAddress of the slot
+    int      index;                     //!< slot in epcm[]
+} epcm_slot_t;
+
+static int epcm_nepc;
+static uint64_t epcm_base;              //!< epcPageAddress of epcm[0]
+static bool epcm_contiguous;
+static epcm_slot_t *epcm_sorted;        //!< only used when !epcm_contiguous
+
+static
+int epcm_slot_cmp(const void *a, const void *b)
+{
+    const epcm_slot_t *s1 = a;
+    const epcm_slot_t *s2 = b;
+
+    if (s1->page < s2->page)
+        return -1;
+    return s1->page > s2->page;
+}
+
+// (Re)build the index. Must be called whenever epcPageAddress changes.
+void epcm_index_build(epcm_entry_t *epcm, int nepc)
+{
+    int i;
+
+    free(epcm_sorted);
+    epcm_sorted = NULL;
+
+    epcm_nepc = nepc;
+    epcm_base = (nepc > 0) ? epcm[0].epcPageAddress : 0;
+    epcm_contiguous = true;
+
+    for (i = 0; i < nepc; i++) {
+        if (epcm[i].epcPageAddress != epcm_base + (uint64_t)i * PAGE_SIZE) {
+            epcm_contiguous = false;
+            break;
+        }
+    }
+
+    if (epcm_contiguous)
+        return;
+
+    sgx_dbg(info, "EPC is not contiguous, using sorted EPCM index");
+
+    epcm_sorted = malloc(nepc * sizeof(epcm_slot_t));
+    if (!epcm_sorted) {
+        sgx_err("failed to allocate EPCM index");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nepc; i++) {
+        epcm_sorted[i].page  = epcm[i].epcPageAddress;
+        epcm_sorted[i].index = i;
+    }
+    qsort(epcm_sorted, nepc, sizeof(epcm_slot_t), epcm_slot_cmp);
+}
+
+// Returns the epcm[] slot whose page contains addr, or -1.
+int epcm_index_lookup(uint64_t addr)
+{
+    int lo, hi;
+
+    if (epcm_contiguous) {
+        // Unsigned wrap-around also rejects addr < epcm_base
+        uint64_t offset = addr - epcm_base;
+        if (offset < (uint64_t)epcm_nepc * PAGE_SIZE)
+            return (int)(offset / PAGE_SIZE);
+        return -1;
+    }
+
+    // Find the last page starting at or below addr
+    lo = 0;
+    hi = epcm_nepc - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (epcm_sorted[mid].page <= addr)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    if (hi >= 0 && addr < epcm_sorted[hi].page + PAGE_SIZE)
+        return epcm_sorted[hi].index;
+    return -1;
+}
+
+// Reference implementation: scan every entry.
+int epcm_linear_lookup(epcm_entry_t *epcm, int nepc, uint64_t addr)
+{
+    int i;
+
+    for (i = 0; i < nepc; i++) {
+        // Can be in between page addresses. for example: EEXTEND : 256 chunks && EWB : Version Array (VA)
+        if ((epcm[i].epcPageAddress <= addr)
+                && (addr < epcm[i].epcPageAddress + PAGE_SIZE)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef UNITTEST
+//
+// Microbenchmark: index vs. linear scan
+//   $ gcc -DUNITTEST -std=gnu99 -O2 sgx-epcm.c -o epcm-bench
+//
+#include <assert.h>
+#include <time.h>
+
+#define NUM_LOOKUPS (1 << 20)
+#define EPC_FAKE_BASE (0x40008000UL)
+
+static
+double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static
+void bench(const char *name, epcm_entry_t *epcm, int nepc, uint64_t *addrs)
+{
+    double beg;
+    double linear_ns, index_ns;
+    long sum = 0;
+    int i;
+
+    // the scan is slow, so sample it on a fraction of the lookups
+    beg = now_ns();
+    for (i = 0; i < NUM_LOOKUPS / 64; i++)
+        sum += epcm_linear_lookup(epcm, nepc, addrs[i]);
+    linear_ns = (now_ns() - beg) / (NUM_LOOKUPS / 64);
+
+    beg = now_ns();
+    for (i = 0; i < NUM_LOOKUPS; i++)
+        sum += epcm_index_lookup(addrs[i]);
+    index_ns = (now_ns() - beg) / NUM_LOOKUPS;
+
+    printf("%-12s nepc=%-6d linear: %8.1f ns/lookup  index: %6.1f ns/lookup"
+           "  (x%.0f) [%ld]\n",
+           name, nepc, linear_ns, index_ns, linear_ns / index_ns, sum);
+}
+
+int main(int argc, char *argv[])
+{
+    int sizes[] = { NUM_EPC, 32768, 65536 };
+    int s, i;
+
+    srand(0);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int nepc = sizes[s];
+        epcm_entry_t *epcm = calloc(nepc, sizeof(epcm_entry_t));
+        uint64_t *addrs = malloc(NUM_LOOKUPS * sizeof(uint64_t));
+        assert(epcm && addrs);
+
+        for (i = 0; i < nepc; i++)
+            epcm[i].epcPageAddress = EPC_FAKE_BASE + (uint64_t)i * PAGE_SIZE;
+        for (i = 0; i < NUM_LOOKUPS; i++)
+            addrs[i] = EPC_FAKE_BASE + (uint64_t)rand() % ((uint64_t)nepc * PAGE_SIZE);
+
+        // contiguous layout
+        epcm_index_build(epcm, nepc);
+        for (i = 0; i < 4096; i++)
+            assert(epcm_index_lookup(addrs[i])
+                   == epcm_linear_lookup(epcm, nepc, addrs[i]));
+        assert(epcm_index_lookup(EPC_FAKE_BASE - 1) == -1);
+        assert(epcm_index_lookup(EPC_FAKE_BASE + (uint64_t)nepc * PAGE_SIZE) == -1);
+        bench("contiguous", epcm, nepc, addrs);
+
+        // shuffled layout exercises the fallback
+        for (i = nepc - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            uint64_t tmp = epcm[i].epcPageAddress;
+            epcm[i].epcPageAddress = epcm[j].epcPageAddress;
+            epcm[j].epcPageAddress = tmp;
+        }
+        epcm_index_build(epcm, nepc);
+        for (i = 0; i < 4096; i++)
+            assert(epcm_index_lookup(addrs[i])
+                   == epcm_linear_lookup(epcm, nepc, addrs[i]));
+        bench("shuffled", epcm, nepc, addrs);
+
+        free(addrs);
+        free(epcm);
+    }
+
+    return 0;
+}
+#endif
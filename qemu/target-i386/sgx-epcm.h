@@ -0,0 +1,14 @@
+#pragma once
+
+#include "sgx.h"
+
+// EPCM index: maps an effective address to its epcm[] slot.
+//
+// The EPC handed to ENCLS_OSGX_INIT is one contiguous mapping, so the
+// common case is a subtract and a shift. If the epcPageAddress fields
+// do not describe a contiguous run, lookups fall back to a binary
+// search over a page-sorted copy of the table.
+
+void epcm_index_build(epcm_entry_t *epcm, int nepc);
+int  epcm_index_lookup(uint64_t addr);
+int  epcm_linear_lookup(epcm_entry_t *epcm, int nepc, uint64_t addr);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "polarssl/sha256.h"
+
+// Running MRENCLAVE measurement.
+//
+// sha256update() unpacks the digest bytes into a fresh context, hashes
+// one block and packs it back. A measure_t keeps the SHA-256 state in
+// native form for the lifetime of an enclave build, and hashes blocks
+// with SHA-NI when the host supports it. measure_export() produces the
+// same bytes sha256update() would have left in SECS.MRENCLAVE.
+
+typedef struct {
+    sha256_context ctx;                 //!< only ctx.state is used
+} measure_t;
+
+void measure_init(measure_t *m);
+void measure_import(measure_t *m, const unsigned char hash[32]);
+void measure_export(measure_t *m, unsigned char hash[32]);
+void measure_update(measure_t *m, const void *blocks, size_t nblocks);
+const char *measure_impl(void);
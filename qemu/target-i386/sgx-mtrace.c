@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cpu.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "sgx.h"
+#include "sgx-mtrace.h"
+#include "tcg-plugin.h"
+
+// Only the vcpu moves the head of its ring and only the writer moves
+// the tail. The writer is woken every half ring and when a vcpu finds
+// its ring full; whatever is left is drained by sgx_mtrace_close().
+#define MTRACE_RING_BITS    16
+#define MTRACE_RING         (1 << MTRACE_RING_BITS)
+#define MTRACE_KICK         (MTRACE_RING / 2)
+
+struct SGXMTrace {
+    CPUX86State *owner;                 //!< cpu_copy() duplicates env
+    mtrace_rec_t *recs;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t stalls;                    //!< times the vcpu found the ring full
+    uint8_t cpu;
+    SGXMTrace *next;                    //!< set once, before publishing
+};
+
+static pthread_once_t mt_once = PTHREAD_ONCE_INIT;
+static FILE *mt_file;
+static SGXMTrace *mt_rings;             //!< guarded by mt_lock
+static QemuMutex mt_lock;
+static QemuCond mt_work;                //!< mt_pending or mt_stop was set
+static QemuCond mt_space;               //!< the writer finished a pass
+static QemuThread mt_writer;
+static bool mt_pending;
+static bool mt_stop;
+static bool mt_closed;
+
+static
+void mtrace_drain(SGXMTrace *r)
+{
+    uint64_t head = atomic_mb_read(&r->head);
+    uint64_t tail = r->tail;
+
+    while (tail != head) {
+        uint64_t off = tail & (MTRACE_RING - 1);
+        uint64_t n = MIN(head - tail, MTRACE_RING - off);
+
+        if (fwrite(&r->recs[off], sizeof(mtrace_rec_t), n, mt_file) != n) {
+            fprintf(stderr, "qemu: -sgx-mtrace: %s\n", strerror(errno));
+        }
+        tail += n;
+    }
+    atomic_mb_set(&r->tail, tail);
+}
+
+static
+void *mtrace_writer(void *arg)
+{
+    SGXMTrace *r;
+    bool stop;
+
+    qemu_mutex_lock(&mt_lock);
+    for (;;) {
+        while (!mt_pending && !mt_stop) {
+            qemu_cond_wait(&mt_work, &mt_lock);
+        }
+        mt_pending = false;
+        stop = mt_stop;
+        r = mt_rings;
+        qemu_mutex_unlock(&mt_lock);
+
+        // rings are only ever prepended, so this walk needs no lock
+        for (; r; r = r->next) {
+            mtrace_drain(r);
+        }
+
+        qemu_mutex_lock(&mt_lock);
+        qemu_cond_broadcast(&mt_space);
+        if (stop) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&mt_lock);
+    return NULL;
+}
+
+static
+void mtrace_open(void)
+{
+    mtrace_hdr_t hdr;
+
+    mt_file = fopen(sgx_mtrace_path, "wb");
+    if (!mt_file) {
+        fprintf(stderr, "qemu: can't open %s: %s\n",
+                sgx_mtrace_path, strerror(errno));
+        mt_closed = true;
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MTRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = MTRACE_VERSION;
+    hdr.rec_size = sizeof(mtrace_rec_t);
+    fwrite(&hdr, sizeof(hdr), 1, mt_file);
+
+    qemu_mutex_init(&mt_lock);
+    qemu_cond_init(&mt_work);
+    qemu_cond_init(&mt_space);
+    qemu_thread_create(&mt_writer, "sgx-mtrace", mtrace_writer, NULL,
+                       QEMU_THREAD_JOINABLE);
+}
+
+static
+SGXMTrace *get_mtrace(CPUX86State *env)
+{
+    SGXMTrace *r = env->sgx_mtrace;
+
+    if (likely(r && r->owner == env)) {
+        return r;
+    }
+
+    pthread_once(&mt_once, mtrace_open);
+    if (atomic_read(&mt_closed)) {
+        return NULL;
+    }
+    r = g_new0(SGXMTrace, 1);
+    r->recs = g_new(mtrace_rec_t, MTRACE_RING);
+    r->owner = env;
+    r->cpu = ENV_GET_CPU(env)->cpu_index;
+
+    qemu_mutex_lock(&mt_lock);
+    r->next = mt_rings;
+    mt_rings = r;
+    qemu_mutex_unlock(&mt_lock);
+
+    env->sgx_mtrace = r;
+    return r;
+}
+
+static
+void mtrace_kick(void)
+{
+    qemu_mutex_lock(&mt_lock);
+    mt_pending = true;
+    qemu_cond_signal(&mt_work);
+    qemu_mutex_unlock(&mt_lock);
+}
+
+void sgx_mtrace_record(CPUX86State *env, int type, uint64_t addr,
+                       int epc_index, int64_t eid)
+{
+    SGXMTrace *r = get_mtrace(env);
+    mtrace_rec_t *rec;
+
+    if (!r || atomic_read(&mt_closed)) {
+        return;
+    }
+
+    if (r->head - atomic_mb_read(&r->tail) == MTRACE_RING) {
+        qemu_mutex_lock(&mt_lock);
+        while (!mt_closed && r->head - atomic_read(&r->tail) == MTRACE_RING) {
+            r->stalls++;
+            mt_pending = true;
+            qemu_cond_signal(&mt_work);
+            qemu_cond_wait(&mt_space, &mt_lock);
+        }
+        qemu_mutex_unlock(&mt_lock);
+        if (atomic_read(&mt_closed)) {
+            return;
+        }
+    }
+
+    rec = &r->recs[r->head & (MTRACE_RING - 1)];
+    rec->addr = addr;
+    rec->icount = tcg_plugin_icount(r->cpu);
+    rec->epc_index = epc_index;
+    rec->eid = (eid < 0 || eid > 0xfffe) ? 0xffff : eid;
+    rec->type = type;
+    rec->cpu = r->cpu;
+    smp_wmb();
+    atomic_set(&r->head, r->head + 1);
+
+    if ((r->head & (MTRACE_KICK - 1)) == 0) {
+        mtrace_kick();
+    }
+}
+
+// Called on guest exit: no vcpu may record past this point
+void sgx_mtrace_close(void)
+{
+    SGXMTrace *r;
+    uint64_t nrecs = 0, stalls = 0;
+
+    if (!mt_file) {
+        return;
+    }
+
+    qemu_mutex_lock(&mt_lock);
+    mt_stop = true;
+    qemu_cond_signal(&mt_work);
+    qemu_mutex_unlock(&mt_lock);
+    qemu_thread_join(&mt_writer);
+
+    qemu_mutex_lock(&mt_lock);
+    atomic_mb_set(&mt_closed, true);
+    qemu_cond_broadcast(&mt_space);
+    r = mt_rings;
+    qemu_mutex_unlock(&mt_lock);
+
+    for (; r; r = r->next) {
+        mtrace_drain(r);
+        nrecs += r->head;
+        stalls += r->stalls;
+    }
+    fclose(mt_file);
+    mt_file = NULL;
+
+    fprintf(stderr, "sgx-mtrace: %" PRIu64 " records to %s, "
+            "%" PRIu64 " ring stalls\n", nrecs, sgx_mtrace_path, stalls);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "cpu.h"
+#include "sgx.h"
+#include "sgx-epcm.h"
+
+// Enclave memory trace (-sgx-mtrace FILE).
+//
+// Each vcpu appends mtrace_rec_t records to its own ring; a writer
+// thread drains the rings into the file. Nothing is dropped: a vcpu
+// that fills its ring waits for the writer. See user/sgx-mtrace.c for
+// the decoder.
+
+void sgx_mtrace_record(CPUX86State *env, int type, uint64_t addr,
+                       int epc_index, int64_t eid);
+
+// Access to addr by the enclave running on env
+static inline
+void sgx_mtrace_access(CPUX86State *env, int type, uint64_t addr)
+{
+    if (unlikely(sgx_mtrace_path != NULL)) {
+        sgx_mtrace_record(env, type, addr, epcm_index_lookup(addr),
+                          sgx_active_eid(env));
+    }
+}
+
+// EWB/ELDB/ELDU of the page of enclave eid at addr, in epcm[epc_index]
+static inline
+void sgx_mtrace_page(CPUX86State *env, int type, uint64_t addr,
+                     int epc_index, int64_t eid)
+{
+    if (unlikely(sgx_mtrace_path != NULL)) {
+        sgx_mtrace_record(env, type, addr, epc_index, eid);
+    }
+}
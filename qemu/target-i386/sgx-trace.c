@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cpu.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "sgx.h"
+#include "sgx-trace.h"
+
+#define TRACE_BUF_SIZE      (64 * 1024)
+#define TRACE_REC_MAX       (4 * 1024)
+#define TRACE_STR_MAX       256         //!< longer %s arguments are cut
+
+typedef struct SGXTraceBuf {
+    uint32_t tid;
+    uint32_t len;
+    struct SGXTraceBuf *next;
+    uint8_t data[TRACE_BUF_SIZE];
+} SGXTraceBuf;
+
+uint32_t sgx_trace_mask;
+const char *sgx_trace_path = "qemu-sgx.trace";
+
+static const char *trace_cat_names[SGX_TRACE_NR] = {
+#define SGX_TRACE_NAME(c) #c,
+    SGX_DBG_CATEGORIES(SGX_TRACE_NAME)
+#undef SGX_TRACE_NAME
+};
+
+static __thread SGXTraceBuf *trace_buf;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;         //!< flushes a buffer at thread exit
+static QemuMutex trace_lock;            //!< the file, site ids, trace_bufs
+static FILE *trace_file;
+static SGXTraceBuf *trace_bufs;
+static int trace_nsites;
+static uint64_t trace_t0;
+static bool trace_closed;
+
+static
+uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Enable the comma-separated filters in cats ("all" for every one)
+int sgx_trace_enable(const char *cats)
+{
+    const char *p = cats;
+    uint32_t mask = 0;
+
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        int i;
+
+        if (len == 3 && !strncmp(p, "all", 3)) {
+            mask = (1u << SGX_TRACE_NR) - 1;
+        } else {
+            for (i = 0; i < SGX_TRACE_NR; i++) {
+                if (strlen(trace_cat_names[i]) == len
+                    && !strncmp(p, trace_cat_names[i], len)) {
+                    break;
+                }
+            }
+            if (i == SGX_TRACE_NR) {
+                return -1;
+            }
+            mask |= 1u << i;
+        }
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    sgx_trace_mask |= mask;
+    return 0;
+}
+
+void sgx_trace_help(void)
+{
+    int i;
+
+    printf("sgx_dbg() filters for -sgx-trace (or all):\n");
+    for (i = 0; i < SGX_TRACE_NR; i++) {
+        printf("  %s\n", trace_cat_names[i]);
+    }
+}
+
+// Caller holds trace_lock
+static
+void trace_flush(SGXTraceBuf *b)
+{
+    if (b->len && trace_file) {
+        fwrite(b->data, b->len, 1, trace_file);
+    }
+    b->len = 0;
+}
+
+static
+void trace_thread_exit(void *arg)
+{
+    SGXTraceBuf *b = arg, **pp;
+
+    qemu_mutex_lock(&trace_lock);
+    trace_flush(b);
+    for (pp = &trace_bufs; *pp; pp = &(*pp)->next) {
+        if (*pp == b) {
+            *pp = b->next;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&trace_lock);
+    g_free(b);
+}
+
+static
+void trace_open(void)
+{
+    trace_hdr_t hdr;
+
+    qemu_mutex_init(&trace_lock);
+    pthread_key_create(&trace_key, trace_thread_exit);
+    trace_t0 = trace_now_ns();
+
+    trace_file = fopen(sgx_trace_path, "wb");
+    if (!trace_file) {
+        fprintf(stderr, "qemu: can't open %s: %s\n",
+                sgx_trace_path, strerror(errno));
+        trace_closed = true;
+        return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    fwrite(&hdr, sizeof(hdr), 1, trace_file);
+}
+
+static
+SGXTraceBuf *get_trace_buf(void)
+{
+    SGXTraceBuf *b = trace_buf;
+
+    if (likely(b)) {
+        return b;
+    }
+    pthread_once(&trace_once, trace_open);
+    if (atomic_read(&trace_closed)) {
+        return NULL;
+    }
+
+    b = g_new(SGXTraceBuf, 1);
+    b->tid = qemu_get_thread_id();
+    b->len = 0;
+    pthread_setspecific(trace_key, b);
+
+    qemu_mutex_lock(&trace_lock);
+    b->next = trace_bufs;
+    trace_bufs = b;
+    qemu_mutex_unlock(&trace_lock);
+
+    trace_buf = b;
+    return b;
+}
+
+// The argument types printf() would fetch for fmt
+static
+void trace_parse_fmt(sgx_trace_site_t *site)
+{
+    const char *p = site->fmt;
+
+    while ((p = strchr(p, '%')) != NULL && site->nargs < TRACE_MAX_ARGS) {
+        bool lng = false;
+        int prec = 0;
+
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        p += strspn(p, "-+ #0");
+        if (*p == '*') {
+            site->args[site->nargs++] = TRACE_ARG_INT;
+            p++;
+        }
+        p += strspn(p, "0123456789");
+        if (*p == '.') {
+            p++;
+            if (*p == '*') {
+                if (site->nargs < TRACE_MAX_ARGS) {
+                    site->args[site->nargs++] = TRACE_ARG_INT;
+                }
+                p++;
+            } else {
+                prec = atoi(p);
+                p += strspn(p, "0123456789");
+            }
+        }
+        for (; *p && strchr("hlLqjzt", *p); p++) {
+            lng |= (*p != 'h');
+        }
+        if (!*p || site->nargs == TRACE_MAX_ARGS) {
+            break;
+        }
+
+        switch (*p++) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            site->args[site->nargs++] = lng ? TRACE_ARG_LONG : TRACE_ARG_INT;
+            break;
+        case 'p':
+            site->args[site->nargs++] = TRACE_ARG_LONG;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+        case 'a': case 'A':
+            site->args[site->nargs++] = TRACE_ARG_DBL;
+            break;
+        case 's':
+            site->str_max[site->nargs] = (prec && prec < TRACE_STR_MAX)
+                                         ? prec : TRACE_STR_MAX;
+            site->args[site->nargs++] = TRACE_ARG_STR;
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+// Give the site an id and write its definition, on its first hit
+static
+void trace_define(sgx_trace_site_t *site, const char *func)
+{
+    uint8_t rec[TRACE_REC_MAX];
+    trace_rec_t *hdr = (trace_rec_t *)rec;
+    trace_def_t *def = (trace_def_t *)(hdr + 1);
+    size_t flen, mlen;
+
+    qemu_mutex_lock(&trace_lock);
+    if (site->id) {
+        qemu_mutex_unlock(&trace_lock);
+        return;
+    }
+    site->func = func;
+    trace_parse_fmt(site);
+
+    flen = MIN(strlen(func) + 1, 256);
+    mlen = MIN(strlen(site->fmt) + 1,
+               TRACE_REC_MAX - sizeof(*hdr) - sizeof(*def) - flen);
+
+    memset(hdr, 0, sizeof(*hdr) + sizeof(*def));
+    hdr->size = sizeof(*hdr) + sizeof(*def) + flen + mlen;
+    hdr->site = ++trace_nsites;
+    def->line = site->line;
+    def->cat = site->cat;
+    def->nargs = site->nargs;
+    memcpy(def->args, site->args, sizeof(def->args));
+    memcpy(def + 1, func, flen);
+    memcpy((char *)(def + 1) + flen, site->fmt, mlen);
+    ((char *)(def + 1))[flen - 1] = '\0';
+    rec[hdr->size - 1] = '\0';
+
+    if (trace_file) {
+        fwrite(rec, hdr->size, 1, trace_file);
+    }
+    atomic_mb_set(&site->id, hdr->site);
+    qemu_mutex_unlock(&trace_lock);
+}
+
+void sgx_trace(sgx_trace_site_t *site, const char *func, ...)
+{
+    SGXTraceBuf *b = get_trace_buf();
+    trace_rec_t *hdr;
+    uint8_t *p;
+    va_list ap;
+    int i;
+
+    if (!b || atomic_read(&trace_closed)) {
+        return;
+    }
+    if (!atomic_mb_read(&site->id)) {
+        trace_define(site, func);
+    }
+    if (b->len + TRACE_REC_MAX > TRACE_BUF_SIZE) {
+        qemu_mutex_lock(&trace_lock);
+        trace_flush(b);
+        qemu_mutex_unlock(&trace_lock);
+    }
+
+    hdr = (trace_rec_t *)&b->data[b->len];
+    hdr->site = site->id;
+    hdr->tid = b->tid;
+    hdr->ns = trace_now_ns() - trace_t0;
+    p = (uint8_t *)(hdr + 1);
+
+    va_start(ap, func);
+    for (i = 0; i < site->nargs; i++) {
+        uint64_t v = 0;
+        double d;
+
+        switch (site->args[i]) {
+        case TRACE_ARG_INT:
+            v = (uint32_t)va_arg(ap, int);
+            break;
+        case TRACE_ARG_LONG:
+            v = va_arg(ap, uint64_t);
+            break;
+        case TRACE_ARG_DBL:
+            d = va_arg(ap, double);
+            memcpy(&v, &d, sizeof(v));
+            break;
+        case TRACE_ARG_STR: {
+            const char *s = va_arg(ap, const char *);
+            uint16_t len;
+
+            if (!s) {
+                s = "(null)";
+            }
+            len = strnlen(s, site->str_max[i]);
+            memcpy(p, &len, sizeof(len));
+            memcpy(p + sizeof(len), s, len);
+            p += sizeof(len) + len;
+            continue;
+        }
+        }
+        memcpy(p, &v, sizeof(v));
+        p += sizeof(v);
+    }
+    va_end(ap);
+
+    hdr->size = p - (uint8_t *)hdr;
+    b->len += hdr->size;
+}
+
+// Called on guest exit: flush every thread's buffer and close the file
+void sgx_trace_close(void)
+{
+    SGXTraceBuf *b;
+    long bytes;
+
+    if (!trace_file) {
+        return;
+    }
+    qemu_mutex_lock(&trace_lock);
+    atomic_mb_set(&trace_closed, true);
+    for (b = trace_bufs; b; b = b->next) {
+        trace_flush(b);
+    }
+    bytes = ftell(trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+    qemu_mutex_unlock(&trace_lock);
+
+    fprintf(stderr, "sgx-trace: %d call sites, %ld bytes to %s\n",
+            trace_nsites, bytes, sgx_trace_path);
+}
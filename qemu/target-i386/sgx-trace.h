@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "sgx-dbg.h"
+
+// sgx_dbg() tracepoints (-sgx-trace item[,...], -sgx-trace-file FILE).
+//
+// A call site whose filter is enabled at run time appends a binary
+// record to a buffer of the calling thread: the site id, a timestamp
+// and the raw arguments of its format. Buffers go to the file when
+// they fill up, when their thread exits and at exit. The format of a
+// site is parsed and written to the file once, on its first hit; see
+// user/sgx-trace.c for the pretty-printer. A disabled filter costs a
+// load and a test.
+
+enum {
+#define SGX_TRACE_ENUM(c) SGX_TRACE_##c,
+    SGX_DBG_CATEGORIES(SGX_TRACE_ENUM)
+#undef SGX_TRACE_ENUM
+    SGX_TRACE_NR
+};
+
+// sgx.h packs its structures; this one is shared by every includer
+#pragma pack(push, 8)
+typedef struct {
+    int         id;                     //!< 0 until the first hit
+    uint8_t     cat;                    //!< SGX_TRACE_*
+    int         line;
+    const char *fmt;
+    const char *func;
+    uint8_t     nargs;
+    uint8_t     args[TRACE_MAX_ARGS];   //!< TRACE_ARG_* of each argument
+    uint16_t    str_max[TRACE_MAX_ARGS];//!< bytes of a %s argument kept
+} sgx_trace_site_t;
+#pragma pack(pop)
+
+extern uint32_t sgx_trace_mask;
+
+#define sgx_trace_on(filter)                                            \
+    __builtin_expect(sgx_trace_mask & (1u << SGX_TRACE_##filter), 0)
+
+void sgx_trace(sgx_trace_site_t *site, const char *func, ...);
@@ -22,8 +22,9 @@
 #define CPU_SVN                  (1)              //!< Default CPU SVN
 #define PAGE_SIZE                (4096)
 #define EPC_SIZE                 (PAGE_SIZE)      // from 1.5
-//#define NUM_EPC                (100)            // XXX. where?
-#define NUM_EPC                  (1500)           // XXX. where?
+#define NUM_EPC                  (1500)           //!< Default EPC size in pages
+#define MAX_EPC                  (65536)          //!< EPCM indices are 16 bits
+#define EPC_PAGES_ENV            "QEMU_EPC_PAGES" //!< Set by -epc-pages
 #define ENCLAVE_SIZE             (16)             // XXX : Set temporarily
 #define MEASUREMENT_SIZE         (256)
 #define MIN_ALLOC                (2)
@@ -54,7 +55,16 @@
 #define PRIfptr "0x%016"PRIxPTR
 
 /// QEMU resource management for enclave
-#define MAX_ENCLAVES 16
+#define MAX_ENCLAVES 16                           //!< For the default EPC
+
+// Enclave slots for an EPC of nepc pages: MAX_ENCLAVES for the default
+// EPC, growing linearly with larger ones.
+static inline
+int max_enclaves(int nepc)
+{
+    int n = nepc / (NUM_EPC / MAX_ENCLAVES);
+    return (n > MAX_ENCLAVES) ? n : MAX_ENCLAVES;
+}
 
 typedef uint8_t rsa_key_t[KEY_LENGTH];
 typedef uint8_t rsa_sig_t[KEY_LENGTH];
@@ -119,6 +129,11 @@ typedef enum {
     ENCLS_OSGX_CPUSVN    = 0x13,          // XXX?
     ENCLS_OSGX_STAT      = 0x14,
     ENCLS_OSGX_SET_STACK = 0x15,
+    ENCLS_OSGX_EWB_N     = 0x16,          // batched EWB
+    ENCLS_OSGX_ELD_N     = 0x17,          // batched ELDB/ELDU
+    ENCLS_OSGX_EADD_N    = 0x18,          // batched EADD (+ EEXTEND)
+    ENCLS_OSGX_EPC_AGE   = 0x19,          // read and clear EPC accessed bits
+    ENCLS_OSGX_PROFILE   = 0x1A,          // name an enclave's code for -sgx-profile
 } encls_cmd_t;
 
 // from 5.1.2
@@ -188,6 +203,8 @@ typedef struct {
     unsigned int blocked:1;             //!< Indicates whether the page is in the blocked state
     unsigned int pending:1;             //!< Indicates whether the page is in the pending state
     unsigned int modified:1;            //!< Indicates whether the page is in the modified state
+    unsigned int accessed:1;            //!< OpenSGX: enclave accessed the page since ENCLS_OSGX_EPC_AGE
+    unsigned int evicted:1;             //!< OpenSGX: written back by EWB, enclave accesses fault
 
     // XXX?
     uint64_t epcPageAddress;            //!< Maps EPCM <-> EPC ( enclaveAddress seems to have a different functionality
@@ -377,6 +394,96 @@ typedef struct {
     uint64_t  mac[2]; 
 } pcmd_t;
 
+// One page for ENCLS_OSGX_EWB_N / ENCLS_OSGX_ELD_N: the RBX/RCX/RDX
+// operands of a single EWB/ELDB, and its EAX on return.
+typedef struct {
+    uint64_t pageinfo;
+    uint64_t epcpage;
+    uint64_t vaslot;
+    uint64_t status;
+} paging_req_t;
+
+// One page for ENCLS_OSGX_EADD_N: the RBX/RCX operands of a single EADD.
+// Padded to 64 bytes so every pageinfo stays PAGEINFO_ALIGN_SIZE aligned.
+typedef struct {
+    pageinfo_t pageinfo;
+    uint64_t   epcpage;
+    uint64_t   reserved[3];
+} eadd_req_t;
+
+// ENCLS_OSGX_PROFILE: the enclave code at load_addr is the size bytes
+// at link_addr in path, whose symbols name it in the profile
+#define PROFILE_PATH_MAX    256
+typedef struct {
+    uint64_t load_addr;
+    uint64_t link_addr;
+    uint64_t size;
+    char     path[PROFILE_PATH_MAX];
+} profile_map_t;
+
+// -sgx-mtrace file: an mtrace_hdr_t, then mtrace_rec_t records in the
+// order each vcpu produced them (vcpus are interleaved in chunks)
+#define MTRACE_MAGIC        "SGXMTRC1"
+#define MTRACE_VERSION      1
+
+#define MTRACE_READ         0           //!< enclave load inside ELRANGE
+#define MTRACE_WRITE        1           //!< enclave store inside ELRANGE
+#define MTRACE_EXEC         2           //!< enclave jump/call/ret target
+#define MTRACE_EVICT        3           //!< EWB of a REG/TCS page
+#define MTRACE_RELOAD       4           //!< ELDB/ELDU of a REG/TCS page
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t rec_size;                  //!< sizeof(mtrace_rec_t)
+} mtrace_hdr_t;
+
+typedef struct {
+    uint64_t addr;
+    uint64_t icount;                    //!< guest instructions of the vcpu so far
+    int32_t  epc_index;                 //!< epcm[] slot, -1 outside the EPC
+    uint16_t eid;                       //!< 0xffff if unknown
+    uint8_t  type;                      //!< MTRACE_*
+    uint8_t  cpu;
+} mtrace_rec_t;
+
+// -sgx-trace file: a trace_hdr_t, then trace_rec_t records. A record
+// with tid 0 defines call site 'site': a trace_def_t follows, then the
+// function name and the format, both NUL-terminated. Any other record
+// is a hit on a site defined before it, followed by the arguments of
+// the format: 8 bytes each, strings as a uint16_t length and the bytes.
+#define TRACE_MAGIC         "SGXTRCE1"
+#define TRACE_VERSION       1
+
+#define TRACE_ARG_INT       0           //!< int, unsigned, char
+#define TRACE_ARG_LONG      1           //!< long, long long, size_t, pointers
+#define TRACE_ARG_DBL       2
+#define TRACE_ARG_STR       3
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} trace_hdr_t;
+
+typedef struct {
+    uint16_t size;                      //!< of the record, header included
+    uint16_t site;
+    uint32_t tid;                       //!< host thread, 0 for a definition
+    uint64_t ns;                        //!< since the file was opened
+} trace_rec_t;
+
+typedef struct {
+    uint32_t line;
+    uint8_t  cat;                       //!< bit in SGX_DBG_CATEGORIES()
+    uint8_t  nargs;
+    uint8_t  args[TRACE_MAX_ARGS];      //!< TRACE_ARG_*
+} trace_def_t;
+
+// Per-page bits returned by ENCLS_OSGX_EPC_AGE
+#define EPC_AGE_ACCESSED    (1 << 0)    //!< accessed since the previous call
+#define EPC_AGE_EVICTABLE   (1 << 1)    //!< valid, unblocked, non-executable PT_REG
+
 // XXX:Separate reserved -> reserved1, reserved2 to remove warning
 typedef struct {
     unsigned int dbgoptin:1;
@@ -496,9 +603,22 @@ typedef struct mark_eid_einit {
     struct mark_eid_einit *next;
 } eid_einit_t;
 
+// Log2-bucketed histogram: bucket[0] counts zeros, bucket[i] values in
+// [2^(i-1), 2^i) and the last bucket everything from there up.
+#define STAT_HIST_BUCKETS   32
+#define STAT_ENCLS_LEAVES   (ENCLS_EMODT + 1)       //!< spec leaves only
+#define STAT_ENCLU_LEAVES   (ENCLU_EACCEPTCOPY + 1)
+
+typedef struct {
+    uint64_t n;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t bucket[STAT_HIST_BUCKETS];
+} stat_hist_t;
+
 typedef struct {
     unsigned int mode_switch;
-    unsigned int tlbflush_n;
+    unsigned int tlbflush_n;            // TLB entries invalidated on transitions
 
     unsigned int encls_n;
     unsigned int ecreate_n;
@@ -514,10 +634,24 @@ typedef struct {
     unsigned int egetkey_n;
     unsigned int ereport_n;
     unsigned int eaccept_n;
+
+    // Host time spent in each leaf (ns), by leaf number
+    stat_hist_t encls_ns[STAT_ENCLS_LEAVES];
+    stat_hist_t enclu_ns[STAT_ENCLU_LEAVES];
+
+    // Each stay inside the enclave (EENTER/ERESUME to EEXIT/AEX) and
+    // outside it in between (ocalls, AEX handling). Guest instructions
+    // are only counted with -i, a translation block at a time.
+    stat_hist_t inside_ns;
+    stat_hist_t inside_insn;
+    stat_hist_t outside_ns;
+    stat_hist_t outside_insn;
 } stat_t;
 
 typedef struct {
     stat_t stat;
+    uint64_t switch_ns;                 //!< last entry or exit, 0 before EENTER
+    uint64_t switch_insn;
 } qeid_t;
 
 
@@ -6,11 +6,15 @@
 #include "cpu.h"
 #include "sgx.h"
 #include "sgx-utils.h"
+#include "sgx-epcm.h"
+#include "sgx-measure.h"
+#include "sgx-mtrace.h"
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
 #include "sgx-dbg.h"
 #include "exec/cpu-all.h"
 #include "sgx-perf.h"
+#include "tcg-plugin.h"
 
 #include "polarssl/sha256.h"
 #include "polarssl/rsa.h"
@@ -22,12 +26,17 @@
 
 
 
-static qeid_t qenclaves[MAX_ENCLAVES];
+static qeid_t *qenclaves;
+static measure_t *qmeasures;            //!< running MRENCLAVE, by eid
+static int num_qenclaves;
 
 /**
  *  SGX Global Data Structures
  */
-static epcm_entry_t epcm[NUM_EPC];
+static epcm_entry_t *epcm;
+static int num_epc;
+// Upper bound for the EPC handed to ENCLS_OSGX_INIT (-epc-pages)
+int sgx_epc_pages = NUM_EPC;
 static epc_map * enclaveTrackEntry = NULL;      // Tracking pointers For enclaves
 static eid_einit_t * entry_eid = NULL;
 static uint64_t EPC_BaseAddr;
@@ -44,6 +53,98 @@ static uint64_t enclave_ssa_base;
 static uint8_t process_priv_key[DEVICE_KEY_LENGTH];
 static uint8_t process_pub_key[DEVICE_KEY_LENGTH];
 
+#if PERF
+// Enclave the ENCLS/ENCLU being executed is charged to, -1 if none
+static int64_t perf_eid = -1;
+
+static
+uint64_t perf_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+void stat_hist_add(stat_hist_t *hist, uint64_t v)
+{
+    int b = v ? 64 - __builtin_clzll(v) : 0;
+
+    if (b >= STAT_HIST_BUCKETS)
+        b = STAT_HIST_BUCKETS - 1;
+    hist->bucket[b]++;
+    hist->n++;
+    hist->sum += v;
+    if (v > hist->max)
+        hist->max = v;
+}
+
+// Enclave owning the EPC page at addr (or whose SECS it is), -1 if none
+static
+int64_t perf_page_eid(uint64_t addr)
+{
+    int index = epcm_index_lookup(addr);
+    secs_t *secs;
+
+    if (index < 0 || !epcm[index].valid)
+        return -1;
+    if (epcm[index].page_type == PT_SECS)
+        secs = (secs_t *)(addr & ~(uint64_t)(PAGE_SIZE - 1));
+    else
+        secs = (secs_t *)epcm[index].enclave_secs;
+    if (!secs)
+        return -1;
+    return secs->eid_reserved.eid_pad.eid;
+}
+
+// ENCLS leaves on an EPC page (RCX) that do not look up their enclave
+// themselves are charged to its owner, before or after the leaf runs
+static
+uint64_t perf_leaf_begin(CPUX86State *env, bool encls)
+{
+    perf_eid = encls ? perf_page_eid(env->regs[R_ECX]) : -1;
+    return perf_now_ns();
+}
+
+static
+void perf_leaf_end(CPUX86State *env, bool encls, uint64_t leaf, uint64_t beg)
+{
+    uint64_t ns = perf_now_ns() - beg;
+    stat_t *stat;
+
+    if (encls && perf_eid < 0)
+        perf_eid = perf_page_eid(env->regs[R_ECX]);
+    if (perf_eid < 0 || perf_eid >= num_qenclaves)
+        return;
+
+    stat = &qenclaves[perf_eid].stat;
+    if (encls && leaf < STAT_ENCLS_LEAVES)
+        stat_hist_add(&stat->encls_ns[leaf], ns);
+    else if (!encls && leaf < STAT_ENCLU_LEAVES)
+        stat_hist_add(&stat->enclu_ns[leaf], ns);
+}
+
+// Close the stay inside (enter == false) or outside the enclave that
+// ends with this switch
+static
+void perf_switch(CPUX86State *env, int64_t eid, bool enter)
+{
+    qeid_t *q = &qenclaves[eid];
+    uint64_t ns = perf_now_ns();
+    uint64_t insn = tcg_plugin_icount(ENV_GET_CPU(env)->cpu_index);
+
+    if (!enter) {
+        stat_hist_add(&q->stat.inside_ns, ns - q->switch_ns);
+        stat_hist_add(&q->stat.inside_insn, insn - q->switch_insn);
+    } else if (q->switch_ns) {
+        stat_hist_add(&q->stat.outside_ns, ns - q->switch_ns);
+        stat_hist_add(&q->stat.outside_insn, insn - q->switch_insn);
+    }
+    q->switch_ns = ns;
+    q->switch_insn = insn;
+}
+#endif
+
 typedef struct {
     bool read_check;
     bool write_check;
@@ -65,30 +166,70 @@ static const unsigned char gcm_key[] = {
 0x5f, 0x8a, 0xe6, 0xd1, 0x65, 0x8b, 0xb2, 0x6d, 0xe6, 0xf8, 0xa0, 0x69,
 0xa3, 0x52, 0x02, 0x93};
 
+// Last version handed out by EWB (0 marks an empty VA slot)
+static uint64_t ewb_version;
+
 void handleError(char *errMsg)
 {
     printf("%s\n", errMsg);
     exit(-1);
 }
 
-int encrypt_epc(unsigned char *plaintext, int plaintext_len, unsigned char *aad,
-            int aad_len, unsigned char *key, unsigned char *iv,
+// AES-GCM contexts for EWB/ELDB, one pair per vcpu. The key schedule is
+// expanded once; each page only restarts GCM with its IV.
+struct SGXPageCrypto {
+    CPUX86State *owner;                 //!< cpu_copy() duplicates env
+    EVP_CIPHER_CTX *enc;
+    EVP_CIPHER_CTX *dec;
+    bool key_set;
+    unsigned char key[16];
+};
+
+// callers pass a NULL iv for the fixed all-zero IV
+static const unsigned char gcm_zero_iv[16];
+
+static
+SGXPageCrypto *get_page_crypto(CPUX86State *env, const unsigned char *key)
+{
+    SGXPageCrypto *pc = env->sgx_page_crypto;
+
+    if (!pc || pc->owner != env) {
+        pc = calloc(1, sizeof(SGXPageCrypto));
+        if (!pc || !(pc->enc = EVP_CIPHER_CTX_new())
+                || !(pc->dec = EVP_CIPHER_CTX_new())) {
+            handleError("Context Creation Error !!!");
+        }
+        pc->owner = env;
+        if(EVP_EncryptInit_ex(pc->enc, EVP_aes_128_gcm(), NULL, NULL, NULL) != 1 ||
+           EVP_DecryptInit_ex(pc->dec, EVP_aes_128_gcm(), NULL, NULL, NULL) != 1) {
+            handleError("EVP Init Error !!!");
+        }
+        if(EVP_CIPHER_CTX_ctrl(pc->enc, EVP_CTRL_GCM_SET_IVLEN, 16, NULL) != 1 ||
+           EVP_CIPHER_CTX_ctrl(pc->dec, EVP_CTRL_GCM_SET_IVLEN, 16, NULL) != 1) {
+            handleError("Context Control Error !!!");
+        }
+        env->sgx_page_crypto = pc;
+    }
+
+    if (!pc->key_set || memcmp(pc->key, key, sizeof(pc->key))) {
+        if(EVP_EncryptInit_ex(pc->enc, NULL, NULL, key, NULL) != 1 ||
+           EVP_DecryptInit_ex(pc->dec, NULL, NULL, key, NULL) != 1) {
+            handleError("Key Init Error !!!");
+        }
+        memcpy(pc->key, key, sizeof(pc->key));
+        pc->key_set = true;
+    }
+    return pc;
+}
+
+int encrypt_epc(EVP_CIPHER_CTX *ctx, unsigned char *plaintext, int plaintext_len,
+            unsigned char *aad, int aad_len, const unsigned char *iv,
             unsigned char *ciphertext, unsigned char *tag) {
-    EVP_CIPHER_CTX *ctx;
     int len;
     int ciphertext_len; 
 
-    if(!(ctx = EVP_CIPHER_CTX_new())) {
-        handleError("Context Creation Error !!!");
-    }
-    if(EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL) != 1) {
-        handleError("EVP Init Error !!!");
-    }
-    if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, 16, NULL) != 1) {
-        handleError("Context Control Error !!!");
-    }
-    if(EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv) != 1) {
-        handleError("Key & IV Init Error !!!");
+    if(EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv ? iv : gcm_zero_iv) != 1) {
+        handleError("IV Init Error !!!");
     }
     if(EVP_EncryptUpdate(ctx, NULL, &len, aad, aad_len) !=1 ) {
         handleError("Aad Addtion Error !!!");
@@ -109,34 +250,19 @@ int encrypt_epc(unsigned char *plaintext, int plaintext_len, unsigned char *aad,
     if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag) != 1) { 
         handleError("Getting Tag Error !!!");
     }
-    /* Clean up */
-    EVP_CIPHER_CTX_free(ctx);
     return ciphertext_len;
 }
 
-int decrypt_epc(unsigned char *ciphertext, int ciphertext_len, unsigned char *aad,
-            int aad_len, unsigned char *tag, unsigned char *key, unsigned char *iv,
-            unsigned char *plaintext)
+int decrypt_epc(EVP_CIPHER_CTX *ctx, unsigned char *ciphertext, int ciphertext_len,
+            unsigned char *aad, int aad_len, unsigned char *tag,
+            const unsigned char *iv, unsigned char *plaintext)
 {
-    EVP_CIPHER_CTX *ctx;
     int len;
     int plaintext_len;
     int ret;
 
-    // create and init the context
-    if(!(ctx = EVP_CIPHER_CTX_new())) {
-        handleError("Context Creation Error !!!");
-    }
-    // init the decrypt operation
-    if(!EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL)) { 
-        handleError("EVIP Decrypt Init Error !!!");
-    }
-    // Set iv length.
-    if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, 16, NULL)) {
-        handleError("Context Control Error !!!");
-    }
-    if(EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv) != 1) {
-        handleError("Key & IV Init Error !!!");
+    if(EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv ? iv : gcm_zero_iv) != 1) {
+        handleError("IV Init Error !!!");
     } 
     if(EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_len) !=1 ) {
         handleError("Aad Addtion Error !!!");
@@ -156,9 +282,6 @@ int decrypt_epc(unsigned char *ciphertext, int ciphertext_len, unsigned char *aa
     */
     ret = EVP_DecryptFinal_ex(ctx, plaintext + len, &len);
 
-    // clean up
-    EVP_CIPHER_CTX_free(ctx);
-
     if(ret > 0) { //Decrypt Success 
         plaintext_len += len;
         return plaintext_len;
@@ -225,16 +348,6 @@ void is_reserved_zero(void *addr, uint32_t bytes, CPUX86State *env)
     }
 }
 
-static
-bool is_enclave_initialized(void)
-{
-    // Intercepting Memory access only if ECREATE has been invoked
-    if (enclave_init) {
-        return true;
-    }
-    return false;
-}
-
 // Check if mem_addr is within the current enclave
 static
 bool is_within_enclave(CPUX86State *env, uint64_t mem_addr)
@@ -293,7 +406,7 @@ bool is_within_same_epc(void *target_addr1, void *target_addr2, CPUX86State *env
   
     start_addr = EPC_BaseAddr; 
     end_addr = EPC_BaseAddr + PAGE_SIZE;
-    for (i = 0 ; i < NUM_EPC; i++) {
+    for (i = 0 ; i < num_epc; i++) {
        if( target_index1 && target_index2) //found two indices. 
            break;
        if((!target_index1) && (target_addr1 > start_addr) && (target_addr1 < end_addr)) {
@@ -434,15 +547,15 @@ void epcm_field_check(epcm_entry_t *epcm_entry, uint64_t enclave_addr,
 static
 void set_ssa_base(void)
 {
-    enclave_ssa_base = NUM_EPC;
+    enclave_ssa_base = num_epc;
 }
 
 // Update the SSA Base
 static
 void update_ssa_base(void)
 {
-    enclave_ssa_base = (enclave_ssa_base < NUM_EPC) ?
-                       enclave_ssa_base + 1 : NUM_EPC;
+    enclave_ssa_base = (enclave_ssa_base < num_epc) ?
+                       enclave_ssa_base + 1 : num_epc;
 }
 
 static
@@ -645,17 +758,8 @@ uint16_t epcm_search(void *addr, CPUX86State *env)
     assert(addr);
     assert(env);
 
-    uint16_t i;
-    int16_t index = -1;
-
-    for (i = 0; i < NUM_EPC; i ++) {
-        // Can be in between page addresses. for example: EEXTEND : 256 chunks && EWB : Version Array (VA)
-        if ((epcm[i].epcPageAddress <= (uint64_t)addr)
-                && ((uint64_t)addr < epcm[i].epcPageAddress + PAGE_SIZE)) {
-            index = i;
-            break;
-        }
-    }
+    // Can be in between page addresses. for example: EEXTEND : 256 chunks && EWB : Version Array (VA)
+    int index = epcm_index_lookup((uint64_t)addr);
 
     if (index == -1) {
         sgx_msg(warn, "Fail to get epcm index addr: %lx");
@@ -681,6 +785,8 @@ void set_epcm_entry(epcm_entry_t *epcm_entry, bool valid, bool read, bool write,
     epcm_entry->page_type    = pt;
     epcm_entry->enclave_secs = secs;
     epcm_entry->enclave_addr = addr;
+    epcm_entry->accessed     = 0;
+    epcm_entry->evicted      = 0;
 }
 
 static
@@ -1052,7 +1158,7 @@ static
 uint64_t addressMapping(CPUX86State *env, void *addr)
 {
     uint8_t i;
-    for (i = 0; i < NUM_EPC; i ++) {
+    for (i = 0; i < num_epc; i ++) {
         // Can be in between page addresses. for example: EEXTEND : 256 chunks
         if (epcm[i].appAddress == (uint64_t)addr) {
             return epcm[i].enclave_addr;
@@ -1070,95 +1176,190 @@ static void abortAccess(CPUX86State *env) {
 }
 */
 
+// EPCM permission cache, one per vcpu. Only valid pages are cached, so
+// leaves that make a page valid (EADD, EAUG, ELDB) cannot leave stale
+// entries behind; leaves that change or drop the attributes of a valid
+// page flush it.
+#define SGX_PERM_CACHED (1 << 0)
+#define SGX_PERM_R      (1 << 1)
+#define SGX_PERM_W      (1 << 2)
+#define SGX_PERM_X      (1 << 3)
+#define SGX_PERM_ABSENT (1 << 4)        //!< evicted or never added, not cached
+
+static
+void sgx_perm_cache_flush(CPUX86State *env)
+{
+    memset(env->sgx_perm_cache, 0, sizeof(env->sgx_perm_cache));
+}
+
+// The EPCM is shared by all vcpus
+static
+void sgx_perm_cache_flush_all(void)
+{
+    CPUState *cs;
+    CPU_FOREACH(cs) {
+        sgx_perm_cache_flush(&X86_CPU(cs)->env);
+    }
+}
+
+static
+uint32_t sgx_perm_lookup(CPUX86State *env, uint64_t mem_addr)
+{
+    target_ulong page = mem_addr & ~((target_ulong)PAGE_SIZE - 1);
+    SGXPermCacheEntry *ent;
+    epcm_entry_t *entry;
+    uint32_t perms;
+
+    ent = &env->sgx_perm_cache[(page / PAGE_SIZE) & (SGX_PERM_CACHE_SIZE - 1)];
+    if (ent->perms && ent->page == page)
+        return ent->perms;
+
+    entry = &epcm[epcm_search((void *)mem_addr, env)];
+    if (!entry->valid)
+        return SGX_PERM_ABSENT;
+
+    perms = SGX_PERM_CACHED
+          | (entry->read    ? SGX_PERM_R : 0)
+          | (entry->write   ? SGX_PERM_W : 0)
+          | (entry->execute ? SGX_PERM_X : 0);
+    if (entry->valid) {
+        // Misses are the only accesses ENCLS_OSGX_EPC_AGE can see, so it
+        // flushes the caches after clearing the bits
+        entry->accessed = 1;
+        ent->page  = page;
+        ent->perms = perms;
+    }
+    return perms;
+}
+
+// Enclave access to a page that is not in the EPCM, either written back
+// by EWB or not added yet (lazily provisioned stack and heap): #PF on
+// the faulting instruction, which the SGX kernel's SIGSEGV handler
+// services with ELDU or EAUG before the access is restarted. linux-user
+// has no AEX path to the kernel, so the enclave state is left untouched.
+static QEMU_NORETURN
+void sgx_epc_page_fault(CPUX86State *env, uint64_t addr, int error_code,
+                        uintptr_t retaddr)
+{
+    sgx_dbg(trace, "EPC page %p is not resident", (void *)addr);
+
+    cpu_restore_state(CPU(x86_env_get_cpu(env)), retaddr);
+    env->cr[2] = addr;
+    raise_exception_err(env, EXCP0E_PAGE, error_code | PG_ERROR_U_MASK);
+}
+
+// The emulator reads and writes some ENCLU operands on the enclave's
+// behalf, bypassing helper_mem_access(). Fault before touching them.
+static
+void sgx_check_resident(CPUX86State *env, uint64_t addr, size_t len,
+                        int error_code, uintptr_t retaddr)
+{
+    uint64_t page;
+
+    if (!len)
+        return;
+    for (page = addr & ~((uint64_t)PAGE_SIZE - 1); page < addr + len;
+         page += PAGE_SIZE) {
+        if (is_within_epc(page)
+            && (sgx_perm_lookup(env, page) & SGX_PERM_ABSENT)) {
+            sgx_epc_page_fault(env, page, error_code, retaddr);
+        }
+    }
+}
+
+// The helpers below are only called from enclave-mode TBs (HF_SGX_MASK):
+// the translated code has already checked the address against the
+// active ELRANGE (see gen_sgx_mem_access()).
+
+// Enclave fetch inside its ELRANGE
 void helper_mem_execute(CPUX86State *env, target_ulong a0)
 {
-    int epcm_index = 0;
     uint64_t mem_addr = (uint64_t)a0;
-    sgx_dbg(mtrace, "Executing memory (enclave:%d): %p",
-            (int)env->cregs.CR_ENCLAVE_MODE, (void *)mem_addr);
-
-    if (env->cregs.CR_ENCLAVE_MODE) {
-        if (is_within_epc(mem_addr)){
-            sgx_dbg(trace, "Executing memory in EPC (enclave:%d): %p",
-                 (int)env->cregs.CR_ENCLAVE_MODE, (void *)mem_addr); //temporary
-            epcm_index = epcm_search((void *)mem_addr, env);
-            if(!is_within_enclave(env, mem_addr)) {
-                sgx_dbg(trace, "Mode EINIT Range: Executed %lX", mem_addr);
-                sgx_msg(trace, "Inside Enclave. Executing Incorrect enclave memory");
-                raise_exception(env, EXCP0D_GPF);
-            }
-            else if((epcm[epcm_index].execute) == 0){
-                sgx_dbg(trace, "EPCM execute property is violated at %p", mem_addr);
-                raise_exception(env, EXCP0D_GPF);
-            }
-        }
+    uint32_t perms;
+
+    sgx_dbg(mtrace, "Executing memory (enclave): %p", (void *)mem_addr);
+
+    // ELRANGE is rounded up to a power of two and may extend past the EPC
+    if (!is_within_epc(mem_addr))
+        return;
+
+    perms = sgx_perm_lookup(env, mem_addr);
+    if (perms & SGX_PERM_ABSENT) {
+        sgx_epc_page_fault(env, mem_addr, PG_ERROR_I_D_MASK, GETPC());
+    }
+    if (!(perms & SGX_PERM_X)) {
+        sgx_dbg(trace, "EPCM execute property is violated at %p", mem_addr);
+        raise_exception(env, EXCP0D_GPF);
     }
+    sgx_mtrace_access(env, MTRACE_EXEC, mem_addr);
 }
 
-// helper test
+// Enclave access inside its ELRANGE
 void helper_mem_access(CPUX86State *env, target_ulong a0, int operation)
 {
     int ld_ = 0;
     int st_ = 1;
-    int epcm_index = 0;
-
-    // Do not add overheads prior to any enclave initiation process
-    if (!is_enclave_initialized())
-        return;
+    uint32_t perms;
 
     // FIXME:For EPC access, cpu_ldq_data doesn't seem to work correctly
     uint64_t mem_addr = (uint64_t)a0;
-    //printf("memory access: %x\n", mem_addr);
-
-    sgx_dbg(mtrace, "Accessing memory (enclave:%d): %p",
-            (int)env->cregs.CR_ENCLAVE_MODE, (void *)mem_addr);
-
-    // Non-enclave mode access
-    //  - no access to EPC pages
-    // Enclave mode access
-    //  - not allow to access other enclaves
-    // CCH: plan to add the case when an enclave access area outside EPC or shared memory
-    if (env->cregs.CR_ENCLAVE_MODE) {
-        if (is_within_epc(mem_addr)){
-            epcm_index = epcm_search((void *)mem_addr, env);
-            if(!is_within_enclave(env, mem_addr)) {
-                sgx_dbg(trace, "Mode EINIT Range: Accessed %lX %lX", a0, mem_addr);
-                sgx_msg(trace, "Inside Enclave. Accessing Incorrect enclave memory");
-                raise_exception(env, EXCP0D_GPF);
-            }
-            else if((operation == ld_) && (epcm[epcm_index].read) == 0){
-                sgx_dbg(trace, "EPCM read property is violated at %p", mem_addr);
-                //raise_exception(env, EXCP0D_GPF);  // blocked temporarily just for reaching the end of epcm rwx test
-            }
-            else if((operation == st_) && (epcm[epcm_index].write) == 0){
-                sgx_dbg(trace, "EPCM write property is violated at %p", mem_addr);
-                //raise_exception(env, EXCP0D_GPF);  // blocked temporarily just for reaching the end of epcm rwx test
-            }
-        }
-    } else {
-        if (is_within_epc(mem_addr) || (mem_addr == (uint64_t)epcm) ||
-           (mem_addr == (uint64_t)process_priv_key) ||
-           (mem_addr == (uint64_t)process_pub_key)) {
-            /*if (checkEnclaveState()) {
-                setEnclaveState(false);
-                printf("Update entry: %lx \n", mem_addr);
-                updateEntry(mem_addr);
-                return;
-            }*/
-
-	    /*
-            //if((checkEPCBaseAddr(mem_addr)) ||
-            if (((checkLastFuncEntries(mem_addr)) ||
-               checkSpecificFunction(mem_addr))) {
-                return;
-            }
-	    */
-            sgx_dbg(trace, "!Mode EINIT Range: Accessed %lX ", mem_addr);
-            //raise_exception(env, EXCP0D_GPF);
-        }
+
+    sgx_dbg(mtrace, "Accessing memory (enclave): %p", (void *)mem_addr);
+
+    if (!is_within_epc(mem_addr))
+        return;
+
+    perms = sgx_perm_lookup(env, mem_addr);
+    if (perms & SGX_PERM_ABSENT) {
+        sgx_epc_page_fault(env, mem_addr,
+                           (operation == st_) ? PG_ERROR_W_MASK : 0, GETPC());
+    }
+    sgx_mtrace_access(env, (operation == st_) ? MTRACE_WRITE : MTRACE_READ,
+                      mem_addr);
+    if ((operation == ld_) && !(perms & SGX_PERM_R)) {
+        sgx_dbg(trace, "EPCM read property is violated at %p", mem_addr);
+        //raise_exception(env, EXCP0D_GPF);  // blocked temporarily just for reaching the end of epcm rwx test
+    } else if ((operation == st_) && !(perms & SGX_PERM_W)) {
+        sgx_dbg(trace, "EPCM write property is violated at %p", mem_addr);
+        //raise_exception(env, EXCP0D_GPF);  // blocked temporarily just for reaching the end of epcm rwx test
     }
 }
 
+// Enclave access or fetch to an EPC page outside its ELRANGE
+void helper_sgx_range_fault(CPUX86State *env, target_ulong a0)
+{
+    sgx_dbg(trace, "Mode EINIT Range: Accessed %lX", a0);
+    sgx_msg(trace, "Inside Enclave. Accessing Incorrect enclave memory");
+    raise_exception(env, EXCP0D_GPF);
+}
+
+// Drop the TLB entries that may map enclave memory (the ELRANGE of
+// 'secs' and the EPC) instead of the whole TLB on every enclave
+// transition. Returns the number of entries invalidated; always 0 in
+// linux-user, which has no softmmu TLB.
+static
+int sgx_tlb_flush_enclave(CPUX86State *env, secs_t *secs)
+{
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    int n;
+
+    n  = tlb_flush_range(cs, secs->baseAddr, secs->baseAddr + secs->size);
+    n += tlb_flush_range(cs, EPC_BaseAddr + 1, EPC_EndAddr);
+    return n;
+}
+
+// CR_ENCLAVE_MODE is mirrored in hflags so that translated blocks are
+// specialised per mode. Callers end the TB (ENCLU is translated as a jump).
+static
+void set_enclave_mode(CPUX86State *env, bool mode)
+{
+    env->cregs.CR_ENCLAVE_MODE = mode;
+    if (mode)
+        env->hflags |= HF_SGX_MASK;
+    else
+        env->hflags &= ~HF_SGX_MASK;
+}
+
 // Get SECS of enclave based on epcm of EPC page
 static
 secs_t* get_secs_address(epcm_entry_t *cur_epcm)
@@ -1324,9 +1525,9 @@ void sgx_eaccept(CPUX86State *env)
     // If tmp_secs does not resolve within an EPC, then GP(0).
     check_within_epc(destPage, env);
 
-    //TODO: PT_TRIM needs to be added
     if (!(((scratch_secinfo.flags.page_type == PT_REG) && (scratch_secinfo.flags.modified == 0)) ||
-        ((scratch_secinfo.flags.page_type == PT_TCS) && (scratch_secinfo.flags.pending == 0) && (scratch_secinfo.flags.modified == 1)) )){
+        ((scratch_secinfo.flags.page_type == PT_TCS) && (scratch_secinfo.flags.pending == 0) && (scratch_secinfo.flags.modified == 1)) ||
+        ((scratch_secinfo.flags.page_type == PT_TRIM) && (scratch_secinfo.flags.pending == 0) && (scratch_secinfo.flags.modified == 1)) )){
         sgx_msg(warn, "there is something wrong in scratch_secinfo");
         raise_exception(env, EXCP0D_GPF);
     }
@@ -1334,9 +1535,9 @@ void sgx_eaccept(CPUX86State *env)
     uint16_t index_page = epcm_search(destPage, env);
     epcm_entry_t *epcm_dest = &epcm[index_page];
 
-    // TODO: PT_TRIM needs to be added
     if ((epcm_dest->valid == 0) || (epcm_dest->blocked != 0) ||
-            ((epcm_dest->page_type != PT_REG) && (epcm_dest->page_type != PT_TCS)) ||
+            ((epcm_dest->page_type != PT_REG) && (epcm_dest->page_type != PT_TCS) &&
+             (epcm_dest->page_type != PT_TRIM)) ||
             (epcm_dest->enclave_secs != env->cregs.CR_ACTIVE_SECS) ){
         sgx_msg(warn, "there is something wrong in destPage");
         raise_exception(env, EXCP0D_GPF);
@@ -1410,6 +1611,7 @@ Done:
     eid = tmp_secs->eid_reserved.eid_pad.eid;
     qenclaves[eid].stat.eaccept_n++;
     qenclaves[eid].stat.enclu_n++;
+    perf_eid = eid;
 #endif
 }
 
@@ -1814,7 +2016,7 @@ void sgx_eenter(CPUX86State *env)
            raise_exception(env, EXCP0D_GPF);
     */
     curr_Eid = tmp_secs->eid_reserved.eid_pad.eid;
-    env->cregs.CR_ENCLAVE_MODE = true;
+    set_enclave_mode(env, true);
     env->cregs.CR_ACTIVE_SECS = (uint64_t)tmp_secs;
     env->cregs.CR_ELRANGE[0] = tmp_secs->baseAddr;
     env->cregs.CR_ELRANGE[1] = tmp_secs->size;
@@ -1946,14 +2148,15 @@ void sgx_eenter(CPUX86State *env)
     // Added for QEMU TB flow while operating in enclave mode
     env->cregs.CR_ENC_INSN_RET = true;
 
-    CPUState *cs = CPU(x86_env_get_cpu(env));
-    tlb_flush(cs, 1);
+    int flushed = sgx_tlb_flush_enclave(env, tmp_secs);
 
 #if PERF
     qenclaves[eid].stat.mode_switch++;
-    qenclaves[eid].stat.tlbflush_n++;
+    qenclaves[eid].stat.tlbflush_n += flushed;
     qenclaves[eid].stat.eenter_n++;
     qenclaves[eid].stat.enclu_n++;
+    perf_eid = eid;
+    perf_switch(env, eid, true);
 #endif
     return;
 }
@@ -2071,8 +2274,9 @@ void sgx_eexit(CPUX86State *env)
 
     //update_ssa_base();
 
-    env->cregs.CR_ENCLAVE_MODE = false;
+    set_enclave_mode(env, false);
     env->cregs.CR_EXIT_MODE = true;
+    sgx_perm_cache_flush(env);
 //    setEnclaveAccess(false);
 
     // Used for tracking function end
@@ -2081,15 +2285,16 @@ void sgx_eexit(CPUX86State *env)
     // setEnclaveState(true);
     // Mark State inactive
 
-    CPUState *cs = CPU(x86_env_get_cpu(env));
-    tlb_flush(cs, 1);
+    int flushed = sgx_tlb_flush_enclave(env, secs);
 #if PERF
     int64_t eid;
     eid = secs->eid_reserved.eid_pad.eid;
     qenclaves[eid].stat.mode_switch++;
-    qenclaves[eid].stat.tlbflush_n++;
+    qenclaves[eid].stat.tlbflush_n += flushed;
     qenclaves[eid].stat.eexit_n++;
     qenclaves[eid].stat.enclu_n++;
+    perf_eid = eid;
+    perf_switch(env, eid, false);
 #endif
 }
 
@@ -2403,6 +2608,7 @@ _EXIT:
     eid = tmp_currentsecs->eid_reserved.eid_pad.eid;
     qenclaves[eid].stat.egetkey_n++;
     qenclaves[eid].stat.enclu_n++;
+    perf_eid = eid;
 #endif
 }
 
@@ -2472,6 +2678,7 @@ void sgx_emodpe(CPUX86State *env)
     epcm[epc_index].read |= scratch_secinfo.flags.r;
     epcm[epc_index].write |= scratch_secinfo.flags.w;
     epcm[epc_index].execute |= scratch_secinfo.flags.x;
+    sgx_perm_cache_flush_all();
 
 }
 
@@ -2597,6 +2804,7 @@ void sgx_ereport(CPUX86State *env)
     eid = tmp_currentsecs->eid_reserved.eid_pad.eid;
     qenclaves[eid].stat.ereport_n++;
     qenclaves[eid].stat.enclu_n++;
+    perf_eid = eid;
 #endif
 }
 
@@ -2882,7 +3090,7 @@ void sgx_eresume(CPUX86State *env)
         is_canonical((uint64_t)(void*)tmp_gsbase, env);
     }
 
-    env->cregs.CR_ENCLAVE_MODE = true;
+    set_enclave_mode(env, true);
     env->cregs.CR_ACTIVE_SECS = (uint64_t)tmp_secs;
     env->cregs.CR_ELRANGE[0] = tmp_secs->baseAddr;
     env->cregs.CR_ELRANGE[1] = tmp_secs->size;
@@ -2991,13 +3199,14 @@ void sgx_eresume(CPUX86State *env)
     // Considering QEMU TB flow for conditional statements
     env->cregs.CR_ENC_INSN_RET = true;
 
-    CPUState *cs = CPU(x86_env_get_cpu(env));
-    tlb_flush(cs, 1);
+    int flushed = sgx_tlb_flush_enclave(env, tmp_secs);
 #if PERF
     qenclaves[eid].stat.mode_switch++;
-    qenclaves[eid].stat.tlbflush_n++;
+    qenclaves[eid].stat.tlbflush_n += flushed;
     qenclaves[eid].stat.eresume_n++;
     qenclaves[eid].stat.enclu_n++;
+    perf_eid = eid;
+    perf_switch(env, eid, true);
 #endif
     return;
 }
@@ -3019,6 +3228,11 @@ const char *enclu_cmd_to_str(long cmd) {
 
 void helper_sgx_enclu(CPUX86State *env, uint64_t next_eip)
 {
+#if PERF
+    uint64_t leaf = env->regs[R_EAX];
+    uint64_t beg = perf_leaf_begin(env, false);
+#endif
+
     sgx_dbg(ttrace,
             "(%-13s), EBX=0x%08"PRIx64", "
             "RCX=0x%08"PRIx64", RDX=0x%08"PRIx64,
@@ -3026,6 +3240,21 @@ void helper_sgx_enclu(CPUX86State *env, uint64_t next_eip)
             env->regs[R_EBX],
             env->regs[R_ECX],
             env->regs[R_EDX]);
+
+    // Operands that the leaves access directly must be resident
+    if (env->regs[R_EAX] == ENCLU_EGETKEY) {
+        sgx_check_resident(env, env->regs[R_EBX], sizeof(keyrequest_t),
+                           0, GETPC());
+        sgx_check_resident(env, env->regs[R_ECX], 16,
+                           PG_ERROR_W_MASK, GETPC());
+    } else if (env->regs[R_EAX] == ENCLU_EREPORT) {
+        sgx_check_resident(env, env->regs[R_EBX], sizeof(targetinfo_t),
+                           0, GETPC());
+        sgx_check_resident(env, env->regs[R_ECX], 64, 0, GETPC());
+        sgx_check_resident(env, env->regs[R_EDX], sizeof(report_t),
+                           PG_ERROR_W_MASK, GETPC());
+    }
+
     switch (env->regs[R_EAX]) {
         case ENCLU_EACCEPT:
             env->cregs.CR_NEXT_EIP = next_eip;
@@ -3072,6 +3301,9 @@ void helper_sgx_enclu(CPUX86State *env, uint64_t next_eip)
         default:
             sgx_err("not implemented yet");
     }
+#if PERF
+    perf_leaf_end(env, false, leaf, beg);
+#endif
 }
 
 // ENCLS instruction implementation.
@@ -3142,6 +3374,14 @@ void *cpu_load_pi_linaddr(CPUX86State *env, pageinfo_t *pi)
     return (void *)cpu_ldq_data(env, addr);
 }
 
+// Running measurement of the enclave whose SECS is given; SECS.MRENCLAVE
+// is its exported copy.
+static inline
+measure_t *secs_measure(secs_t *secs)
+{
+    return &qmeasures[secs->eid_reserved.eid_pad.eid];
+}
+
 // ECREATE is the first instruction in the enclave build process.
 // In ECREATE, an SECS structure (PAGEINFO.SRCPGE) outside the epc is copied
 // into an EPC page (with page type = SECS).
@@ -3310,10 +3550,18 @@ void sgx_ecreate(CPUX86State *env)
     }
 */
 
-    // Set SECS.EID : starts from 0
+    // Set SECS.EID : starts from 0, indexes qenclaves[]
+    if (env->cregs.CR_NEXT_EID >= (uint64_t)num_qenclaves) {
+        sgx_err("out of enclave descriptors (%d), raise -epc-pages",
+                num_qenclaves);
+        raise_exception(env, EXCP0D_GPF);
+    }
     tmp_secs->eid_reserved.eid_pad.eid = env->cregs.CR_NEXT_EID;
     LockedXAdd(&(env->cregs.CR_NEXT_EID), 1);
 
+    // EADD/EEXTEND continue the measurement from here
+    measure_import(secs_measure(tmp_secs), tmp_secs->mrEnclave);
+
     // Update EPCM of EPC page
     set_epcm_entry(&epcm[index_secs], 1, 0, 0, 0, 0, PT_SECS, 0, 0);
 
@@ -3322,6 +3570,7 @@ void sgx_ecreate(CPUX86State *env)
     eid = tmp_secs->eid_reserved.eid_pad.eid;
     qenclaves[eid].stat.ecreate_n++;
     qenclaves[eid].stat.encls_n++;
+    perf_eid = eid;
 #endif
 }
 
@@ -3532,7 +3781,8 @@ void sgx_eadd(CPUX86State *env)
     tmpUpdateField[0] = 0x0000000044444145;
     memcpy(&tmpUpdateField[1], &tmp_enclaveoffset, 8);
     memcpy(&tmpUpdateField[2], &scratch_secinfo, 48);
-    sha256update((unsigned char *)tmpUpdateField, tmp_secs->mrEnclave);
+    measure_update(secs_measure(tmp_secs), tmpUpdateField, 1);
+    measure_export(secs_measure(tmp_secs), tmp_secs->mrEnclave);
 
     // INC enclave's MRENCLAVE update counter
     tmp_secs->mrEnclaveUpdateCounter++;
@@ -3570,6 +3820,7 @@ void sgx_eadd(CPUX86State *env)
     eid = tmp_secs->eid_reserved.eid_pad.eid;
     qenclaves[eid].stat.eadd_n++;
     qenclaves[eid].stat.encls_n++;
+    perf_eid = eid;
 #endif
 }
 
@@ -3950,6 +4201,7 @@ _EXIT:
     eid = secs->eid_reserved.eid_pad.eid;
     qenclaves[eid].stat.einit_n++;
     qenclaves[eid].stat.encls_n++;
+    perf_eid = eid;
 #endif
 }
 
@@ -3962,12 +4214,12 @@ void sgx_eldb(CPUX86State *env)
     //RDX: VA  slot addr(In)
     //EAX: Error code(Out)
     epc_t* tmp_srcpge;
-    epc_t  ciphertext;
+    epc_t  plaintext;
     secs_t* tmp_secs;
     pcmd_t* tmp_pcmd;
     mac_header_t tmp_header;
     uint64_t tmp_ver;
-    uint64_t tmp_mac[2];
+    uint64_t tmp_iv[2];
     uint64_t epc_index, va_index, secs_index;
 
     if(!is_aligned(env->regs[R_EBX], 32) || !is_aligned(env->regs[R_ECX], PAGE_SIZE)) {
@@ -4010,7 +4262,7 @@ void sgx_eldb(CPUX86State *env)
         }
         check_within_epc((void *)tmp_secs, env);
         secs_index = epcm_search(tmp_secs, env);
-        if(epcm[secs_index].valid == 0 || epcm[secs_index].page_type == PT_SECS) {
+        if(epcm[secs_index].valid == 0 || epcm[secs_index].page_type != PT_SECS) {
             raise_exception(env, EXCP0D_GPF);
         }
     }
@@ -4029,34 +4281,42 @@ void sgx_eldb(CPUX86State *env)
     else {
         tmp_header.eid = 0;
     }
-    memcpy(ciphertext, tmp_srcpge, PAGE_SIZE);
-    tmp_ver = env->regs[R_EDX];
-    
-    decrypt_epc(ciphertext, PAGE_SIZE, (unsigned char *)&tmp_header, sizeof(tmp_header),
-                (unsigned char *)tmp_mac, gcm_key, NULL, (unsigned char *)env->regs[R_ECX]); 
-
-    if(!memcmp(tmp_mac, tmp_pcmd->mac, 16)) {
+    // The version EWB left in the VA slot is the GCM IV, so a stale copy
+    // of the page fails to authenticate
+    tmp_ver = *(uint64_t *)env->regs[R_EDX];
+    tmp_iv[0] = tmp_ver;
+    tmp_iv[1] = 0;
+
+    // Decrypt aside: the EPC page is only written once the MAC matches
+    if(tmp_ver == 0 ||
+       decrypt_epc(get_page_crypto(env, gcm_key)->dec,
+                   (unsigned char *)tmp_srcpge, PAGE_SIZE,
+                   (unsigned char *)&tmp_header, sizeof(tmp_header),
+                   (unsigned char *)tmp_pcmd->mac,
+                   (unsigned char *)tmp_iv, plaintext) < 0) {
         env->regs[R_EAX] = ERR_SGX_MAC_COMPARE_FAIL;
+        env->eflags |= CC_Z;
         goto ERROR_EXIT;
     }
-    if(env->regs[R_EDX] != 0) { //XXX ? 
-        raise_exception(env, EXCP0D_GPF);
-    }
-    else {
-        env->regs[R_EDX] = tmp_ver;
-    }
-    epcm[epc_index].page_type = tmp_header.secinfo.flags.page_type;
-    epcm[epc_index].read    = tmp_header.secinfo.flags.r;
-    epcm[epc_index].write   = tmp_header.secinfo.flags.w;
-    epcm[epc_index].execute = tmp_header.secinfo.flags.x;
-    epcm[epc_index].enclave_addr = tmp_header.linaddr;
+    memcpy((void *)env->regs[R_ECX], plaintext, PAGE_SIZE);
 
-    if(env->regs[R_EAX] == 0x07) 
-        epcm[epc_index].blocked = 1;
-    else
-        epcm[epc_index].blocked = 0;
+    // Free the VA slot
+    *(uint64_t *)env->regs[R_EDX] = 0;
+
+    set_epcm_entry(&epcm[epc_index], 1,
+                   tmp_header.secinfo.flags.r,
+                   tmp_header.secinfo.flags.w,
+                   tmp_header.secinfo.flags.x,
+                   env->regs[R_EAX] == ENCLS_ELDB,
+                   tmp_header.secinfo.flags.page_type,
+                   (uint64_t)tmp_secs, tmp_header.linaddr);
+
+    if (tmp_header.secinfo.flags.page_type == PT_REG ||
+        tmp_header.secinfo.flags.page_type == PT_TCS) {
+        sgx_mtrace_page(env, MTRACE_RELOAD, tmp_header.linaddr, epc_index,
+                        tmp_header.eid);
+    }
 
-    epcm[epc_index].valid = 1;
     env->regs[R_EAX] = 0;
     env->eflags &= ~(CC_Z);
 
@@ -4064,10 +4324,46 @@ void sgx_eldb(CPUX86State *env)
         env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S);
 }
 
-/*
-static void sgx_eremove(CPUX86State *env)
+// Any valid page still belonging to the enclave of this SECS
+static
+bool eremove_secs_has_child(uint64_t secs)
+{
+    int i;
+
+    for (i = 0; i < num_epc; i++) {
+        if (epcm[i].valid && epcm[i].page_type != PT_SECS
+            && epcm[i].enclave_secs == secs) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Any vcpu (guest thread) running inside the enclave of this SECS
+static
+bool eremove_enclave_active(uint64_t secs)
+{
+    CPUState *cs;
+
+    CPU_FOREACH(cs) {
+        CPUX86State *cenv = &X86_CPU(cs)->env;
+
+        if (cenv->cregs.CR_ENCLAVE_MODE
+            && cenv->cregs.CR_ACTIVE_SECS == secs) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// EREMOVE instruction
+static
+void sgx_eremove(CPUX86State *env)
 {
+    // RCX: EPC Addr(In, EA)
+    // EAX: Error Code(Out)
     epc_t *tmp_epcpage = (epc_t *)env->regs[R_ECX];
+    epcm_entry_t *entry;
 
     // If RCX is not 4KB Aligned, then GP(0)
     if (!is_aligned((void *)tmp_epcpage, PAGE_SIZE)) {
@@ -4082,36 +4378,41 @@ static void sgx_eremove(CPUX86State *env)
     // TODO : Check the EPC page for concurrency
 
     // If RCX is already unused, nothing to do
-    uint8_t index_page = epcm_search((void *)tmp_epcpage, env);
-
-    if (epcm[index_page].valid == 0) {
+    entry = &epcm[epcm_search((void *)tmp_epcpage, env)];
+    if (entry->valid == 0) {
         goto _DONE;
     }
 
-    if (epcm[index_page].page_type == PT_VA) {
-        epcm[index_page].valid = 0;
-        goto _DONE;
-    }
-
-    if (epcm[index_page].page_type == PT_SECS) {
-        // TODO : RCX has an EPC page associated with it check
-        epcm[index_page].valid = 0;
-        goto _DONE;
+    // If RCX is a SECS with pages still associated with it, or a page of
+    // an enclave that some thread is executing in, then fail
+    if (entry->page_type == PT_SECS) {
+        if (eremove_secs_has_child((uint64_t)tmp_epcpage)) {
+            env->eflags |= CC_Z;
+            env->regs[R_EAX] = ERR_SGX_CHILD_PRESENT;
+            goto _ERROR;
+        }
+    } else if (eremove_enclave_active(entry->enclave_secs)) {
+        env->eflags |= CC_Z;
+        env->regs[R_EAX] = ERR_SGX_ENCLAVE_ACT;
+        goto _ERROR;
     }
 
-    // secs_t *tmp_secs = get_secs_address(&epcm[index_page]);
+    entry->valid = 0;
+    entry->evicted = 0;
+    sgx_perm_cache_flush_all();
 
-    // TODO : If other threads active using SECS
+    // Scrub the page and let the host reclaim the memory
+    memset(tmp_epcpage, 0, PAGE_SIZE);
+    qemu_madvise((void *)tmp_epcpage, PAGE_SIZE, QEMU_MADV_DONTNEED);
 
 _DONE:
     env->regs[R_EAX] = 0;
     env->eflags &= ~CC_Z;
 
-//_ERROR_EXIT:
+_ERROR:
     // clear flags : CF, PF, AF, OF, SF
     env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S);
 }
-*/
 
 // In EEXTEND, security measurement (SECS.MRENCLAVE) is updated for every
 // page chunk (256 Bytes).
@@ -4163,7 +4464,7 @@ void sgx_eextend(CPUX86State *env)
     memset(&tmpUpdateField[2], 0, 48);
 
     // Update MRENCLAVE hash value
-    sha256update((unsigned char *)tmpUpdateField, tmp_secs->mrEnclave);
+    measure_update(secs_measure(tmp_secs), tmpUpdateField, 1);
 
     // Increase MRENCLAVE update counter
     tmp_secs->mrEnclaveUpdateCounter++;
@@ -4181,10 +4482,8 @@ void sgx_eextend(CPUX86State *env)
 */
 
     // Add 256 bytes to MRENCLAVE, 64 byte at a time
-    sha256update((unsigned char *)(&target_addr[0]), tmp_secs->mrEnclave);
-    sha256update((unsigned char *)(&target_addr[8]), tmp_secs->mrEnclave);
-    sha256update((unsigned char *)(&target_addr[16]), tmp_secs->mrEnclave);
-    sha256update((unsigned char *)(&target_addr[24]), tmp_secs->mrEnclave);
+    measure_update(secs_measure(tmp_secs), target_addr, 4);
+    measure_export(secs_measure(tmp_secs), tmp_secs->mrEnclave);
 
     // Increase enclaves's MRENCLAVE update counter by 4
     tmp_secs->mrEnclaveUpdateCounter += 4;
@@ -4205,6 +4504,7 @@ void sgx_eextend(CPUX86State *env)
     eid = tmp_secs->eid_reserved.eid_pad.eid;
     qenclaves[eid].stat.eextend_n++;
     qenclaves[eid].stat.encls_n++;
+    perf_eid = eid;
 #endif
 }
 
@@ -4314,6 +4614,7 @@ void sgx_eaug(CPUX86State *env)
 #if PERF
     qenclaves[eid].stat.eaug_n++;
     qenclaves[eid].stat.encls_n++;
+    perf_eid = eid;
 #endif
 }
 
@@ -4368,6 +4669,7 @@ void sgx_emodpr(CPUX86State *env)
     epcm[page_index].read &= scratch_secinfo.flags.r;
     epcm[page_index].write &= scratch_secinfo.flags.w;
     epcm[page_index].execute &= scratch_secinfo.flags.x;
+    sgx_perm_cache_flush_all();
     
     env->eflags &= ~(CC_Z);
     env->regs[R_EAX] = 0;
@@ -4429,6 +4731,7 @@ void sgx_eblock(CPUX86State *env)
     }
     else {
         epcm[epcm_index].blocked = 1;
+        sgx_perm_cache_flush_all();
     }
    
 
@@ -4449,16 +4752,14 @@ b. EMODT may only be called on VALID pages
 static
 void sgx_emodt(CPUX86State *env)
 {
-    
     // RBX: SECINFO addr(In, EA)
     // RCX: EPC Addr(In, EA)
     // EAX: Error Code(Out)
     secs_t *tmp_secs;
     secinfo_t scratch_secinfo;
-    uint64_t *tmp_secinfo = env->regs[R_EBX];
-    uint64_t *target_addr = (uint64_t *)env->regs[R_ECX];
-    uint16_t epcm_index = 0;
-
+    secinfo_t *tmp_secinfo = (secinfo_t *)env->regs[R_EBX];
+    epc_t *target_addr = (epc_t *)env->regs[R_ECX];
+    epcm_entry_t *entry;
 
     // If RBX is not 64 Byte aligned, then GP(0).
     if (!is_aligned(tmp_secinfo, SECINFO_ALIGN_SIZE)) {
@@ -4486,46 +4787,40 @@ void sgx_emodt(CPUX86State *env)
     }
 
     // TODO:(* Check concurrency with SGX1 instructions on the EPC page *)
-    
-    epcm_index = epcm_search(target_addr, env);
-    if (epcm[epcm_index].page_type == PT_REG || epcm[epcm_index].page_type == PT_TCS) {
-        raise_exception(env, EXCP0E_PAGE);
-    }
 
-    // (* Check for mis-configured SECINFO flags*)
-    if ((epcm[epcm_index].read == 0) && (scratch_secinfo.flags.r == 0) &&
-        (scratch_secinfo.flags.w != 0)) { 
-        env->eflags = 1;
-        env->regs[R_EAX] = ERR_SGX_PAGE_NOT_MODIFIABLE;
-        goto Done;
+    // Only valid REG pages can change type, TCS pages can only be trimmed
+    entry = &epcm[epcm_search(target_addr, env)];
+    if (!entry->valid ||
+        !(entry->page_type == PT_REG ||
+          (entry->page_type == PT_TCS && scratch_secinfo.flags.page_type == PT_TRIM))) {
+        raise_exception(env, EXCP0E_PAGE);
     }
 
-    if ((epcm[epcm_index].pending != 0)) { // TODO:|| epcm[epcm_index].modified != 0
-        env->eflags = 1;
+    if (entry->pending || entry->modified) {
+        env->eflags |= CC_Z;
         env->regs[R_EAX] = ERR_SGX_PAGE_NOT_MODIFIABLE;
         goto Done;
     }
 
-    tmp_secs = get_secs_address(&epcm[epcm_index]);
-
-    if (tmp_secs->attributes.einittokenkey == 0)
+    tmp_secs = get_secs_address(entry);
+    if (!checkEINIT(tmp_secs->eid_reserved.eid_pad.eid))
         raise_exception(env, EXCP0D_GPF);
 
     //TODO: check concurrency with ETRACK
 
-    //TODO: epcm[epcm_index].modified = 1;
-    epcm[epcm_index].read  = 0;
-    epcm[epcm_index].write = 0;
-    epcm[epcm_index].execute  = 0;
-    epcm[epcm_index].page_type = scratch_secinfo.flags.page_type;
+    // Inaccessible until the enclave EACCEPTs the change
+    entry->modified = 1;
+    entry->read  = 0;
+    entry->write = 0;
+    entry->execute = 0;
+    entry->page_type = scratch_secinfo.flags.page_type;
+    sgx_perm_cache_flush_all();
 
     env->eflags &= ~(CC_Z);
     env->regs[R_EAX] = 0;
-   
 
-    Done: 
-    env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S );
-    
+ Done:
+    env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S);
 }
 
 static
@@ -4550,19 +4845,13 @@ void sgx_epa(CPUX86State *env)
     }
 
     /* Clears EPC page */
-    memset(epc_addr, 0, PAGE_SIZE * 8);
-  
-    epcm[epcm_index].page_type = PT_VA;
-    epcm[epcm_index].enclave_addr = 0;
-    epcm[epcm_index].blocked = 0;
+    memset(epc_addr, 0, PAGE_SIZE);
+
+    set_epcm_entry(&epcm[epcm_index], 1, 0, 0, 0, 0, PT_VA, 0, 0);
     /* Based on Spec ver2--------- */
     epcm[epcm_index].pending = 0;
     epcm[epcm_index].modified = 0;
     /* --------------------------- */
-    epcm[epcm_index].read = 0;
-    epcm[epcm_index].write = 0;
-    epcm[epcm_index].execute = 0;
-    epcm[epcm_index].valid = 0;
 }
 
 static
@@ -4580,6 +4869,7 @@ void sgx_ewb(CPUX86State *env)
     mac_header_t tmp_header; //MAC Header
     memset(&tmp_header, 0, 128);
     uint64_t tmp_ver;
+    uint64_t tmp_iv[2];
 
     if (!(is_aligned(env->regs[R_EBX], 32)) || 
         !(is_aligned(env->regs[R_ECX], PAGE_SIZE))) {
@@ -4651,10 +4941,26 @@ void sgx_ewb(CPUX86State *env)
     tmp_header.secinfo.flags.x = epcm[epc_index].execute;
     // it seems rsvd in the spec indicates reserved field.. but not sure..
     //TMP_HEADER.SECINFO.FLAGS.RSVD = 0;
- 
+
+    /*Check if version array slot was empty */
+    if( *((uint64_t *)(env->regs[R_EDX])) ){
+        env->regs[R_EAX] = ERR_SGX_VA_SLOT_OCCUPIED;
+        env->eflags |= CC_C;
+        goto ERROR_EXIT;
+    }
+
+    /* A fresh version per write-back, used as the GCM IV: IVs are never
+       reused under gcm_key and only the latest copy of a page decrypts */
+    tmp_ver = __sync_add_and_fetch(&ewb_version, 1);
+    tmp_iv[0] = tmp_ver;
+    tmp_iv[1] = 0;
+
     /* Encrypt the page, AES-GCM produces 2 values, {ciphertext, MAC}. */
-    encrypt_epc((unsigned char *)env->regs[R_ECX], PAGE_SIZE, (unsigned char *)&tmp_header,
-                sizeof(tmp_header), gcm_key, NULL, tmp_srcpge, tmp_pcmd->mac);
+    encrypt_epc(get_page_crypto(env, gcm_key)->enc,
+                (unsigned char *)env->regs[R_ECX], PAGE_SIZE,
+                (unsigned char *)&tmp_header, sizeof(tmp_header),
+                (unsigned char *)tmp_iv, (unsigned char *)tmp_srcpge,
+                tmp_pcmd->mac);
 
     memset(&tmp_pcmd->secinfo, 0 , sizeof(secinfo_t));
     tmp_pcmd->secinfo.flags.page_type = epcm[epc_index].page_type; 
@@ -4665,13 +4971,22 @@ void sgx_ewb(CPUX86State *env)
     tmp_pcmd->enclaveid = tmp_pcmd_enclaveid;
     ((pageinfo_t *)(env->regs[R_EBX]))->linaddr = epcm[epc_index].enclave_addr;
 
-    /*Check if version array slot was empty */
-    if( *((uint64_t *)(env->regs[R_EDX])) ){
-        env->regs[R_EAX] = ERR_SGX_VA_SLOT_OCCUPIED;
-        env->eflags |= CC_C;
-    }
-    env->regs[R_EDX] = tmp_ver;
+    *((uint64_t *)(env->regs[R_EDX])) = tmp_ver;
+
+    /* The plaintext leaves the EPC; give the host memory back */
+    memset((void *)env->regs[R_ECX], 0, PAGE_SIZE);
+    qemu_madvise((void *)env->regs[R_ECX], PAGE_SIZE, QEMU_MADV_DONTNEED);
+
     epcm[epc_index].valid = 0;
+    epcm[epc_index].accessed = 0;
+    epcm[epc_index].evicted = (epcm[epc_index].page_type == PT_REG ||
+                               epcm[epc_index].page_type == PT_TCS);
+    sgx_perm_cache_flush_all();
+
+    if (epcm[epc_index].evicted) {
+        sgx_mtrace_page(env, MTRACE_EVICT, epcm[epc_index].enclave_addr,
+                        epc_index, tmp_pcmd_enclaveid);
+    }
 
     ERROR_EXIT:
         env->eflags &= ~(CC_C | CC_P | CC_A | CC_O | CC_S);
@@ -4692,7 +5007,17 @@ void encls_epcm_clear(CPUX86State *env)
 {
     epc_t *target = (epc_t *)env->regs[R_EBX];
     int target_index = epcm_search(target, env);
+
+    // Enclave TBs embed the ELRANGE of their enclave; drop them with it
+    if (epcm[target_index].valid
+        && epcm[target_index].page_type == PT_SECS) {
+        secs_t *secs = (secs_t *)target;
+        tb_invalidate_phys_range(secs->baseAddr,
+                                 secs->baseAddr + secs->size, 0);
+    }
     epcm[target_index].valid = 0;
+    epcm[target_index].evicted = 0;
+    sgx_perm_cache_flush_all();
 }
 
 // Sanity checks data structures
@@ -4718,12 +5043,17 @@ static void sanity_check(void)
     assert(sizeof(mac_header_t) == 128);
 }
 
-static void init_qenclave(void)
+static void init_qenclave(int nenclaves)
 {
-    int i = 0;
-    for(i = 0; i < MAX_ENCLAVES; i++){
-        memset(&(qenclaves[i]), 0, sizeof(qeid_t));
-    }
+    free(qenclaves);
+    free(qmeasures);
+    qenclaves = calloc(nenclaves, sizeof(qeid_t));
+    qmeasures = calloc(nenclaves, sizeof(measure_t));
+    if (!qenclaves || !qmeasures) {
+        sgx_err("failed to allocate %d enclave descriptors", nenclaves);
+        exit(EXIT_FAILURE);
+    }
+    num_qenclaves = nenclaves;
 }
 
 #define KEY_PATH1 "user/conf/device.key"
@@ -4735,7 +5065,24 @@ static void encls_qemu_init(CPUX86State *env)
     // firstPage represents the first page of EPC - the start of EPC
     epc_t *firstPage = (epc_t *)env->regs[R_EBX];
     epc_t *endPage = (epc_t *)env->regs[R_ECX];
-    memset(epcm, 0, NUM_EPC * sizeof(epcm_entry_t));
+    int nepc = endPage - firstPage;
+
+    if (nepc <= 0 || nepc > sgx_epc_pages) {
+        sgx_err("EPC of %d pages does not fit -epc-pages %d",
+                nepc, sgx_epc_pages);
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    free(epcm);
+    epcm = calloc(nepc, sizeof(epcm_entry_t));
+    if (!epcm) {
+        sgx_err("failed to allocate EPCM for %d pages", nepc);
+        exit(EXIT_FAILURE);
+    }
+    num_epc = nepc;
+
+    // Initializing QEMU Enclave Descriptor
+    init_qenclave(max_enclaves(nepc));
 
     // Save the epc base and address
     // Made Base the previous value since it appears as an address inside is_within_epc (thus goes to mem_access
@@ -4747,11 +5094,23 @@ static void encls_qemu_init(CPUX86State *env)
             (void *)EPC_BaseAddr,
             (void *)EPC_EndAddr);
 
+    // Publish the range to every vcpu so translated code only calls
+    // helper_mem_access() for EPC addresses
+    CPUState *cs;
+    CPU_FOREACH(cs) {
+        CPUX86State *cenv = &X86_CPU(cs)->env;
+        cenv->sgx_epc_base = (target_ulong)firstPage;
+        cenv->sgx_epc_size = (target_ulong)endPage - (target_ulong)firstPage;
+    }
+
     int iter;
-    for (iter = 0; iter < NUM_EPC; iter++) {
+    for (iter = 0; iter < num_epc; iter++) {
         epcm[iter].epcPageAddress = (uint64_t)firstPage;
         firstPage++;
     }
+    epcm_index_build(epcm, num_epc);
+    sgx_perm_cache_flush_all();
+
     // Initializing CR_ Registers in cpu.h (For CR_NEXT_EID)
     env->cregs.CR_NEXT_EID = 0; // Next Enclave EID
     env->cregs.CR_ENC_INSN_RET = false;
@@ -4785,9 +5144,41 @@ void encls_set_stat(CPUX86State *env)
 {
     int32_t eid = (int32_t)env->regs[R_EBX];
     stat_t *stat = (stat_t *)env->regs[R_ECX];
+
+    if (eid < 0 || eid >= num_qenclaves) {
+        raise_exception(env, EXCP0D_GPF);
+    }
     memcpy(stat, &(qenclaves[eid].stat), sizeof(stat_t));
 }
 
+// Tell the profiler where an enclave's code came from.
+//   RBX: EID(In)
+//   RCX: profile_map_t(In)
+static
+void encls_profile(CPUX86State *env)
+{
+    int32_t eid = (int32_t)env->regs[R_EBX];
+    profile_map_t *map = (profile_map_t *)env->regs[R_ECX];
+    char path[PROFILE_PATH_MAX];
+
+    if (eid < 0 || eid >= num_qenclaves) {
+        raise_exception(env, EXCP0D_GPF);
+    }
+    memcpy(path, map->path, sizeof(path));
+    path[sizeof(path) - 1] = '\0';
+    tcg_plugin_profile_map(eid, map->load_addr, map->link_addr, map->size, path);
+}
+
+int64_t sgx_active_eid(CPUX86State *env)
+{
+    secs_t *secs = (secs_t *)env->cregs.CR_ACTIVE_SECS;
+
+    if (!env->cregs.CR_ENCLAVE_MODE || !secs) {
+        return -1;
+    }
+    return secs->eid_reserved.eid_pad.eid;
+}
+
 static
 void encls_set_stack(CPUX86State *env)
 {
@@ -4814,6 +5205,146 @@ void encls_set_stack(CPUX86State *env)
     return iter;
 }*/
 
+// Seal/unseal many pages per ENCLS.
+//   RBX: paging_req_t array(In/Out)
+//   RCX: number of entries(In)
+//   RDX: ENCLS_ELDB or ENCLS_ELDU, for ENCLS_OSGX_ELD_N(In)
+//   EAX: number of entries with a non-zero status(Out)
+// A fault on any page aborts the rest of the batch, like the single leaf.
+static
+void encls_paging_batch(CPUX86State *env, int leaf)
+{
+    paging_req_t *reqs = (paging_req_t *)env->regs[R_EBX];
+    uint64_t nreqs = env->regs[R_ECX];
+    uint64_t eld_leaf = env->regs[R_EDX];
+    uint64_t i, nfail = 0;
+
+    if (!is_aligned((uintptr_t)reqs, 8)) {
+        raise_exception(env, EXCP0D_GPF);
+    }
+    if (leaf == ENCLS_OSGX_ELD_N
+        && eld_leaf != ENCLS_ELDB && eld_leaf != ENCLS_ELDU) {
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    for (i = 0; i < nreqs; i++) {
+        env->regs[R_EBX] = reqs[i].pageinfo;
+        env->regs[R_ECX] = reqs[i].epcpage;
+        env->regs[R_EDX] = reqs[i].vaslot;
+
+#if PERF
+        uint64_t beg = perf_leaf_begin(env, true);
+#endif
+        if (leaf == ENCLS_OSGX_EWB_N) {
+            env->regs[R_EAX] = ENCLS_EWB;
+            sgx_ewb(env);
+        } else {
+            env->regs[R_EAX] = eld_leaf;
+            sgx_eldb(env);
+        }
+#if PERF
+        perf_leaf_end(env, true,
+                      leaf == ENCLS_OSGX_EWB_N ? ENCLS_EWB : eld_leaf, beg);
+#endif
+
+        reqs[i].status = env->regs[R_EAX];
+        if (reqs[i].status)
+            nfail++;
+    }
+
+    env->regs[R_EAX] = nfail;
+}
+
+// Read and clear the accessed bits of a run of EPC pages, for the SGX
+// kernel's page replacement.
+//   RBX: first EPC page(In)
+//   RCX: number of pages(In)
+//   RDX: uint8_t array of EPC_AGE_* bits, one per page(Out)
+//   EAX: number of accessed pages(Out)
+static
+void encls_epc_age(CPUX86State *env)
+{
+    uint64_t page = env->regs[R_EBX];
+    uint64_t npages = env->regs[R_ECX];
+    uint8_t *ages = (uint8_t *)env->regs[R_EDX];
+    uint64_t i, naccessed = 0;
+
+    if (!is_aligned(page, PAGE_SIZE)) {
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    for (i = 0; i < npages; i++, page += PAGE_SIZE) {
+        epcm_entry_t *entry;
+
+        check_within_epc((void *)page, env);
+        entry = &epcm[epcm_search((void *)page, env)];
+
+        ages[i] = 0;
+        if (entry->accessed) {
+            ages[i] |= EPC_AGE_ACCESSED;
+            entry->accessed = 0;
+            naccessed++;
+        }
+        if (entry->valid && !entry->blocked && !entry->execute
+            && entry->page_type == PT_REG) {
+            ages[i] |= EPC_AGE_EVICTABLE;
+        }
+    }
+
+    // Cached permissions would hide the next accesses
+    sgx_perm_cache_flush_all();
+    env->regs[R_EAX] = naccessed;
+}
+
+// Add (and measure) many pages per ENCLS.
+//   RBX: eadd_req_t array(In)
+//   RCX: number of entries(In)
+//   RDX: non-zero to EEXTEND every page after adding it(In)
+// Pages are processed exactly as EADD followed by PAGE_SIZE/MEASUREMENT_SIZE
+// EEXTENDs would be, so MRENCLAVE is the same as with the single leaves.
+static
+void encls_eadd_batch(CPUX86State *env)
+{
+    eadd_req_t *reqs = (eadd_req_t *)env->regs[R_EBX];
+    uint64_t nreqs = env->regs[R_ECX];
+    bool measure = env->regs[R_EDX] != 0;
+    uint64_t i, off;
+
+    if (!is_aligned(reqs, PAGEINFO_ALIGN_SIZE)) {
+        raise_exception(env, EXCP0D_GPF);
+    }
+
+    for (i = 0; i < nreqs; i++) {
+#if PERF
+        uint64_t beg;
+#endif
+        env->regs[R_EBX] = (uint64_t)&reqs[i].pageinfo;
+        env->regs[R_ECX] = reqs[i].epcpage;
+#if PERF
+        beg = perf_leaf_begin(env, true);
+#endif
+        sgx_eadd(env);
+#if PERF
+        perf_leaf_end(env, true, ENCLS_EADD, beg);
+#endif
+
+        if (!measure)
+            continue;
+        for (off = 0; off < PAGE_SIZE; off += MEASUREMENT_SIZE) {
+            env->regs[R_ECX] = reqs[i].epcpage + off;
+#if PERF
+            beg = perf_leaf_begin(env, true);
+#endif
+            sgx_eextend(env);
+#if PERF
+            perf_leaf_end(env, true, ENCLS_EEXTEND, beg);
+#endif
+        }
+    }
+
+    env->regs[R_EAX] = 0;
+}
+
 static
 const char *encls_cmd_to_str(long cmd) {
     switch (cmd) {
@@ -4823,16 +5354,27 @@ const char *encls_cmd_to_str(long cmd) {
     case ENCLS_EREMOVE:       return "EREMOVE";
     case ENCLS_EEXTEND:       return "EEXTEND";
     case ENCLS_EAUG:          return "EAUG";
+    case ENCLS_EMODT:         return "EMODT";
     case ENCLS_OSGX_INIT:     return "OSGX_INIT";
     case ENCLS_OSGX_PUBKEY:   return "OSGX_PUBKEY";
     case ENCLS_OSGX_EPCM_CLR: return "OSGX_EPCM_CLR";
     case ENCLS_OSGX_CPUSVN:   return "OSGX_CPUSVN";
+    case ENCLS_OSGX_EWB_N:    return "OSGX_EWB_N";
+    case ENCLS_OSGX_ELD_N:    return "OSGX_ELD_N";
+    case ENCLS_OSGX_EADD_N:   return "OSGX_EADD_N";
+    case ENCLS_OSGX_EPC_AGE:  return "OSGX_EPC_AGE";
+    case ENCLS_OSGX_PROFILE:  return "OSGX_PROFILE";
     }
     return "UNKONWN";
 }
 
 void helper_sgx_encls(CPUX86State *env)
 {
+#if PERF
+    uint64_t leaf = env->regs[R_EAX];
+    uint64_t beg = perf_leaf_begin(env, true);
+#endif
+
     sgx_dbg(ttrace,
             "(%-13s) EAX=0x%08"PRIx64", EBX=0x%08"PRIx64", "
             "RCX=0x%08"PRIx64", RDX=0x%08"PRIx64,
@@ -4854,8 +5396,9 @@ void helper_sgx_encls(CPUX86State *env)
         case ENCLS_ELDB:
         case ENCLS_ELDU:
             sgx_eldb(env);
+            break;
         case ENCLS_EREMOVE:
-           //sgx_eremove(env);
+            sgx_eremove(env);
             break;
         case ENCLS_EEXTEND:
             sgx_eextend(env);
@@ -4865,6 +5408,7 @@ void helper_sgx_encls(CPUX86State *env)
             break;
         case ENCLS_EPA:
             sgx_epa(env);
+            break;
         case ENCLS_EWB:
             sgx_ewb(env);
             break;
@@ -4874,10 +5418,12 @@ void helper_sgx_encls(CPUX86State *env)
         case ENCLS_EMODPR:
             sgx_emodpr(env);
             break;
+        case ENCLS_EMODT:
+            sgx_emodt(env);
+            break;
 
         // custom (non-spec) hypercalls: for setting up qemu
         case ENCLS_OSGX_INIT:
-            init_qenclave(); // Initializing QEMU Enclave Descriptor
             encls_qemu_init(env);
             break;
         case ENCLS_OSGX_PUBKEY:
@@ -4895,9 +5441,25 @@ void helper_sgx_encls(CPUX86State *env)
         case ENCLS_OSGX_SET_STACK:
             encls_set_stack(env);
             break;
+        case ENCLS_OSGX_EWB_N:
+        case ENCLS_OSGX_ELD_N:
+            encls_paging_batch(env, env->regs[R_EAX]);
+            break;
+        case ENCLS_OSGX_EADD_N:
+            encls_eadd_batch(env);
+            break;
+        case ENCLS_OSGX_EPC_AGE:
+            encls_epc_age(env);
+            break;
+        case ENCLS_OSGX_PROFILE:
+            encls_profile(env);
+            break;
         default:
             sgx_err("not implemented yet");
     }
+#if PERF
+    perf_leaf_end(env, true, leaf, beg);
+#endif
 }
 
 void helper_sgx_ehandle(CPUX86State *env)
@@ -4912,6 +5474,10 @@ void helper_sgx_ehandle(CPUX86State *env)
     secs = (secs_t *)env->cregs.CR_ACTIVE_SECS;
     tmp_gpr = (gprsgx_t *)(env->cregs.CR_GPR_PA); //CR_XSAVE_PAGE[0];
 
+#if PERF
+    perf_switch(env, secs->eid_reserved.eid_pad.eid, false);
+#endif
+
     // Check for 64 bit mode
     tmp_mode64 = (env->efer & MSR_EFER_LMA) && (env->segs[R_CS].flags & DESC_L_MASK);
 
@@ -63,7 +63,6 @@
 /* global register indexes */
 static TCGv_ptr cpu_env;
 static TCGv cpu_A0;
-static bool enclave_mode = false;
 static int ld_ = 0;
 static int st_ = 1;
 //static TCGv ld_ = 0;
@@ -128,6 +127,7 @@ typedef struct DisasContext {
     int cpuid_ext2_features;
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
+    int sgx_enclave; /* enclave mode (HF_SGX_MASK) */
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -479,15 +479,93 @@ static inline void gen_op_addq_A0_reg_sN(int shift, int reg)
 }
 #endif
 
+/* Branch to l_outside unless a0 lies in the active ELRANGE.  The bounds
+   are loaded from env at run time: HF_SGX_MASK only says that some
+   enclave is active, so a TB can run for several enclaves.  */
+static void gen_sgx_elrange_check(TCGv a0, TCGv t0, TCGv t1, int l_outside)
+{
+    tcg_gen_ld_tl(t1, cpu_env,
+                  offsetof(CPUX86State, cregs.CR_ELRANGE[0]));
+    tcg_gen_sub_tl(t0, a0, t1);
+    tcg_gen_ld_tl(t1, cpu_env,
+                  offsetof(CPUX86State, cregs.CR_ELRANGE[1]));
+    tcg_gen_brcond_tl(TCG_COND_GEU, t0, t1, l_outside);
+}
+
+/* Enclave-mode checks for a data access.  Non-enclave TBs (HF_SGX_MASK
+   clear) emit nothing.  Enclave TBs check the ELRANGE: inside it only
+   the EPCM permissions are left to check, outside it the access faults
+   if it hits the EPC (bounds published in env by ENCLS_OSGX_INIT).
+   Note that the branches end the basic block: anything live across a
+   memory access must be a global or a local temp.  */
+static void gen_sgx_mem_access(DisasContext *s, TCGv a0, int op)
+{
+    int l_outside, l_done;
+    TCGv t0, t1;
+
+    if (!s->sgx_enclave) {
+        return;
+    }
+    l_outside = gen_new_label();
+    l_done = gen_new_label();
+    t0 = tcg_temp_new();
+    t1 = tcg_temp_new();
+
+    gen_sgx_elrange_check(a0, t0, t1, l_outside);
+    gen_helper_mem_access(cpu_env, a0, tcg_const_i32(op));
+    tcg_gen_br(l_done);
+
+    gen_set_label(l_outside);
+    tcg_gen_ld_tl(t0, cpu_env, offsetof(CPUX86State, sgx_epc_base));
+    tcg_gen_ld_tl(t1, cpu_env, offsetof(CPUX86State, sgx_epc_size));
+    tcg_gen_sub_tl(t0, a0, t0);
+    tcg_gen_brcond_tl(TCG_COND_GEU, t0, t1, l_done);
+    gen_helper_sgx_range_fault(cpu_env, a0);
+
+    gen_set_label(l_done);
+    tcg_temp_free(t0);
+    tcg_temp_free(t1);
+}
+
+/* Same as gen_sgx_mem_access() for a control transfer to 'target'.  */
+static void gen_sgx_mem_execute(DisasContext *s, TCGv target)
+{
+    int l_outside, l_done;
+    TCGv t0, t1;
+
+    if (!s->sgx_enclave) {
+        return;
+    }
+    l_outside = gen_new_label();
+    l_done = gen_new_label();
+    t0 = tcg_temp_new();
+    t1 = tcg_temp_new();
+
+    gen_sgx_elrange_check(target, t0, t1, l_outside);
+    gen_helper_mem_execute(cpu_env, target);
+    tcg_gen_br(l_done);
+
+    gen_set_label(l_outside);
+    tcg_gen_ld_tl(t0, cpu_env, offsetof(CPUX86State, sgx_epc_base));
+    tcg_gen_ld_tl(t1, cpu_env, offsetof(CPUX86State, sgx_epc_size));
+    tcg_gen_sub_tl(t0, target, t0);
+    tcg_gen_brcond_tl(TCG_COND_GEU, t0, t1, l_done);
+    gen_helper_sgx_range_fault(cpu_env, target);
+
+    gen_set_label(l_done);
+    tcg_temp_free(t0);
+    tcg_temp_free(t1);
+}
+
 static inline void gen_op_ld_v(DisasContext *s, int idx, TCGv t0, TCGv a0)
 {
-    gen_helper_mem_access(cpu_env, a0, tcg_const_i32(ld_));
+    gen_sgx_mem_access(s, a0, ld_);
     tcg_gen_qemu_ld_tl(t0, a0, s->mem_index, idx | MO_LE);
 }
 
 static inline void gen_op_st_v(DisasContext *s, int idx, TCGv t0, TCGv a0)
 {
-    gen_helper_mem_access(cpu_env, a0, tcg_const_i32(st_));
+    gen_sgx_mem_access(s, a0, st_);
     tcg_gen_qemu_st_tl(t0, a0, s->mem_index, idx | MO_LE);
 }
 
@@ -1746,7 +1824,7 @@ static void gen_shiftd_rm_T1(DisasContext *s, TCGMemOp ot, int op1,
         gen_op_mov_v_reg(ot, cpu_T[0], op1);
     }
 
-    count = tcg_temp_new();
+    count = tcg_temp_local_new();
     tcg_gen_andi_tl(count, count_in, mask);
 
     switch (ot) {
@@ -2520,7 +2598,7 @@ static void gen_enter(DisasContext *s, int esp_addend, int level)
 
 static void gen_exception(DisasContext *s, int trapno, target_ulong cur_eip)
 {
-    if (enclave_mode) {
+    if (s->sgx_enclave) {
         gen_helper_sgx_ehandle(cpu_env);
     }
     gen_update_cc_op(s);
@@ -2534,7 +2612,7 @@ static void gen_exception(DisasContext *s, int trapno, target_ulong cur_eip)
 static void gen_interrupt(DisasContext *s, int intno,
                           target_ulong cur_eip, target_ulong next_eip)
 {
-    if (enclave_mode) {
+    if (s->sgx_enclave) {
         gen_helper_sgx_ehandle(cpu_env);
     }
     gen_update_cc_op(s);
@@ -2595,7 +2673,7 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
 
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+    gen_sgx_mem_access(s, cpu_A0, ld_);
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset);
 }
@@ -2603,18 +2681,18 @@ static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 static inline void gen_stq_env_A0(DisasContext *s, int offset)
 {
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset);
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));//st_);
+    gen_sgx_mem_access(s, cpu_A0, st_);
     tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
 }
 
 static inline void gen_ldo_env_A0(DisasContext *s, int offset)
 {
     int mem_index = s->mem_index;
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+    gen_sgx_mem_access(s, cpu_A0, ld_);
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, mem_index, MO_LEQ);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(0)));
     tcg_gen_addi_tl(cpu_tmp0, cpu_A0, 8);
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+    gen_sgx_mem_access(s, cpu_A0, ld_);
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_tmp0, mem_index, MO_LEQ);
     tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(1)));
 }
@@ -2623,11 +2701,11 @@ static inline void gen_sto_env_A0(DisasContext *s, int offset)
 {
     int mem_index = s->mem_index;
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(0)));
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+    gen_sgx_mem_access(s, cpu_A0, st_);
     tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0, mem_index, MO_LEQ);
     tcg_gen_addi_tl(cpu_tmp0, cpu_A0, 8);
     tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset + offsetof(XMMReg, XMM_Q(1)));
-    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+    gen_sgx_mem_access(s, cpu_A0, st_);
     tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_tmp0, mem_index, MO_LEQ);
 }
 
@@ -3656,14 +3734,14 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         break;
                     case 0x21: case 0x31: /* pmovsxbd, pmovzxbd */
                     case 0x24: case 0x34: /* pmovsxwq, pmovzxwq */
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         tcg_gen_st_i32(cpu_tmp2_i32, cpu_env, op2_offset +
                                         offsetof(XMMReg, XMM_L(0)));
                         break;
                     case 0x22: case 0x32: /* pmovsxbq, pmovzxbq */
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_tl(cpu_tmp0, cpu_A0,
                                            s->mem_index, MO_LEUW);
                         tcg_gen_st16_tl(cpu_tmp0, cpu_env, op2_offset +
@@ -3753,12 +3831,12 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
 
                 gen_lea_modrm(env, s, modrm);
                 if ((b & 1) == 0) {
-                    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                    gen_sgx_mem_access(s, cpu_A0, ld_);
                     tcg_gen_qemu_ld_tl(cpu_T[0], cpu_A0,
                                        s->mem_index, ot | MO_BE);
                     gen_op_mov_reg_v(ot, reg, cpu_T[0]);
                 } else {
-                    gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                    gen_sgx_mem_access(s, cpu_A0, st_);
                     tcg_gen_qemu_st_tl(cpu_regs[reg], cpu_A0,
                                        s->mem_index, ot | MO_BE);
                 }
@@ -4096,7 +4174,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     if (mod == 3) {
                         gen_op_mov_reg_v(ot, rm, cpu_T[0]);
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_tl(cpu_T[0], cpu_A0,
                                            s->mem_index, MO_UB);
                     }
@@ -4107,7 +4185,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     if (mod == 3) {
                         gen_op_mov_reg_v(ot, rm, cpu_T[0]);
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_tl(cpu_T[0], cpu_A0,
                                            s->mem_index, MO_LEUW);
                     }
@@ -4120,7 +4198,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         if (mod == 3) {
                             tcg_gen_extu_i32_tl(cpu_regs[rm], cpu_tmp2_i32);
                         } else {
-                            gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                            gen_sgx_mem_access(s, cpu_A0, st_);
                             tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                                 s->mem_index, MO_LEUL);
                         }
@@ -4132,7 +4210,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         if (mod == 3) {
                             tcg_gen_mov_i64(cpu_regs[rm], cpu_tmp1_i64);
                         } else {
-                            gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                            gen_sgx_mem_access(s, cpu_A0, st_);
                             tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0,
                                                 s->mem_index, MO_LEQ);
                         }
@@ -4147,7 +4225,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     if (mod == 3) {
                         gen_op_mov_reg_v(ot, rm, cpu_T[0]);
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_tl(cpu_T[0], cpu_A0,
                                            s->mem_index, MO_LEUL);
                     }
@@ -4156,7 +4234,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     if (mod == 3) {
                         gen_op_mov_v_reg(MO_32, cpu_T[0], rm);
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_ld_tl(cpu_T[0], cpu_A0,
                                            s->mem_index, MO_UB);
                     }
@@ -4169,7 +4247,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                                         offsetof(CPUX86State,xmm_regs[rm]
                                                 .XMM_L((val >> 6) & 3)));
                     } else {
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                     }
@@ -4198,7 +4276,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         if (mod == 3) {
                             tcg_gen_trunc_tl_i32(cpu_tmp2_i32, cpu_regs[rm]);
                         } else {
-                            gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                            gen_sgx_mem_access(s, cpu_A0, ld_);
                             tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                                 s->mem_index, MO_LEUL);
                         }
@@ -4210,7 +4288,7 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                         if (mod == 3) {
                             gen_op_mov_v_reg(ot, cpu_tmp1_i64, rm);
                         } else {
-                            gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                            gen_sgx_mem_access(s, cpu_A0, ld_);
                             tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0,
                                                 s->mem_index, MO_LEQ);
                         }
@@ -4971,7 +5049,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (dflag == MO_16) {
                 tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
             }
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);  //cpu_T[0] contains the destination address
+            gen_sgx_mem_execute(s, cpu_T[0]);  //cpu_T[0] contains the destination address
             next_eip = s->pc - s->cs_base;
             tcg_gen_movi_tl(cpu_T[1], next_eip);
             gen_push_v(s, cpu_T[1]);
@@ -5002,7 +5080,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (dflag == MO_16) {
                 tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
             }
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);
+            gen_sgx_mem_execute(s, cpu_T[0]);
             gen_op_jmp_v(cpu_T[0]);
             gen_eob(s);
             break;
@@ -5019,7 +5097,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                                           tcg_const_i32(s->pc - pc_start));
             } else {
                 gen_op_movl_seg_T0_vm(R_CS);
-                gen_helper_mem_execute(cpu_env, cpu_T[1]);
+                gen_sgx_mem_execute(s, cpu_T[1]);
                 gen_op_jmp_v(cpu_T[1]);
             }
             gen_eob(s);
@@ -5749,7 +5827,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         gen_op_mov_v_reg(ot, cpu_T[1], reg);
 
         if (shift) {
-            TCGv imm = tcg_const_tl(cpu_ldub_code(env, s->pc++));
+            TCGv imm = tcg_const_local_tl(cpu_ldub_code(env, s->pc++));
             gen_shiftd_rm_T1(s, ot, opreg, op, imm);
             tcg_temp_free(imm);
         } else {
@@ -5784,26 +5862,26 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
 
                     switch(op >> 4) {
                     case 0:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         gen_helper_flds_FT0(cpu_env, cpu_tmp2_i32);
                         break;
                     case 1:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         gen_helper_fildl_FT0(cpu_env, cpu_tmp2_i32);
                         break;
                     case 2:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0,
                                             s->mem_index, MO_LEQ);
                         gen_helper_fldl_FT0(cpu_env, cpu_tmp1_i64);
                         break;
                     case 3:
                     default:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LESW);
                         gen_helper_fildl_FT0(cpu_env, cpu_tmp2_i32);
@@ -5827,26 +5905,26 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 case 0:
                     switch(op >> 4) {
                     case 0:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         gen_helper_flds_ST0(cpu_env, cpu_tmp2_i32);
                         break;
                     case 1:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         gen_helper_fildl_ST0(cpu_env, cpu_tmp2_i32);
                         break;
                     case 2:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0,
                                             s->mem_index, MO_LEQ);
                         gen_helper_fldl_ST0(cpu_env, cpu_tmp1_i64);
                         break;
                     case 3:
                     default:
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                        gen_sgx_mem_access(s, cpu_A0, ld_);
                         tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LESW);
                         gen_helper_fildl_ST0(cpu_env, cpu_tmp2_i32);
@@ -5858,20 +5936,20 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                     switch(op >> 4) {
                     case 1:
                         gen_helper_fisttl_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         break;
                     case 2:
                         gen_helper_fisttll_ST0(cpu_tmp1_i64, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0,
                                             s->mem_index, MO_LEQ);
                         break;
                     case 3:
                     default:
                         gen_helper_fistt_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUW);
                         break;
@@ -5882,26 +5960,26 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                     switch(op >> 4) {
                     case 0:
                         gen_helper_fsts_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         break;
                     case 1:
                         gen_helper_fistl_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUL);
                         break;
                     case 2:
                         gen_helper_fstl_ST0(cpu_tmp1_i64, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0,
                                             s->mem_index, MO_LEQ);
                         break;
                     case 3:
                     default:
                         gen_helper_fist_ST0(cpu_tmp2_i32, cpu_env);
-                        gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                        gen_sgx_mem_access(s, cpu_A0, st_);
                         tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                             s->mem_index, MO_LEUW);
                         break;
@@ -5917,7 +5995,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 gen_helper_fldenv(cpu_env, cpu_A0, tcg_const_i32(dflag - 1));
                 break;
             case 0x0d: /* fldcw mem */
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                gen_sgx_mem_access(s, cpu_A0, ld_);
                 tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                     s->mem_index, MO_LEUW);
                 gen_helper_fldcw(cpu_env, cpu_tmp2_i32);
@@ -5929,7 +6007,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 break;
             case 0x0f: /* fnstcw mem */
                 gen_helper_fnstcw(cpu_tmp2_i32, cpu_env);
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                gen_sgx_mem_access(s, cpu_A0, st_);
                 tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                     s->mem_index, MO_LEUW);
                 break;
@@ -5956,7 +6034,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 break;
             case 0x2f: /* fnstsw mem */
                 gen_helper_fnstsw(cpu_tmp2_i32, cpu_env);
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                gen_sgx_mem_access(s, cpu_A0, st_);
                 tcg_gen_qemu_st_i32(cpu_tmp2_i32, cpu_A0,
                                     s->mem_index, MO_LEUW);
                 break;
@@ -5972,13 +6050,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 gen_helper_fpop(cpu_env);
                 break;
             case 0x3d: /* fildll */
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                gen_sgx_mem_access(s, cpu_A0, ld_);
                 tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
                 gen_helper_fildll_ST0(cpu_env, cpu_tmp1_i64);
                 break;
             case 0x3f: /* fistpll */
                 gen_helper_fistll_ST0(cpu_tmp1_i64, cpu_env);
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(st_));
+                gen_sgx_mem_access(s, cpu_A0, st_);
                 tcg_gen_qemu_st_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
                 gen_helper_fpop(cpu_env);
                 break;
@@ -6463,7 +6541,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         s->pc += 2;
         ot = gen_pop_T0(s);
         gen_stack_update(s, val + (1 << ot));
-        gen_helper_mem_execute(cpu_env, cpu_T[0]);
+        gen_sgx_mem_execute(s, cpu_T[0]);
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
         gen_eob(s);
@@ -6471,7 +6549,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
         gen_pop_update(s, ot);
-        gen_helper_mem_execute(cpu_env, cpu_T[0]);
+        gen_sgx_mem_execute(s, cpu_T[0]);
         gen_op_jmp_v(cpu_T[0]);
         gen_eob(s);
         break;
@@ -6482,7 +6560,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->pe && !s->vm86) {
             gen_update_cc_op(s);
             tcg_gen_movi_tl(cpu_T[0], pc_start - s->cs_base);  
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);  
+            gen_sgx_mem_execute(s, cpu_T[0]);
             gen_jmp_im(pc_start - s->cs_base);
             gen_helper_lret_protected(cpu_env, tcg_const_i32(dflag - 1),
                                       tcg_const_i32(val));
@@ -6492,7 +6570,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_op_ld_v(s, dflag, cpu_T[0], cpu_A0);
             /* NOTE: keeping EIP updated is not a problem in case of
                exception */
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);
+            gen_sgx_mem_execute(s, cpu_T[0]);
             gen_op_jmp_v(cpu_T[0]);
             /* pop selector */
             gen_op_addl_A0_im(1 << dflag);
@@ -6522,7 +6600,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else {
             gen_update_cc_op(s);
             tcg_gen_movi_tl(cpu_T[0], pc_start - s->cs_base);
-            gen_helper_mem_execute(cpu_env, cpu_T[0]);
+            gen_sgx_mem_execute(s, cpu_T[0]);
             gen_jmp_im(pc_start - s->cs_base);
             gen_helper_iret_protected(cpu_env, tcg_const_i32(dflag - 1),
                                       tcg_const_i32(s->pc - s->cs_base));
@@ -6545,8 +6623,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                     tval &= 0xffffffff;
                 }
                 tcg_gen_movi_tl(cpu_T[0], tval);
-                gen_helper_mem_execute(cpu_env, cpu_T[0]);
-                if (enclave_mode) {
+                gen_sgx_mem_execute(s, cpu_T[0]);
+                if (s->sgx_enclave) {
                     sgx_dbg(trace, "In 0xe8(call im), enclave mode, cur env->eip : %lx s-----> PC: %lx", env->eip, s->pc);
                     sgx_dbg(trace, "In 0xe8(call im), enclave mode, target: %lx", tval);
                     jmpOutEnc = true;
@@ -6586,7 +6664,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffffffff;
         }
         tcg_gen_movi_tl(cpu_T[0], tval);
-        gen_helper_mem_execute(cpu_env, cpu_T[0]);
+        gen_sgx_mem_execute(s, cpu_T[0]);
         gen_jmp(s, tval);
         break;
     case 0xea: /* ljmp im */
@@ -6609,7 +6687,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffff;
         }
         tcg_gen_movi_tl(cpu_T[0], tval);
-        gen_helper_mem_execute(cpu_env, cpu_T[0]);
+        gen_sgx_mem_execute(s, cpu_T[0]);
         gen_jmp(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
@@ -7874,7 +7952,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 goto illegal_op;
             gen_lea_modrm(env, s, modrm);
             if (op == 2) {
-                gen_helper_mem_access(cpu_env, cpu_A0, tcg_const_i32(ld_));
+                gen_sgx_mem_access(s, cpu_A0, ld_);
                 tcg_gen_qemu_ld_i32(cpu_tmp2_i32, cpu_A0,
                                     s->mem_index, MO_LEUL);
                 gen_helper_ldmxcsr(cpu_env, cpu_tmp2_i32);
@@ -8032,7 +8110,6 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     CPUState *cs = CPU(cpu);
     CPUX86State *env = &cpu->env;
 
-    enclave_mode = env->cregs.CR_ENCLAVE_MODE;
     DisasContext dc1, *dc = &dc1;
     target_ulong pc_ptr;
     uint16_t *gen_opc_end;
@@ -8057,6 +8134,7 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     dc->vm86 = (flags >> VM_SHIFT) & 1;
     dc->cpl = (flags >> HF_CPL_SHIFT) & 3;
     dc->iopl = (flags >> IOPL_SHIFT) & 3;
+    dc->sgx_enclave = (flags >> HF_SGX_SHIFT) & 1;
     dc->tf = (flags >> TF_SHIFT) & 1;
     dc->singlestep_enabled = cs->singlestep_enabled;
     dc->cc_op = CC_OP_DYNAMIC;
@@ -8091,15 +8169,16 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
         printf("ERROR addseg\n");
 #endif
 
-    cpu_T[0] = tcg_temp_new();
-    cpu_T[1] = tcg_temp_new();
-    cpu_A0 = tcg_temp_new();
+    /* These must survive the branch in gen_sgx_mem_access().  */
+    cpu_T[0] = tcg_temp_local_new();
+    cpu_T[1] = tcg_temp_local_new();
+    cpu_A0 = tcg_temp_local_new();
 
-    cpu_tmp0 = tcg_temp_new();
-    cpu_tmp1_i64 = tcg_temp_new_i64();
-    cpu_tmp2_i32 = tcg_temp_new_i32();
-    cpu_tmp3_i32 = tcg_temp_new_i32();
-    cpu_tmp4 = tcg_temp_new();
+    cpu_tmp0 = tcg_temp_local_new();
+    cpu_tmp1_i64 = tcg_temp_local_new_i64();
+    cpu_tmp2_i32 = tcg_temp_local_new_i32();
+    cpu_tmp3_i32 = tcg_temp_local_new_i32();
+    cpu_tmp4 = tcg_temp_local_new();
     cpu_ptr0 = tcg_temp_new_ptr();
     cpu_ptr1 = tcg_temp_new_ptr();
     cpu_cc_srcT = tcg_temp_local_new();
@@ -7,6 +7,7 @@
 #include <string.h>  /* strlen(3), */
 #include <stdio.h>   /* *printf(3), memset(3), */
 #include <pthread.h> /* pthread_*, */
+#include <errno.h>   /* errno, */
 
 #include "tcg-op.h"
 
@@ -14,6 +15,9 @@
 #include "exec/exec-all.h"   /* TranslationBlock */
 #include "qom/cpu.h"         /* CPUState */
 #include "sysemu/sysemu.h"   /* max_cpus */
+#include "disas/disas.h"     /* lookup_symbol() */
+#include "elf.h"             /* Elf64_*, */
+#include "qemu/atomic.h"     /* atomic_*(), */
 
 /* Interface for the TCG plugin.  */
 static TCGPluginInterface tpi;
@@ -22,7 +26,20 @@ static bool mutex_protected;
 
 static uint64_t current_pc = 0;
 
-static uint64_t *icount_total;
+/* Guest instructions executed, one counter per vcpu.  In linux-user
+   every guest thread is a vcpu with its own host thread (e.g. the
+   switchless ocall worker), so each thread registers its counter on
+   first use and only ever bumps its own.  The list is append-only.  */
+typedef struct ICount {
+    int cpu_index;
+    uint64_t n;
+    struct ICount *next;
+} ICount;
+
+static __thread ICount *icount_self;
+static pthread_mutex_t icount_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ICount *icounts;
+static bool icount_enabled;
 
 /* Ensure resources used by *_helper_code are protected from
    concurrent access.  */
@@ -50,12 +67,332 @@ static int init=0;
     } while (0);
 
 
-static void cpus_stopped(const TCGPluginInterface *tpi)
+/***********************************************************************
+ * Instruction profile (-sgx-profile FILE).
+ *
+ * Every translation block gets a record when it is translated, in host
+ * or enclave mode (the mode is part of the TB flags, so a block never
+ * runs in the other one), and counts its executions.  The TB flags do
+ * not say which enclave is active, so the enclave is looked up when the
+ * block runs, and a block run by several enclaves gets a record for
+ * each.  At exit the records are merged by (enclave, pc) and written as
+ * folded stacks:
+ *
+ *   host;<symbol>;0x<pc> <instructions>
+ *   enclave<eid>;<symbol>;<symbol>+0x<offset> <instructions>
+ *
+ * Host code is named from the guest binary's symbols; enclave code from
+ * the .sgx binary the SGX kernel names with ENCLS_OSGX_PROFILE.
+ */
+
+typedef struct TBProfile {
+    uint64_t pc;
+    int64_t eid;                /* -1 in host mode */
+    uint64_t icount;
+    uint64_t exec_n;
+    struct TBProfile *next;     /* same block, run by another enclave */
+} TBProfile;
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+    const char *name;
+} ProfileSym;
+
+typedef struct {
+    int64_t eid;
+    uint64_t load_addr;
+    uint64_t link_addr;
+    uint64_t size;
+    gchar *image;               /* the .sgx binary, names point into it */
+    ProfileSym *syms;           /* sorted by addr */
+    size_t nb_syms;
+} ProfileMap;
+
+/* Guest threads translate and run blocks concurrently.  */
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TBProfile **tb_profiles;
+static size_t nb_tb_profiles;
+static size_t max_tb_profiles;
+
+static ProfileMap *profile_maps;
+static size_t nb_profile_maps;
+
+static int cmp_profile_sym(const void *a, const void *b)
+{
+    const ProfileSym *x = a, *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* Read the function symbols of an ELF64 binary within [lo, hi).  */
+static bool load_profile_syms(ProfileMap *map, const char *path,
+                              uint64_t lo, uint64_t hi)
 {
+    gsize len = 0;
+    Elf64_Ehdr *eh;
+    Elf64_Shdr *sh;
     unsigned int i;
-    for (i = 0; i < tpi->nb_cpus; i++) {
+
+    if (!g_file_get_contents(path, &map->image, &len, NULL)) {
+        return false;
+    }
+    eh = (Elf64_Ehdr *)map->image;
+    if (len < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG)
+        || eh->e_ident[EI_CLASS] != ELFCLASS64
+        || eh->e_shentsize != sizeof(Elf64_Shdr)
+        || eh->e_shoff > len
+        || (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > len - eh->e_shoff) {
+        return false;
+    }
+    sh = (Elf64_Shdr *)(map->image + eh->e_shoff);
+
+    for (i = 1; i < eh->e_shnum; i++) {
+        Elf64_Shdr *strtab = &sh[sh[i].sh_link];
+        Elf64_Sym *sym;
+        size_t j, n;
+
+        if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum
+            || sh[i].sh_offset > len || sh[i].sh_size > len - sh[i].sh_offset
+            || strtab->sh_offset > len || strtab->sh_size > len - strtab->sh_offset
+            || strtab->sh_size == 0
+            || map->image[strtab->sh_offset + strtab->sh_size - 1] != '\0') {
+            continue;
+        }
+        sym = (Elf64_Sym *)(map->image + sh[i].sh_offset);
+        n = sh[i].sh_size / sizeof(Elf64_Sym);
+        map->syms = g_renew(ProfileSym, map->syms, map->nb_syms + n);
+        for (j = 0; j < n; j++) {
+            if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC
+                || sym[j].st_value < lo || sym[j].st_value >= hi
+                || sym[j].st_name >= strtab->sh_size) {
+                continue;
+            }
+            map->syms[map->nb_syms].addr = sym[j].st_value;
+            map->syms[map->nb_syms].size = sym[j].st_size;
+            map->syms[map->nb_syms].name =
+                map->image + strtab->sh_offset + sym[j].st_name;
+            map->nb_syms++;
+        }
+    }
+    qsort(map->syms, map->nb_syms, sizeof(ProfileSym), cmp_profile_sym);
+    return true;
+}
+
+/* Called for ENCLS_OSGX_PROFILE.  */
+void tcg_plugin_profile_map(int64_t eid, uint64_t load_addr, uint64_t link_addr,
+                            uint64_t size, const char *path)
+{
+    ProfileMap *map;
+
+    if (!sgx_profile_path) {
+        return;
+    }
+    profile_maps = g_renew(ProfileMap, profile_maps, nb_profile_maps + 1);
+    map = &profile_maps[nb_profile_maps++];
+    memset(map, 0, sizeof(*map));
+    map->eid = eid;
+    map->load_addr = load_addr;
+    map->link_addr = link_addr;
+    map->size = size;
+    if (!load_profile_syms(map, path, link_addr, link_addr + size)) {
+        fprintf(stderr, "sgx-profile: no symbols for enclave %" PRId64
+                " in %s\n", eid, path);
+    }
+}
+
+/* Function containing addr (a link address), NULL if none.  */
+static const ProfileSym *find_profile_sym(const ProfileMap *map, uint64_t addr)
+{
+    const ProfileSym *sym;
+    size_t lo = 0, hi = map->nb_syms;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (map->syms[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    sym = &map->syms[lo - 1];
+    if (sym->size && addr - sym->addr >= sym->size) {
+        return NULL;
+    }
+    return sym;
+}
+
+/* The last map registered for eid covering pc.  */
+static const ProfileMap *find_profile_map(int64_t eid, uint64_t pc)
+{
+    size_t i;
+
+    for (i = nb_profile_maps; i-- > 0; ) {
+        const ProfileMap *map = &profile_maps[i];
+        if (map->eid == eid && pc - map->load_addr < map->size) {
+            return map;
+        }
+    }
+    return NULL;
+}
+
+static int cmp_tb_profile(const void *a, const void *b)
+{
+    const TBProfile *x = *(TBProfile * const *)a, *y = *(TBProfile * const *)b;
+
+    if (x->eid != y->eid) {
+        return (x->eid > y->eid) - (x->eid < y->eid);
+    }
+    return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+static void write_profile_line(FILE *out, int64_t eid, uint64_t pc, uint64_t n)
+{
+    if (eid < 0) {
+        const char *name = lookup_symbol(pc);
+        fprintf(out, "host;%s;0x%" PRIx64 " %" PRIu64 "\n",
+                name[0] ? name : "[unknown]", pc, n);
+    } else {
+        const ProfileMap *map = find_profile_map(eid, pc);
+        const ProfileSym *sym = NULL;
+        uint64_t addr = pc;
+
+        if (map) {
+            addr = pc - map->load_addr + map->link_addr;
+            sym = find_profile_sym(map, addr);
+        }
+        if (sym) {
+            fprintf(out, "enclave%" PRId64 ";%s;%s+0x%" PRIx64 " %" PRIu64 "\n",
+                    eid, sym->name, sym->name, addr - sym->addr, n);
+        } else {
+            fprintf(out, "enclave%" PRId64 ";[unknown];0x%" PRIx64 " %" PRIu64 "\n",
+                    eid, addr, n);
+        }
+    }
+}
+
+static void write_profile(void)
+{
+    FILE *out = fopen(sgx_profile_path, "w");
+    size_t i, j;
+
+    if (!out) {
+        fprintf(stderr, "sgx-profile: cannot write %s: %s\n",
+                sgx_profile_path, strerror(errno));
+        return;
+    }
+
+    pthread_mutex_lock(&profile_mutex);
+    qsort(tb_profiles, nb_tb_profiles, sizeof(TBProfile *), cmp_tb_profile);
+    for (i = 0; i < nb_tb_profiles; i = j) {
+        uint64_t n = 0;
+
+        /* retranslations of the same block */
+        for (j = i; j < nb_tb_profiles && tb_profiles[j]->eid == tb_profiles[i]->eid
+                    && tb_profiles[j]->pc == tb_profiles[i]->pc; j++) {
+            n += tb_profiles[j]->icount * tb_profiles[j]->exec_n;
+        }
+        if (n) {
+            write_profile_line(out, tb_profiles[i]->eid, tb_profiles[i]->pc, n);
+        }
+    }
+    pthread_mutex_unlock(&profile_mutex);
+    fclose(out);
+}
+
+static int64_t profile_eid(CPUState *cpu)
+{
+#ifdef TARGET_I386
+    return cpu ? sgx_active_eid(cpu->env_ptr) : -1;
+#else
+    return -1;
+#endif
+}
+
+/* Caller holds profile_mutex.  */
+static TBProfile *new_tb_profile(uint64_t pc, uint64_t icount, int64_t eid)
+{
+    TBProfile *prof = g_new0(TBProfile, 1);
+
+    prof->pc = pc;
+    prof->icount = icount;
+    prof->eid = eid;
+
+    if (nb_tb_profiles == max_tb_profiles) {
+        max_tb_profiles = max_tb_profiles ? 2 * max_tb_profiles : 4096;
+        tb_profiles = g_renew(TBProfile *, tb_profiles, max_tb_profiles);
+    }
+    tb_profiles[nb_tb_profiles++] = prof;
+    return prof;
+}
+
+/* At translation: give the block its record, passed back as data1.  */
+static void pre_tb_helper_data(const TCGPluginInterface *tpi,
+                               TPIHelperInfo info, uint64_t address,
+                               uint64_t *data1, uint64_t *data2)
+{
+    TBProfile *prof;
+
+    pthread_mutex_lock(&profile_mutex);
+    prof = new_tb_profile(address, info.icount,
+                          profile_eid((CPUState *)tpi->env));
+    pthread_mutex_unlock(&profile_mutex);
+    *data1 = (uintptr_t)prof;
+}
+
+/* The record of block prof for the enclave running it now.  */
+static TBProfile *running_tb_profile(TBProfile *prof)
+{
+    int64_t eid = profile_eid(current_cpu);
+    TBProfile *p;
+
+    for (p = prof; p; p = atomic_read(&p->next)) {
+        if (p->eid == eid) {
+            return p;
+        }
+    }
+
+    pthread_mutex_lock(&profile_mutex);
+    for (p = prof; p->eid != eid; p = p->next) {
+        if (!p->next) {
+            TBProfile *q = new_tb_profile(prof->pc, prof->icount, eid);
+            smp_wmb();
+            atomic_set(&p->next, q);
+        }
+    }
+    pthread_mutex_unlock(&profile_mutex);
+    return p;
+}
+
+static ICount *icount_register(void)
+{
+    ICount *c = g_new0(ICount, 1), **pp;
+
+    c->cpu_index = current_cpu ? current_cpu->cpu_index : 0;
+    pthread_mutex_lock(&icount_mutex);
+    for (pp = &icounts; *pp; pp = &(*pp)->next) {
+        ;
+    }
+    *pp = c;
+    pthread_mutex_unlock(&icount_mutex);
+    icount_self = c;
+    return c;
+}
+
+static void cpus_stopped(const TCGPluginInterface *tpi)
+{
+    ICount *c;
+
+    pthread_mutex_lock(&icount_mutex);
+    for (c = icounts; c; c = c->next) {
         printf("number of executed instructions on CPU #%d = %" PRIu64 "\n",
-                 i, icount_total[i]);
+                 c->cpu_index, atomic_read(&c->n));
+    }
+    pthread_mutex_unlock(&icount_mutex);
+    if (sgx_profile_path) {
+        write_profile();
     }
 }
 
@@ -64,7 +401,38 @@ static void pre_tb_helper_code(const TCGPluginInterface *tpi,
                                TPIHelperInfo info, uint64_t address,
                                uint64_t data1, uint64_t data2)
 {
-    icount_total[info.cpu_index] += info.icount;
+    ICount *c = icount_self ? icount_self : icount_register();
+
+    /* info.cpu_index is the vcpu that translated the block, not the one
+       running it */
+    atomic_set(&c->n, c->n + info.icount);
+    if (data1) {
+        atomic_inc(&running_tb_profile((TBProfile *)(uintptr_t)data1)->exec_n);
+    }
+}
+
+/* Guest instructions executed so far on a CPU, 0 unless counting (-i).  */
+uint64_t tcg_plugin_icount(int cpu_index)
+{
+    ICount *c;
+    uint64_t n = 0;
+
+    if (!icount_enabled) {
+        return 0;
+    }
+    /* callers ask about their own vcpu */
+    if (icount_self && icount_self->cpu_index == cpu_index) {
+        return icount_self->n;
+    }
+    pthread_mutex_lock(&icount_mutex);
+    for (c = icounts; c; c = c->next) {
+        if (c->cpu_index == cpu_index) {
+            n = atomic_read(&c->n);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&icount_mutex);
+    return n;
 }
 
 /* Hook called once all CPUs are stopped/paused.  */
@@ -84,10 +452,13 @@ void tcg_plugin_before_gen_tb(CPUState *env, TranslationBlock *tb)
     {
 	TPI_INIT_VERSION_GENERIC(tpi);
     	tpi.pre_tb_helper_code = pre_tb_helper_code;
+    	if (sgx_profile_path) {
+    	    tpi.pre_tb_helper_data = pre_tb_helper_data;
+    	}
     	tpi.cpus_stopped = cpus_stopped;
 	tpi.nb_cpus = 1;
 
-    	icount_total = g_malloc0(tpi.nb_cpus * sizeof(uint64_t));    	
+    	icount_enabled = true;
     	init++;
     }
 
@@ -16,6 +16,9 @@
 
 
 void tcg_plugin_cpus_stopped(void);
+uint64_t tcg_plugin_icount(int cpu_index);
+void tcg_plugin_profile_map(int64_t eid, uint64_t load_addr, uint64_t link_addr,
+                            uint64_t size, const char *path);
 void tcg_plugin_before_gen_tb(CPUState *env, TranslationBlock *tb);
 void tcg_plugin_after_gen_tb(CPUState *env, TranslationBlock *tb);
 void tcg_plugin_after_gen_opc(uint16_t *opcode, TCGArg *opargs, uint8_t nb_args);
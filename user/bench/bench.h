@@ -0,0 +1,41 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Helpers shared by the enclave microbenchmarks in bench/. Each one
+// reports its results as "bench: <metric> <value>" lines on stdout,
+// which bench/bench.py collects along with the emulator's own numbers.
+
+#pragma once
+
+#include "../test/test.h"
+
+static inline
+unsigned long rdtsc(void)
+{
+    unsigned int lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+}
+
+// sgx_printf() has no %lu: values are reported as 32-bit
+static inline
+void bench_result(const char *metric, unsigned long value)
+{
+    sgx_printf("bench: %s %u\n", metric, (unsigned int)value);
+}
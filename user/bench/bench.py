@@ -0,0 +1,237 @@
+#!/usr/bin/env python
+#
+# Run the enclave microbenchmarks in bench/ under the emulator and
+# report them as JSON: per benchmark, the guest instructions executed
+# (qemu -i), the instructions executed inside the enclave, the wall time
+# of the run, the "bench: <metric> <value>" lines the enclave printed and
+# the ENCLS/ENCLU latencies and paging counters of the enclave stats.
+#
+# With -b, the results are compared against a baseline written earlier
+# with -s: instruction counts are deterministic and get a tight
+# threshold (-I), times are not and get a loose one (-T). Any metric
+# over its threshold is a regression and makes the exit status 1.
+#
+#   $ cd user
+#   $ bench/bench.py -s                 # record bench/baseline.json
+#   $ bench/bench.py -b -o out.json     # later: compare against it
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+import time
+
+USER = os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+SGX = os.path.join(USER, '..', 'sgx')
+RUNTIME = os.path.join(USER, 'sgx-test-runtime')
+BASELINE = os.path.join(USER, 'bench', 'baseline.json')
+
+# Extra environment of a benchmark
+ENV = {
+    'paging': {'OPENSGX_EPC_RESIDENT': '256'},
+}
+
+# Metrics compared with the instruction count threshold
+EXACT = ('icount', 'enclave_insns')
+
+
+# Counts, as opposed to times: never merged by min, and any growth
+# from a zero baseline is a regression
+def is_count(k):
+    return k in EXACT or k.endswith('_n') or k.endswith('_failures')
+
+RE_ICOUNT = re.compile(r'^number of executed instructions on CPU #\d+ = (\d+)')
+RE_BENCH = re.compile(r'^bench: (\w+) (\d+)')
+RE_HIST = re.compile(r'^(\w+)\s*: n (\d+), mean (\d+) (ns|insns), max')
+RE_COUNT = re.compile(r'^(ewb|eldu|epc fault) count\s*: (\d+)')
+RE_PAGING = re.compile(r'^paging time\s*: (\d+) ns')
+
+
+def benchmarks():
+    names = [f[:-2] for f in os.listdir(os.path.join(USER, 'bench')) if f.endswith('.c')]
+    return sorted(names)
+
+
+def parse(out):
+    res = {'icount': None, 'metrics': {}}
+    metrics = res['metrics']
+    paged = 0
+
+    for line in out.splitlines():
+        m = RE_ICOUNT.match(line)
+        if m:
+            res['icount'] = int(m.group(1))
+            continue
+        m = RE_BENCH.match(line)
+        if m:
+            metrics[m.group(1)] = int(m.group(2))
+            continue
+        m = RE_HIST.match(line)
+        if m:
+            name, n, mean, unit = m.group(1), int(m.group(2)), int(m.group(3)), m.group(4)
+            if unit == 'insns':
+                # print_hist() truncates the mean: off by less than n
+                if name == 'inside':
+                    metrics['enclave_insns'] = n * mean
+            elif name != 'outside':
+                metrics[name + '_ns'] = mean
+            continue
+        m = RE_COUNT.match(line)
+        if m:
+            metrics[m.group(1).replace(' ', '_') + '_n'] = int(m.group(2))
+            if m.group(1) != 'epc fault':
+                paged += int(m.group(2))
+            continue
+        m = RE_PAGING.match(line)
+        if m and paged:
+            metrics['paging_ns_per_page'] = int(m.group(1)) // paged
+    return res
+
+
+def run(name, build):
+    binary = 'bench/%s.sgx' % name
+    if build:
+        subprocess.check_call(['make', '-s', binary], cwd=USER)
+
+    env = dict(os.environ)
+    env.update(ENV.get(name, {}))
+
+    beg = time.time()
+    proc = subprocess.Popen([SGX, '-i', RUNTIME, binary], cwd=USER, env=env,
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                            universal_newlines=True)
+    out, errs = proc.communicate()
+    wall = time.time() - beg
+
+    if proc.returncode != 0:
+        sys.stderr.write(errs)
+        raise SystemExit('%s: exited with %d' % (binary, proc.returncode))
+
+    res = parse(out)
+    if res['icount'] is None:
+        raise SystemExit('%s: no instruction count (is qemu built with the tcg plugin?)' % binary)
+    res['wall_ns'] = int(wall * 1e9)
+    return res
+
+
+# Keep the best of several runs: the minimum of every time, the
+# instruction counts of the first run
+def merge(best, res):
+    if best is None:
+        return res
+    best['wall_ns'] = min(best['wall_ns'], res['wall_ns'])
+    for k, v in res['metrics'].items():
+        if k in best['metrics'] and not is_count(k):
+            best['metrics'][k] = min(best['metrics'][k], v)
+    return best
+
+
+def flatten(res):
+    flat = dict(res['metrics'])
+    flat['icount'] = res['icount']
+    flat['wall_ns'] = res['wall_ns']
+    return flat
+
+
+def compare(results, baseline, time_pct, exact_pct):
+    regressions = 0
+
+    print('%-10s %-28s %14s %14s %9s' % ('benchmark', 'metric', 'baseline', 'now', 'change'),
+          file=sys.stderr)
+    for name in sorted(results):
+        if name not in baseline:
+            print('%-10s (not in the baseline)' % name, file=sys.stderr)
+            continue
+        old, new = flatten(baseline[name]), flatten(results[name])
+        for k in sorted(new):
+            if k not in old:
+                continue
+            if not old[k]:
+                # no ratio to a zero baseline; times are just noise here
+                if not is_count(k) or not new[k]:
+                    continue
+                change = float('inf')
+            else:
+                change = 100.0 * (new[k] - old[k]) / old[k]
+            limit = exact_pct if is_count(k) else time_pct
+            mark = ''
+            if change > limit:
+                mark = ' REGRESSION'
+                regressions += 1
+            print('%-10s %-28s %14d %14d %+8.1f%%%s' % (name, k, old[k], new[k], change, mark),
+                  file=sys.stderr)
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description='run the enclave microbenchmarks in bench/')
+    parser.add_argument('names', nargs='*', metavar='bench',
+                        help='benchmarks to run (default: all of %s)' % ', '.join(benchmarks()))
+    parser.add_argument('-o', '--output', help='write the JSON results here instead of stdout')
+    parser.add_argument('-r', '--runs', type=int, default=1,
+                        help='runs per benchmark; times are the best run (default: 1)')
+    parser.add_argument('-s', '--save', action='store_true',
+                        help='also store the results as the baseline')
+    parser.add_argument('-b', '--baseline', nargs='?', const=BASELINE,
+                        help='compare against this baseline (default: %s)'
+                             % os.path.relpath(BASELINE))
+    parser.add_argument('-T', '--threshold', type=float, default=15.0,
+                        help='regression threshold for times, in percent (default: 15)')
+    parser.add_argument('-I', '--icount-threshold', type=float, default=1.0,
+                        help='regression threshold for instruction and event counts, '
+                             'in percent (default: 1)')
+    parser.add_argument('-n', '--no-build', action='store_true',
+                        help="don't make the benchmarks first")
+    args = parser.parse_args()
+
+    names = args.names or benchmarks()
+    for name in names:
+        if name not in benchmarks():
+            parser.error('no benchmark %s' % name)
+
+    # before -s overwrites it
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)['benchmarks']
+
+    results = {}
+    for name in names:
+        best = None
+        for _ in range(max(args.runs, 1)):
+            best = merge(best, run(name, not args.no_build))
+        results[name] = best
+        print('%-10s icount %d, %.2f s' % (name, best['icount'], best['wall_ns'] / 1e9),
+              file=sys.stderr)
+
+    doc = {
+        'version': 1,
+        'host': platform.node(),
+        'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'runs': args.runs,
+        'benchmarks': results,
+    }
+    text = json.dumps(doc, indent=2, sort_keys=True) + '\n'
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+    if args.save:
+        with open(BASELINE, 'w') as f:
+            f.write(text)
+
+    if args.baseline:
+        regressions = compare(results, baseline, args.threshold, args.icount_threshold)
+        if regressions:
+            print('%d regression(s) against %s' % (regressions, args.baseline), file=sys.stderr)
+            return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,151 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// In-enclave crypto throughput with polarssl_sgx: AES-128-CBC and
+// SHA-256 over a BUF_SIZE buffer (cycles per KB), and the public and
+// private operations of a fixed RSA-1024 key (cycles per operation).
+// The key is polarssl's self-test key rather than a generated one, so
+// that every run executes the same instructions.
+
+// before bench.h, which pulls in the host polarssl headers
+#include "../polarssl_sgx/include/polarssl/aes.h"
+#include "../polarssl_sgx/include/polarssl/sha256.h"
+#include "../polarssl_sgx/include/polarssl/rsa.h"
+
+#include "bench.h"
+
+#define BUF_SIZE    (16 * 1024)
+#define ROUNDS      16
+#define RSA_PUB_N   64
+#define RSA_PRIV_N  8
+
+#define RSA_N   "9292758453063D803DD603D5E777D788" \
+                "8ED1D5BF35786190FA2F23EBC0848AEA" \
+                "DDA92CA6C3D80B32C4D109BE0F36D6AE" \
+                "7130B9CED7ACDF54CFC7555AC14EEBAB" \
+                "93A89813FBF3C4F8066D2D800F7C38A8" \
+                "1AE31942917403FF4946B0A83D3D3E05" \
+                "EE57C6F5F5606FB5D4BC6CD34EE0801A" \
+                "5E94BB77B07507233A0BC7BAC8F90F79"
+#define RSA_E   "10001"
+#define RSA_D   "24BF6185468786FDD303083D25E64EFC" \
+                "66CA472BC44D253102F8B4A9D3BFA750" \
+                "91386C0077937FE33FA3252D28855837" \
+                "AE1B484A8A9A45F7EE8C0C634F99E8CD" \
+                "DF79C5CE07EE72C7F123142198164234" \
+                "CABB724CF78B8173B9F880FC86322407" \
+                "AF1FEDFDDE2BEB674CA15F3E81A1521E" \
+                "071513A1E85B5DFA031F21ECAE91A34D"
+#define RSA_P   "C36D0EB7FCD285223CFB5AABA5BDA3D8" \
+                "2C01CAD19EA484A87EA4377637E75500" \
+                "FCB2005C5C7DD6EC4AC023CDA285D796" \
+                "C3D9E75E1EFC42488BB4F1D13AC30A57"
+#define RSA_Q   "C000DF51A7C77AE8D7C7370C1FF55B69" \
+                "E211C2B9E5DB1ED0BF61D0D9899620F4" \
+                "910E4168387E3C30AA1E00C339A79508" \
+                "8452DD96A9A5EA5D9DCA68DA636032AF"
+#define RSA_DP  "C1ACF567564274FB07A0BBAD5D26E298" \
+                "3C94D22288ACD763FD8E5600ED4A702D" \
+                "F84198A5F06C2E72236AE490C93F07F8" \
+                "3CC559CD27BC2D1CA488811730BB5725"
+#define RSA_DQ  "4959CBF6F8FEF750AEE6977C155579C7" \
+                "D8AAEA56749EA28623272E4F7D0592AF" \
+                "7C1F1313CAC9471B5C523BFE592F517B" \
+                "407A1BD76C164B93DA2D32A383E58357"
+#define RSA_QP  "9AE7FBC99546432DF71896FC239EADAE" \
+                "F38D18D2B2F0E2DD275AA977E2BF4411" \
+                "F5A3B2A5D33605AEBBCCBA7FEB9F2D2F" \
+                "A74206CEC169D74BF5A8C50D6F48EA08"
+
+static unsigned char buf[BUF_SIZE];
+static aes_context aes;
+static rsa_context rsa;
+
+static
+void bench_aes(void)
+{
+    unsigned char key[16] = "thiskeyisverybad";
+    unsigned char iv[16] = { 0 };
+    unsigned long beg;
+
+    sgx_aes_init(&aes);
+    sgx_aes_setkey_enc(&aes, key, 128);
+
+    beg = rdtsc();
+    for (int i = 0; i < ROUNDS; i++)
+        sgx_aes_crypt_cbc(&aes, AES_ENCRYPT, BUF_SIZE, iv, buf, buf);
+    bench_result("aes128_cbc_cycles_per_kb",
+                 (rdtsc() - beg) / (ROUNDS * BUF_SIZE / 1024));
+}
+
+static
+void bench_sha256(void)
+{
+    unsigned char hash[32];
+    unsigned long beg = rdtsc();
+
+    for (int i = 0; i < ROUNDS; i++)
+        sgx_sha256(buf, BUF_SIZE, hash, 0);
+    bench_result("sha256_cycles_per_kb",
+                 (rdtsc() - beg) / (ROUNDS * BUF_SIZE / 1024));
+}
+
+static
+void bench_rsa(void)
+{
+    unsigned char in[128], out[128];
+    unsigned long beg;
+
+    sgx_rsa_init(&rsa, RSA_PKCS_V15, 0);
+    rsa.len = sizeof(in);
+    if (sgx_mpi_read_string(&rsa.N, 16, RSA_N)
+        || sgx_mpi_read_string(&rsa.E, 16, RSA_E)
+        || sgx_mpi_read_string(&rsa.D, 16, RSA_D)
+        || sgx_mpi_read_string(&rsa.P, 16, RSA_P)
+        || sgx_mpi_read_string(&rsa.Q, 16, RSA_Q)
+        || sgx_mpi_read_string(&rsa.DP, 16, RSA_DP)
+        || sgx_mpi_read_string(&rsa.DQ, 16, RSA_DQ)
+        || sgx_mpi_read_string(&rsa.QP, 16, RSA_QP)) {
+        sgx_printf("failed to load the RSA key\n");
+        return;
+    }
+
+    // below the modulus
+    sgx_memset(in, 0x5a, sizeof(in));
+    in[0] = 0;
+
+    beg = rdtsc();
+    for (int i = 0; i < RSA_PUB_N; i++)
+        sgx_rsa_public(&rsa, in, out);
+    bench_result("rsa1024_public_cycles", (rdtsc() - beg) / RSA_PUB_N);
+
+    beg = rdtsc();
+    for (int i = 0; i < RSA_PRIV_N; i++)
+        sgx_rsa_private(&rsa, NULL, in, out);
+    bench_result("rsa1024_private_cycles", (rdtsc() - beg) / RSA_PRIV_N);
+
+    sgx_rsa_free(&rsa);
+}
+
+void enclave_main()
+{
+    bench_aes();
+    bench_sha256();
+    bench_rsa();
+}
@@ -0,0 +1,34 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// EADD/EEXTEND per page: an enclave image padded with PAGES pages of
+// data, all of which are added and measured when the enclave is built.
+// bench.py reads the per-leaf latencies from the enclave stats.
+
+#include "bench.h"
+
+#define PAGES 512
+
+// initialized, so that it is part of the image
+char bench_image[PAGES * PAGE_SIZE] = { 1 };
+
+void enclave_main()
+{
+    bench_result("eadd_image_pages", PAGES);
+}
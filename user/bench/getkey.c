@@ -0,0 +1,47 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// EGETKEY and EREPORT, back to back from inside the enclave. Prints
+// cycles per leaf; bench.py adds the emulator's own latencies.
+
+#include "bench.h"
+
+#define N 1000
+
+static keyrequest_t keyreq __attribute__((aligned(KEYREQUEST_ALIGN_SIZE)));
+static unsigned char key[16] __attribute__((aligned(16)));
+static targetinfo_t targetinfo __attribute__((aligned(512)));
+static unsigned char reportdata[64] __attribute__((aligned(128)));
+static report_t report __attribute__((aligned(512)));
+
+void enclave_main()
+{
+    unsigned long beg;
+
+    keyreq.keyname = REPORT_KEY;
+    beg = rdtsc();
+    for (int i = 0; i < N; i++)
+        sgx_getkey(&keyreq, key);
+    bench_result("egetkey_cycles", (rdtsc() - beg) / N);
+
+    beg = rdtsc();
+    for (int i = 0; i < N; i++)
+        sgx_report(&targetinfo, reportdata, &report);
+    bench_result("ereport_cycles", (rdtsc() - beg) / N);
+}
@@ -0,0 +1,72 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// sgx_malloc churn: a window of SLOTS live blocks where every step
+// frees a random slot and refills it with a block of random size,
+// mostly small (slab) sizes with an occasional large block that goes
+// to the chunk heap. Prints cycles per malloc/free pair.
+
+#include "bench.h"
+
+#define SLOTS     256
+#define N         20000
+#define SMALL_MAX 512
+#define LARGE_MAX (64 * 1024)
+
+static void *slots[SLOTS];
+static unsigned int seed = 1;
+
+static
+unsigned int next_rand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7fff;
+}
+
+static
+size_t next_size(void)
+{
+    if (next_rand() % 16 == 0)
+        return SMALL_MAX + (next_rand() * 4) % (LARGE_MAX - SMALL_MAX);
+    return 1 + next_rand() % SMALL_MAX;
+}
+
+void enclave_main()
+{
+    heapstat_t st;
+    unsigned long beg;
+
+    for (int i = 0; i < SLOTS; i++)
+        slots[i] = sgx_malloc(next_size());
+
+    beg = rdtsc();
+    for (int i = 0; i < N; i++) {
+        int s = next_rand() % SLOTS;
+
+        sgx_free(slots[s]);
+        slots[s] = sgx_malloc(next_size());
+    }
+    bench_result("malloc_free_cycles", (rdtsc() - beg) / N);
+
+    sgx_malloc_stat(&st);
+    bench_result("malloc_failures", st.fail_n);
+
+    for (int i = 0; i < SLOTS; i++)
+        sgx_free(slots[i]);
+}
@@ -0,0 +1,38 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Ocall round-trip: EEXIT to the trampoline, a host call that does no
+// work (time()) and EENTER back, as seen from inside the enclave.
+
+#include "bench.h"
+
+#define N 2000
+
+void enclave_main()
+{
+    unsigned long beg;
+
+    // warm up the stub and the trampoline
+    sgx_time(NULL);
+
+    beg = rdtsc();
+    for (int i = 0; i < N; i++)
+        sgx_time(NULL);
+    bench_result("ocall_cycles", (rdtsc() - beg) / N);
+}
@@ -0,0 +1,42 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// EWB/ELDU per page: PASSES sweeps over a buffer of PAGES pages, one
+// write per page, run by bench.py with OPENSGX_EPC_RESIDENT well below
+// PAGES so that every touch of a cold page evicts another one. Prints
+// cycles per touch, paging included; bench.py adds the EWB/ELDU counts
+// and latencies from the enclave stats.
+
+#include "bench.h"
+
+#define PAGES  768
+#define PASSES 4
+
+static char buf[PAGES * PAGE_SIZE];
+
+void enclave_main()
+{
+    unsigned long beg = rdtsc();
+
+    for (int p = 0; p < PASSES; p++) {
+        for (int i = 0; i < PAGES; i++)
+            buf[i * PAGE_SIZE] = (char)p;
+    }
+    bench_result("page_touch_cycles", (rdtsc() - beg) / (PAGES * PASSES));
+}
@@ -52,10 +52,16 @@ extern epc_t *get_epc_region_beg(void);
 extern epc_t *get_epc_region_end(void);
 extern epc_t *alloc_epc_pages(int npages, int key);
 extern epc_t *alloc_epc_page(int key);
+extern epc_t *get_epc_at(epc_t *epc, epc_type_t pt);
+extern int alloc_epc_pages_at(epc_t *epc, int npages, int key, epc_type_t pt);
+extern void free_epc_page(epc_t *epc);
 extern void free_epc_pages(epc_t *epc);
 
 extern void dbg_dump_epc(void);
 
 extern int find_epc_type(void *addr);
+extern int find_epc_key(void *addr);
+extern int get_num_used_epc(void);
+extern int get_num_reserved_epc(void);
 
 extern void free_reserved_epc_pages(epc_t *epc);
@@ -0,0 +1,43 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <sgx-kern-epc.h>
+
+//
+// EPC paging.
+//
+// In linux-user an enclave page lives at the address of its EPC slot, so
+// what is scarce is not EPC address space but resident EPC pages. With
+// OPENSGX_EPC_RESIDENT=n at most n EPC pages hold plaintext: cold
+// enclave pages are EBLOCKed and EWBed to an untrusted backing store in
+// host memory, and the enclave access that next touches one faults
+// (SIGSEGV at the page) and reloads it with ELDU. Victims are picked by
+// a CLOCK hand over the accessed bits from ENCLS_OSGX_EPC_AGE. The same
+// fault handler EAUGs lazily provisioned stack and heap pages (see
+// EPC_LAZY_ENV in sgx-utils.h).
+//
+#define EPC_RESIDENT_ENV "OPENSGX_EPC_RESIDENT"
+
+extern void paging_init(int nepc, int va_key);
+extern bool paging_enabled(void);
+extern void paging_reserve(int npages);
+extern void paging_pin(epc_t *epc, int npages);
+extern bool paging_fault(void *addr);
@@ -37,9 +37,21 @@ extern int sys_create_enclave(void *base, unsigned int code_pages,
                               tcs_t *tcs, sigstruct_t *sig, einittoken_t *token,
                               int intel_flag);
 extern int sys_stat_enclave(int keid, keid_t *stat);
+extern int sys_stat_heap(int keid, heapstat_t *stat);
 extern unsigned long get_epc_heap_beg();
 extern unsigned long get_epc_heap_end();
-extern unsigned long sys_add_epc(int keid);
+extern int sys_add_epc(int keid, unsigned long addr, int npages);
+extern int sys_trim_epc(int keid, unsigned long addr, int npages);
+extern int sys_remove_epc(int keid, unsigned long addr, int npages);
+extern int sys_profile_enclave(int keid, char *binary, uint64_t link_addr);
+extern bool lazy_fault(void *addr);
+
+// ENCLS leaves used by the EPC pager (sgx-kern-paging.c)
+extern int EBLOCK(uint64_t epc_addr);
+extern int EWB_N(paging_req_t *reqs, int nreqs);
+extern int ELD_N(paging_req_t *reqs, int nreqs, int leaf);
+extern epc_t *EPA(int keid);
+extern int EPC_AGE(epc_t *epc, int npages, uint8_t *ages);
 
 // For unit test
 void test_ecreate(pageinfo_t *pageinfo, epc_t *epc);
@@ -27,7 +27,10 @@
 
 #include <netinet/in.h>
 
+// The final EEXIT (ptr == NULL) flushes the buffered console output
 #define sgx_exit(ptr) {                         \
+    if (!(ptr))                                 \
+        sgx_flush();                            \
     asm volatile("movl %0, %%eax\n\t"           \
                  "movq %1, %%rbx\n\t"           \
                  ".byte 0x0F\n\t"               \
@@ -69,17 +72,6 @@
 #define sgx_htons(A) ((((uint16_t)(A) & 0xff00) >> 8) | \
                      (((uint16_t)(A) & 0x00ff) << 8))
 
-struct mem_control_block {
-    int is_available;
-    int size;
-};
-/*
-static unsigned long cur_heap_ptr = 0x0;
-static unsigned long heap_end = 0x0;
-static int has_initialized = 0;
-static void *managed_memory_start = 0;
-static int g_total_chunk = 0;
-*/
 extern void _enclu(enclu_cmd_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
            out_regs_t *out_regs);
 
@@ -106,10 +98,12 @@ extern ssize_t sgx_recv(int fd, void *buf, size_t len, int flag);
 
 extern int sgx_printf(const char *format, ...);
 extern void sgx_putchar(char c);
+extern void sgx_flush(void);
 extern void sgx_print_hex(unsigned long addr);
 extern void *sgx_malloc(size_t numbytes);
 extern void sgx_free(void *ptr);
 extern void sgx_malloc_init();
+extern void sgx_malloc_stat(heapstat_t *stat);
 
 extern int sgx_tolower(int c);
 extern int sgx_toupper(int c);
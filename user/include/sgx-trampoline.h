@@ -36,6 +36,7 @@ typedef enum {
     FUNC_UNSET,
     FUNC_PUTS,
     FUNC_PUTCHAR,
+    FUNC_PRINT,                         // out_arg1 bytes of out_data1 to stdout
 
     FUNC_MALLOC,
     FUNC_FREE,
@@ -59,7 +60,10 @@ typedef enum {
 typedef enum {
     MALLOC_UNSET,
     MALLOC_INIT,
-    REQUEST_EAUG,
+    REQUEST_EAUG,                       // out_arg1 pages at addr
+    MALLOC_STAT,                        // heapstat_t in out_data1
+    REQUEST_EMODT,                      // trim the top of out_arg1 pages at addr
+    REQUEST_EREMOVE,                    // remove them once accepted
 } mcode_t;
 
 
@@ -91,6 +95,38 @@ typedef struct sgx_stub_info {
     char out_data3[SGXLIB_MAX_ARG];
 } sgx_stub_info;
 
+// Switchless ocalls: a ring of stubs right after the exit stub page.
+// The enclave posts a request into a free slot and spins on its state
+// while a host worker thread services it, instead of EEXIT/ERESUME.
+// Turned on by sgx_init() when OCALL_RING_ENV is set, the worker runs
+// for the span of each sgx_enter(); when the ring is off or full, calls
+// fall back to the exit stub at STUB_ADDR.
+#define OCALL_RING_ADDR  (STUB_ADDR + PAGE_SIZE)
+#define OCALL_RING_SLOTS 16
+#define OCALL_RING_ENV   "OPENSGX_SWITCHLESS"
+
+typedef enum {
+    OCALL_FREE,                         // owned by the enclave
+    OCALL_POSTED,                       // waiting for the worker
+    OCALL_DONE,                         // result ready, enclave frees it
+} ocall_state_t;
+
+typedef struct sgx_ocall_slot {
+    volatile int state;                 // ocall_state_t
+    int   wait;                         // 0: worker frees the slot itself
+    sgx_stub_info call;
+} __attribute__((aligned(PAGE_SIZE))) sgx_ocall_slot;
+
+typedef struct sgx_ocall_ring {
+    volatile int enabled;               // set once the worker runs
+    unsigned int tail;                  // next slot to serve (host only)
+    volatile unsigned long served;
+    volatile unsigned long fallback;    // calls that found the ring full
+    sgx_ocall_slot slot[OCALL_RING_SLOTS] __attribute__((aligned(PAGE_SIZE)));
+} sgx_ocall_ring;
+
 extern void execute_code(void);
 extern void sgx_trampoline(void);
 extern int sgx_init(void);
+extern void ocall_start(void);
+extern void ocall_stop(void);
@@ -28,6 +28,22 @@ extern void enclu(enclu_cmd_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
                   out_regs_t* out_regs);
 tcs_t *init_enclave(void *base_addr, unsigned int entry_offset, unsigned int n_of_pages, char *conf);
 
+// Where the enclave is in an .sgx binary: .enc_text's file offset and
+// the addresses of the symbols sgx.lds and sgx-main.c define
+typedef struct {
+    long     size;                  //!< file size in bytes
+    long     offset;                //!< file offset of .enc_text
+    uint64_t code_start;            //!< ENCT_START
+    uint64_t code_end;              //!< ENCT_END
+    uint64_t data_start;            //!< ENCD_START
+    uint64_t data_end;              //!< ENCD_END
+    uint64_t entry;                 //!< enclave_start
+} enclave_layout_t;
+
+extern bool OpenSGX_layout(char *binary, enclave_layout_t *layout);
+extern bool OpenSGX_layout_args(char **args, enclave_layout_t *layout);
+extern void *OpenSGX_loader(char *binary, int size, long offset, int n_of_pages);
+extern void OpenSGX_unload(void *base_addr, int n_of_pages);
 extern tcs_t *test_init_enclave(void *base_addr, unsigned int entry_offset, unsigned int n_of_code_pages);
 extern void exception_handler(void);
 
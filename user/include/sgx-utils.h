@@ -21,6 +21,12 @@
 
 #include <sgx.h>
 
+// With OPENSGX_EPC_LAZY=1, ELRANGE keeps its full size but only the
+// core of the enclave (SECS, TCS, TLS, code/data, SSA) is EADDed and
+// measured; stack and heap pages are EAUGed on first touch. sgx-tool
+// must run with the same setting as the runtime, or EINIT fails.
+#define EPC_LAZY_ENV "OPENSGX_EPC_LAZY"
+
 //#define NUM_BYTES 8
 //#define ENCLAVE_OFFSET 0x20004000
 
@@ -37,3 +43,4 @@ extern einittoken_t *load_einittoken(char *conf);
 extern void hexdump(FILE *fp, void *addr, int len);
 extern void load_bytes_from_str(uint8_t *key, char *bytes, size_t size);
 extern int rop2(int val);
+extern bool lazy_epc(void);
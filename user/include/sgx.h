@@ -53,12 +53,9 @@ int to_npages(int size) {
     return (size - 1) / PAGE_SIZE + 1;
 }
 
-// OS resource management for enclave
-#define MAX_ENCLAVES 16
-
 typedef struct {
     unsigned int mode_switch;
-    unsigned int tlbflush_n;
+    unsigned int tlbflush_n;            // TLB entries invalidated on transitions
 
     unsigned int encls_n;
     unsigned int ecreate_n;
@@ -74,20 +71,58 @@ typedef struct {
     unsigned int egetkey_n;
     unsigned int ereport_n;
     unsigned int eaccept_n;
+
+    // Same layout as the emulator's stat_t from here on
+    stat_hist_t encls_ns[STAT_ENCLS_LEAVES];
+    stat_hist_t enclu_ns[STAT_ENCLU_LEAVES];
+    stat_hist_t inside_ns;
+    stat_hist_t inside_insn;
+    stat_hist_t outside_ns;
+    stat_hist_t outside_insn;
 } qstat_t;
 
+// Enclave heap (sgx_malloc), as last reported by the enclave
+typedef struct {
+    unsigned long heap_size;            // pre-allocated and EAUGed bytes
+    unsigned long heap_top;             // bytes carved out so far
+    unsigned long in_use;               // bytes in live blocks
+    unsigned long peak_in_use;
+    unsigned long slab_bytes;
+    unsigned long realloc_copied;       // bytes moved by sgx_realloc
+    unsigned int  slab_n;
+    unsigned int  large_n;              // live blocks not in a slab
+    unsigned int  malloc_n;
+    unsigned int  free_n;
+    unsigned int  realloc_n;
+    unsigned int  realloc_inplace_n;
+    unsigned int  fail_n;
+    unsigned int  eaug_n;               // pages EAUGed and accepted
+    unsigned int  trim_n;               // pages trimmed
+} heapstat_t;
+
 typedef struct {
     int keid;
     uint64_t enclave;
+    uint64_t enclave_size;
     tcs_t *tcs;
     epc_t *secs;
     // XXX. stats
     unsigned int kin_n;
     unsigned int kout_n;
+    uint64_t code_addr;                 // where .enc_text/.enc_data were EADDed
+    unsigned int code_npages;
     unsigned long prealloc_ssa;
     unsigned long prealloc_stack;
     unsigned long prealloc_heap;
     unsigned long augged_heap;
+    unsigned long trimmed_heap;
+    unsigned int lazy_n;                // stack/heap pages EAUGed on first touch
+    // EPC paging, see sgx-kern-paging.h
+    unsigned int ewb_n;
+    unsigned int eldu_n;
+    unsigned int epc_fault_n;
+    unsigned long paging_ns;
 
     qstat_t qstat;
+    heapstat_t heapstat;
 } keid_t;
@@ -0,0 +1,75 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <emmintrin.h>
+
+//
+// Shared by the enclave sgx_mem*() kernels.
+//
+// They are SSE2 only: it is part of x86-64, so no dispatch is needed,
+// and the emulated CPU does not decode VEX (AVX/AVX2) instructions.
+// Sizes up to 32 bytes are done with a pair of possibly overlapping
+// loads and stores from each end; larger ones store aligned 16-byte
+// vectors in between an unaligned head and tail.
+//
+// The enclave is linked without libc, so these files are built with
+// -fno-tree-loop-distribute-patterns to keep gcc from turning loops
+// back into memcpy()/memset() calls.
+//
+#define MEM_SMALL       32
+#define MEM_NT          (1UL << 20)     //!< stream memcpy()s this size or larger
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) mem_u64;
+typedef uint32_t __attribute__((may_alias, aligned(1))) mem_u32;
+typedef uint16_t __attribute__((may_alias, aligned(1))) mem_u16;
+
+#define MEM_LD(p)       _mm_loadu_si128((const __m128i *)(p))
+#define MEM_ST(p, v)    _mm_storeu_si128((__m128i *)(p), (v))
+#define MEM_STA(p, v)   _mm_store_si128((__m128i *)(p), (v))
+#define MEM_STNT(p, v)  _mm_stream_si128((__m128i *)(p), (v))
+
+// Copy n <= MEM_SMALL bytes. Everything is loaded before it is stored,
+// so src and dst may overlap.
+static inline
+void mem_copy_small(unsigned char *d, const unsigned char *s, size_t n)
+{
+    if (n >= 16) {
+        __m128i a = MEM_LD(s), b = MEM_LD(s + n - 16);
+        MEM_ST(d, a);
+        MEM_ST(d + n - 16, b);
+    } else if (n >= 8) {
+        uint64_t a = *(const mem_u64 *)s, b = *(const mem_u64 *)(s + n - 8);
+        *(mem_u64 *)d = a;
+        *(mem_u64 *)(d + n - 8) = b;
+    } else if (n >= 4) {
+        uint32_t a = *(const mem_u32 *)s, b = *(const mem_u32 *)(s + n - 4);
+        *(mem_u32 *)d = a;
+        *(mem_u32 *)(d + n - 4) = b;
+    } else if (n >= 2) {
+        uint16_t a = *(const mem_u16 *)s, b = *(const mem_u16 *)(s + n - 2);
+        *(mem_u16 *)d = a;
+        *(mem_u16 *)(d + n - 2) = b;
+    } else if (n == 1) {
+        *d = *s;
+    }
+}
@@ -0,0 +1,288 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sgx-lib.h>
+#include "sgx-mem.h"
+
+// Copy n > MEM_SMALL bytes upwards. The head and tail are loaded first
+// and the loop reads each source vector before storing over it, so this
+// is also right for an overlapping move to a lower address.
+static
+void copy_fwd(unsigned char *d, const unsigned char *s, size_t n, int nt)
+{
+    __m128i head = MEM_LD(s), tail = MEM_LD(s + n - 16);
+    unsigned char *end = d + n;
+    size_t skew = 16 - ((uintptr_t)d & 15);
+    unsigned char *p = d + skew;
+    const unsigned char *q = s + skew;
+
+    if (nt) {
+        for (; p + 64 <= end; p += 64, q += 64) {
+            __m128i a = MEM_LD(q), b = MEM_LD(q + 16);
+            __m128i c = MEM_LD(q + 32), e = MEM_LD(q + 48);
+            MEM_STNT(p, a);
+            MEM_STNT(p + 16, b);
+            MEM_STNT(p + 32, c);
+            MEM_STNT(p + 48, e);
+        }
+        _mm_sfence();
+    }
+    for (; p + 64 <= end; p += 64, q += 64) {
+        __m128i a = MEM_LD(q), b = MEM_LD(q + 16);
+        __m128i c = MEM_LD(q + 32), e = MEM_LD(q + 48);
+        MEM_STA(p, a);
+        MEM_STA(p + 16, b);
+        MEM_STA(p + 32, c);
+        MEM_STA(p + 48, e);
+    }
+    for (; p + 16 <= end; p += 16, q += 16)
+        MEM_STA(p, MEM_LD(q));
+
+    MEM_ST(d, head);
+    MEM_ST(end - 16, tail);
+}
+
+// Mirror of copy_fwd() for an overlapping move to a higher address
+static
+void copy_bwd(unsigned char *d, const unsigned char *s, size_t n)
+{
+    __m128i head = MEM_LD(s), tail = MEM_LD(s + n - 16);
+    size_t skew = ((uintptr_t)(d + n) & 15) ? ((uintptr_t)(d + n) & 15) : 16;
+    unsigned char *p = d + n - skew;
+    const unsigned char *q = s + n - skew;
+
+    for (; p - d >= 64; p -= 64, q -= 64) {
+        __m128i a = MEM_LD(q - 16), b = MEM_LD(q - 32);
+        __m128i c = MEM_LD(q - 48), e = MEM_LD(q - 64);
+        MEM_STA(p - 16, a);
+        MEM_STA(p - 32, b);
+        MEM_STA(p - 48, c);
+        MEM_STA(p - 64, e);
+    }
+    for (; p - d >= 16; p -= 16, q -= 16)
+        MEM_STA(p - 16, MEM_LD(q - 16));
+
+    MEM_ST(d, head);
+    MEM_ST(d + n - 16, tail);
+}
+
+void *sgx_memcpy(void *dest, const void *src, size_t size)
+{
+    if (size <= MEM_SMALL)
+        mem_copy_small(dest, src, size);
+    else
+        copy_fwd(dest, src, size, size >= MEM_NT);
+    return dest;
+}
+
+void *sgx_memmove(void *dest, const void *src, size_t size)
+{
+    if (size <= MEM_SMALL)
+        mem_copy_small(dest, src, size);
+    else if ((uintptr_t)dest - (uintptr_t)src >= size)
+        copy_fwd(dest, src, size, 0);       // dest below src, or disjoint
+    else
+        copy_bwd(dest, src, size);
+    return dest;
+}
+
+#ifdef UNITTEST
+//
+// Check the sgx_mem*() kernels and time them against glibc
+//   $ gcc -DUNITTEST -std=gnu1x -O2 -fcommon -fno-tree-loop-distribute-patterns -I../include
+//         -o mem-bench sgx-memcpy.c sgx-memset.c sgx-memcmp.c
+//
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUF_SIZE    (256 * 1024)
+#define BENCH_BYTES (1UL << 30)
+
+static unsigned char *src, *dst, *ref;
+
+static
+double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static
+void fill(unsigned char *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        p[i] = rand();
+}
+
+static
+void check_copy(void)
+{
+    for (size_t n = 0; n < 600; n++) {
+        for (int so = 0; so < 16; so++) {
+            for (int doff = 0; doff < 16; doff++) {
+                fill(src, n + 32);
+                memset(dst, 0xa5, n + 64);
+                memcpy(ref, dst, n + 64);
+                memcpy(ref + doff, src + so, n);
+                sgx_memcpy(dst + doff, src + so, n);
+                assert(!memcmp(dst, ref, n + 64));
+            }
+        }
+    }
+    for (size_t n = MEM_NT - 33; n < MEM_NT + 33; n += 11) {
+        fill(src, n);
+        sgx_memcpy(dst + 3, src, n);
+        assert(!memcmp(dst + 3, src, n));
+    }
+}
+
+static
+void check_move(void)
+{
+    for (size_t n = 0; n < 600; n += (n < 80) ? 1 : 7) {
+        for (int shift = -70; shift <= 70; shift++) {
+            size_t base = 128;
+            fill(src, n + 2 * base);
+            memcpy(ref, src, n + 2 * base);
+            memmove(ref + base + shift, ref + base, n);
+            sgx_memmove(src + base + shift, src + base, n);
+            assert(!memcmp(src, ref, n + 2 * base));
+        }
+    }
+}
+
+static
+void check_set(void)
+{
+    for (size_t n = 0; n < 600; n++) {
+        for (int off = 0; off < 16; off++) {
+            memset(dst, 0x5a, n + 32);
+            memcpy(ref, dst, n + 32);
+            memset(ref + off, n & 0xff, n);
+            sgx_memset(dst + off, n & 0xff, n);
+            assert(!memcmp(dst, ref, n + 32));
+        }
+    }
+}
+
+static
+int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+static
+void check_cmp(void)
+{
+    for (size_t n = 0; n < 600; n++) {
+        for (int off = 0; off < 16; off++) {
+            fill(src + off, n);
+            memcpy(dst + 15 - off, src + off, n);
+            assert(sgx_memcmp(src + off, dst + 15 - off, n) == 0);
+            if (n == 0)
+                continue;
+            for (int k = 0; k < 4; k++) {
+                size_t i = rand() % n;
+                dst[15 - off + i] = rand();
+                assert(sign(sgx_memcmp(src + off, dst + 15 - off, n))
+                       == sign(memcmp(src + off, dst + 15 - off, n)));
+                dst[15 - off + i] = src[off + i];
+            }
+        }
+    }
+}
+
+typedef void (*bench_fn)(size_t n);
+
+// Calls go through volatile pointers so gcc cannot inline glibc away
+static void *(*volatile libc_memcpy)(void *, const void *, size_t) = memcpy;
+static void *(*volatile libc_memmove)(void *, const void *, size_t) = memmove;
+static void *(*volatile libc_memset)(void *, int, size_t) = memset;
+static int (*volatile libc_memcmp)(const void *, const void *, size_t) = memcmp;
+static volatile int sink;
+
+static void b_sgx_memcpy(size_t n)   { sgx_memcpy(dst + 1, src, n); }
+static void b_libc_memcpy(size_t n)  { libc_memcpy(dst + 1, src, n); }
+static void b_sgx_memmove(size_t n)  { sgx_memmove(src + 8, src, n); }
+static void b_libc_memmove(size_t n) { libc_memmove(src + 8, src, n); }
+static void b_sgx_memset(size_t n)   { sgx_memset(dst + 1, 0, n); }
+static void b_libc_memset(size_t n)  { libc_memset(dst + 1, 0, n); }
+static void b_sgx_memcmp(size_t n)   { sink = sgx_memcmp(ref, ref + MEM_NT, n); }
+static void b_libc_memcmp(size_t n)  { sink = libc_memcmp(ref, ref + MEM_NT, n); }
+
+static
+double bench(bench_fn fn, size_t n)
+{
+    size_t iters = BENCH_BYTES / n / 4;
+    double beg = now_ns();
+
+    for (size_t i = 0; i < iters; i++)
+        fn(n);
+    return (now_ns() - beg) / iters;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = { 16, 256, 4096, 65536 };
+    static const struct {
+        const char *name;
+        bench_fn ours, libc;
+    } ops[] = {
+        { "memcpy",  b_sgx_memcpy,  b_libc_memcpy  },
+        { "memmove", b_sgx_memmove, b_libc_memmove },
+        { "memset",  b_sgx_memset,  b_libc_memset  },
+        { "memcmp",  b_sgx_memcmp,  b_libc_memcmp  },
+    };
+
+    src = malloc(MEM_NT * 2);
+    dst = malloc(MEM_NT * 2);
+    ref = malloc(MEM_NT * 2);
+    assert(src && dst && ref);
+    srand(0);
+
+    check_copy();
+    check_move();
+    check_set();
+    check_cmp();
+    printf("sgx_mem*: all checks passed\n");
+
+    fill(src, BUF_SIZE);
+    fill(ref, BUF_SIZE);
+    memcpy(ref + MEM_NT, ref, BUF_SIZE);
+
+    printf("%-8s %8s %12s %12s %8s\n", "op", "size", "sgx ns/op", "glibc ns/op", "ratio");
+    for (int o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+        for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            double ours = bench(ops[o].ours, sizes[s]);
+            double libc = bench(ops[o].libc, sizes[s]);
+            printf("%-8s %8zu %12.1f %12.1f %8.2f\n",
+                   ops[o].name, sizes[s], ours, libc, libc / ours);
+        }
+    }
+
+    free(src);
+    free(dst);
+    free(ref);
+    return 0;
+}
+#endif
@@ -1,95 +1,63 @@
-/* Copyright (C) 1991-2015 Free Software Foundation, Inc.
-   This file is part of the GNU C Library.
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
 
-   The GNU C Library is free software; you can redistribute it and/or
-   modify it under the terms of the GNU Lesser General Public
-   License as published by the Free Software Foundation; either
-   version 2.1 of the License, or (at your option) any later version.
-
-   The GNU C Library is distributed in the hope that it will be useful,
-   but WITHOUT ANY WARRANTY; without even the implied warranty of
-   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
-   Lesser General Public License for more details.
-
-   You should have received a copy of the GNU Lesser General Public
-   License along with the GNU C Library; if not, see
-   <http://www.gnu.org/licenses/>.  */
-
-#include <string.h>
 #include <sgx-lib.h>
+#include "sgx-mem.h"
 
-#ifndef op_t
-#define op_t unsigned long int
-#endif
-
-#ifndef OPSIZ
-#define OPSIZ (sizeof(op_t))
-#endif
-
-typedef unsigned char byte;
-
-void *
-sgx_memset (void *dstpp, int c, size_t len)
+void *sgx_memset(void *ptr, int value, size_t num)
 {
-  long int dstp = (long int) dstpp;
-
-  if (len >= 8)
-    {
-      size_t xlen;
-      op_t cccc;
-
-      cccc = (unsigned char) c;
-      cccc |= cccc << 8;
-      cccc |= cccc << 16;
-      if (OPSIZ > 4)
-	/* Do the shift in two steps to avoid warning if long has 32 bits.  */
-	cccc |= (cccc << 16) << 16;
-
-      /* There are at least some bytes to set.
-	 No need to test for LEN == 0 in this alignment loop.  */
-      while (dstp % OPSIZ != 0)
-	{
-	  ((byte *) dstp)[0] = c;
-	  dstp += 1;
-	  len -= 1;
-	}
-
-      /* Write 8 `op_t' per iteration until less than 8 `op_t' remain.  */
-      xlen = len / (OPSIZ * 8);
-      while (xlen > 0)
-	{
-	  ((op_t *) dstp)[0] = cccc;
-	  ((op_t *) dstp)[1] = cccc;
-	  ((op_t *) dstp)[2] = cccc;
-	  ((op_t *) dstp)[3] = cccc;
-	  ((op_t *) dstp)[4] = cccc;
-	  ((op_t *) dstp)[5] = cccc;
-	  ((op_t *) dstp)[6] = cccc;
-	  ((op_t *) dstp)[7] = cccc;
-	  dstp += 8 * OPSIZ;
-	  xlen -= 1;
-	}
-      len %= OPSIZ * 8;
-
-      /* Write 1 `op_t' per iteration until less than OPSIZ bytes remain.  */
-      xlen = len / OPSIZ;
-      while (xlen > 0)
-	{
-	  ((op_t *) dstp)[0] = cccc;
-	  dstp += OPSIZ;
-	  xlen -= 1;
-	}
-      len %= OPSIZ;
+    unsigned char *d = ptr, *end = d + num, *p;
+    uint64_t c8 = 0x0101010101010101ULL * (unsigned char)value;
+    __m128i v;
+
+    if (num < 16) {
+        if (num >= 8) {
+            *(mem_u64 *)d = c8;
+            *(mem_u64 *)(end - 8) = c8;
+        } else if (num >= 4) {
+            *(mem_u32 *)d = (uint32_t)c8;
+            *(mem_u32 *)(end - 4) = (uint32_t)c8;
+        } else if (num >= 2) {
+            *(mem_u16 *)d = (uint16_t)c8;
+            *(mem_u16 *)(end - 2) = (uint16_t)c8;
+        } else if (num == 1) {
+            *d = (unsigned char)value;
+        }
+        return ptr;
     }
 
-  /* Write the last few bytes.  */
-  while (len > 0)
-    {
-      ((byte *) dstp)[0] = c;
-      dstp += 1;
-      len -= 1;
+    v = _mm_set1_epi8((char)value);
+    MEM_ST(d, v);
+    MEM_ST(end - 16, v);
+    if (num <= MEM_SMALL)
+        return ptr;
+
+    // aligned stores in between the unaligned head and tail
+    p = (unsigned char *)(((uintptr_t)d + 16) & ~(uintptr_t)15);
+    for (; p + 64 <= end; p += 64) {
+        MEM_STA(p, v);
+        MEM_STA(p + 16, v);
+        MEM_STA(p + 32, v);
+        MEM_STA(p + 48, v);
     }
+    for (; p + 16 <= end; p += 16)
+        MEM_STA(p, v);
 
-  return dstpp;
+    return ptr;
 }
-
@@ -132,6 +132,8 @@ extern "C" {
  */
 void sha256( const unsigned char *input, size_t ilen,
            unsigned char output[32], int is224 );
+void sgx_sha256( const unsigned char *input, size_t ilen,
+               unsigned char output[32], int is224 );
 
 #if 0
 /**
@@ -24,6 +24,7 @@
 #include <sgx-user.h>
 #include <sgx-utils.h>
 #include <sgx-crypto.h>
+#include <sgx-measure.h>
 
 #ifndef GET_UINT32_BE
 #define GET_UINT32_BE(n,b,i)                            \
@@ -46,53 +47,7 @@
 #endif
 
 static uint64_t g_update_counter;
-
-static
-void sha256init(unsigned char *hash)
-{
-    sha256_context ctx;
-
-    sha256_init(&ctx);
-    sha256_starts(&ctx, 0);
-
-    PUT_UINT32_BE(ctx.state[0], hash,  0);
-    PUT_UINT32_BE(ctx.state[1], hash,  4);
-    PUT_UINT32_BE(ctx.state[2], hash,  8);
-    PUT_UINT32_BE(ctx.state[3], hash, 12);
-    PUT_UINT32_BE(ctx.state[4], hash, 16);
-    PUT_UINT32_BE(ctx.state[5], hash, 20);
-    PUT_UINT32_BE(ctx.state[6], hash, 24);
-    PUT_UINT32_BE(ctx.state[7], hash, 28);
-}
-
-static
-void sha256update(unsigned char *input, unsigned char *hash)
-{
-    sha256_context ctx;
-
-    sha256_init(&ctx);
-    GET_UINT32_BE(ctx.state[0], hash,  0);
-    GET_UINT32_BE(ctx.state[1], hash,  4);
-    GET_UINT32_BE(ctx.state[2], hash,  8);
-    GET_UINT32_BE(ctx.state[3], hash, 12);
-    GET_UINT32_BE(ctx.state[4], hash, 16);
-    GET_UINT32_BE(ctx.state[5], hash, 20);
-    GET_UINT32_BE(ctx.state[6], hash, 24);
-    GET_UINT32_BE(ctx.state[7], hash, 28);
-
-    sha256_process(&ctx, input);
-
-    PUT_UINT32_BE(ctx.state[0], hash,  0);
-    PUT_UINT32_BE(ctx.state[1], hash,  4);
-    PUT_UINT32_BE(ctx.state[2], hash,  8);
-    PUT_UINT32_BE(ctx.state[3], hash, 12);
-    PUT_UINT32_BE(ctx.state[4], hash, 16);
-    PUT_UINT32_BE(ctx.state[5], hash, 20);
-    PUT_UINT32_BE(ctx.state[6], hash, 24);
-    PUT_UINT32_BE(ctx.state[7], hash, 28);
-
-    sha256_free(&ctx);
-}
+static measure_t g_measure;
 
 static
 void sha256final(unsigned char *hash, size_t len)
@@ -121,36 +76,37 @@ void sha256final(unsigned char *hash, size_t len)
 }
 
 static
-void measure_chunk_page(void *measurement, void *page, uint64_t chunk_offset)
+void measure_chunk_page(measure_t *measurement, void *page, uint64_t chunk_offset)
 {
     uint64_t tmp_update_field[8];
 
     tmp_update_field[0] = STRING_EEXTEND;
     tmp_update_field[1] = chunk_offset;
     memset(&tmp_update_field[2], 0, 48);
-    sha256update((unsigned char *)tmp_update_field, measurement);
+    measure_update(measurement, tmp_update_field, 1);
     g_update_counter++;
 
 #if 0
     {
         char hash[64+1];
-        fmt_hash(measurement, hash);
+        unsigned char digest[32];
+        measure_export(measurement, digest);
+        fmt_hash(digest, hash);
         sgx_dbg(info, "pre-measurement extend: %.20s.., counter: %ld", hash,
                                                                 g_update_counter);
     }
 #endif
 
     unsigned char *cast_page = (unsigned char *)page;
-    sha256update((unsigned char *)(&cast_page[0]),   measurement);
-    sha256update((unsigned char *)(&cast_page[64]),  measurement);
-    sha256update((unsigned char *)(&cast_page[128]), measurement);
-    sha256update((unsigned char *)(&cast_page[192]), measurement);
+    measure_update(measurement, cast_page, 4);
     g_update_counter += 4;
 
 #if 0
     {
         char hash[64+1];
-        fmt_hash(measurement, hash);
+        unsigned char digest[32];
+        measure_export(measurement, digest);
+        fmt_hash(digest, hash);
         sgx_dbg(info, "pre-measurement extend: %.20s.., counter: %ld", hash,
                                                                 g_update_counter);
     }
@@ -159,7 +115,7 @@ void measure_chunk_page(void *measurement, void *page, uint64_t chunk_offset)
 }
 
 static
-void measure_page_add(void *measurement, void *page, secinfo_t *secinfo,
+void measure_page_add(measure_t *measurement, void *page, secinfo_t *secinfo,
                       uint64_t page_offset)
 {
     uint64_t tmp_update_field[8];
@@ -172,13 +128,15 @@ void measure_page_add(void *measurement, void *page, secinfo_t *secinfo,
     tmp_update_field[0] = STRING_EADD;
     tmp_update_field[1] = page_offset;
     memcpy(&tmp_update_field[2], secinfo, 48);
-    sha256update((unsigned char *)tmp_update_field, measurement);
+    measure_update(measurement, tmp_update_field, 1);
     g_update_counter++;
 
 #if 0
     {
         char hash[64+1];
-        fmt_hash(measurement, hash);
+        unsigned char digest[32];
+        measure_export(measurement, digest);
+        fmt_hash(digest, hash);
         sgx_dbg(info, "pre-measurement add: %.20s.., counter: %ld", hash,
                                                                 g_update_counter);
     }
@@ -193,7 +151,7 @@ void measure_page_add(void *measurement, void *page, secinfo_t *secinfo,
 }
 
 static
-void measure_enclave_create(void *measurement, uint32_t ssa_frame_size,
+void measure_enclave_create(measure_t *measurement, uint32_t ssa_frame_size,
                             uint64_t enclave_size)
 {
     uint8_t tmp_update_field[64];
@@ -204,13 +162,15 @@ void measure_enclave_create(void *measurement, uint32_t ssa_frame_size,
     memcpy(&tmp_update_field[8], &ssa_frame_size, 4);
     memcpy(&tmp_update_field[12], &enclave_size, 8);
     memset(&tmp_update_field[20], 0, 44);
-    sha256update((unsigned char *)tmp_update_field, measurement);
+    measure_update(measurement, tmp_update_field, 1);
     g_update_counter++;
 
 #if 0
     {
         char hash[64+1];
-        fmt_hash(measurement, hash);
+        unsigned char digest[32];
+        measure_export(measurement, digest);
+        fmt_hash(digest, hash);
         sgx_dbg(info, "pre-measurement create: %.20s.., counter: %ld", hash,
                                                                        g_update_counter);
     }
@@ -300,8 +260,7 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
                  ssa_npages + stack_npages + heap_npages;
 
     // Initialize hash value.
-    memset(hash, 0, 32);
-    sha256init(hash);
+    measure_init(&g_measure);
     g_update_counter = 0;
 
     // Pre-compute ssa frame and enclave size.
@@ -312,7 +271,7 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
     enclave_size = PAGE_SIZE * npages;
 
     // Update measurement for ECREATE.
-    measure_enclave_create(hash, ssa_frame_size, enclave_size);
+    measure_enclave_create(&g_measure, ssa_frame_size, enclave_size);
     page_offset += PAGE_SIZE;
 
     // tcs update.
@@ -336,7 +295,7 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
 
     // Update measurement for EADD.
     memcpy(&current_page, tmp_tcs, PAGE_SIZE);
-    measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+    measure_page_add(&g_measure, &current_page, &tmp_secinfo, page_offset);
     page_offset += PAGE_SIZE;
 
     // REG page setting.
@@ -350,7 +309,7 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
     for (int i = 0; i < tls_npages; i++) {
         memset(&current_page, 0, PAGE_SIZE);
         memcpy(&current_page, &page, sizeof(uintptr_t));
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+        measure_page_add(&g_measure, &current_page, &tmp_secinfo, page_offset);
         page_offset += PAGE_SIZE;
     }
 
@@ -359,7 +318,7 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
     for (int i = 0; i < code_pages; i++) {
         memset(&current_page, 0, PAGE_SIZE);
         memcpy(&current_page, page, PAGE_SIZE);
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+        measure_page_add(&g_measure, &current_page, &tmp_secinfo, page_offset);
         page = (void *)((uintptr_t)page + PAGE_SIZE);
         page_offset += PAGE_SIZE;
     }
@@ -369,16 +328,20 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
     for (int i = 0; i < ssa_npages; i++) {
         memset(&current_page, 0, PAGE_SIZE);
         memcpy(&current_page, &page, sizeof(uintptr_t));
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+        measure_page_add(&g_measure, &current_page, &tmp_secinfo, page_offset);
         page_offset += PAGE_SIZE;
     }
 
+    // Stack and heap are EAUGed on demand, outside the measurement
+    if (lazy_epc())
+        stack_npages = heap_npages = 0;
+
     // Measure stack pages.
     page = (void *)empty_page;
     for (int i = 0; i < stack_npages; i++) {
         memset(&current_page, 0, PAGE_SIZE);
         memcpy(&current_page, &page, sizeof(uintptr_t));
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+        measure_page_add(&g_measure, &current_page, &tmp_secinfo, page_offset);
         page_offset += PAGE_SIZE;
     }
 
@@ -387,12 +350,13 @@ void generate_enclavehash(void *hash, void *code, int code_pages,
     for (int i = 0; i < heap_npages; i++) {
         memset(&current_page, 0, PAGE_SIZE);
         memcpy(&current_page, &page, sizeof(uintptr_t));
-        measure_page_add(hash, &current_page, &tmp_secinfo, page_offset);
+        measure_page_add(&g_measure, &current_page, &tmp_secinfo, page_offset);
         page_offset += PAGE_SIZE;
     }
 
     // Finalize hash
     g_update_counter = g_update_counter * 512;
+    measure_export(&g_measure, hash);
     sha256final(hash, g_update_counter);
 }
 
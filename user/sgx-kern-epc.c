@@ -30,13 +30,216 @@
 #include <sgx-kern-epc.h>
 
 //
-// NOTE.
-//   bitmap can contain more useful info (e.g., eid, contiguous region &c)
+// EPC page allocator.
 //
+// Free pages are kept as maximal extents of contiguous pages. Each
+// extent is tagged at both ends (g_ext_len[first], g_ext_head[last]) so
+// a freed page merges with its neighbours in O(1), and sits on the bin
+// for floor(log2(len)). An allocation of n pages pops any extent from
+// the first non-empty bin >= ceil(log2(n)), so it is O(1) and finds a
+// run anywhere in the EPC. Only when all of those bins are empty is the
+// bin below searched for an extent that happens to be long enough.
+//
+// Allocated pages are on a per-key list: reserved pages in the order
+// they were reserved (get_epc() hands them out front to back) and
+// typed pages, so teardown only touches the key's own pages.
+//
+#define EPC_NBINS  32
+#define EPC_NIL    (-1)
+
+typedef struct {
+    int head;
+    int tail;
+} epc_list_t;
+
+typedef struct {
+    epc_list_t reserved;
+    epc_list_t used;
+} epc_key_t;
+
 static epc_t *g_epc;
 static epc_info_t *g_epc_info;
 static int g_num_epc;
 
+static int *g_epc_next;                 //!< bin list or key list link
+static int *g_epc_prev;
+static int *g_ext_len;                  //!< on the first page of a free extent
+static int *g_ext_head;                 //!< on the last page of a free extent
+
+static epc_list_t g_bins[EPC_NBINS];
+static uint32_t g_bin_map;              //!< bit k set if g_bins[k] is non-empty
+
+static epc_key_t *g_keys;
+static int g_num_keys;
+
+static int g_num_used;                  //!< pages not on a free extent
+static int g_num_reserved;              //!< of those, pages on a reserved list
+
+static inline
+int floor_log2(unsigned int n)
+{
+    return 31 - __builtin_clz(n);
+}
+
+static inline
+int ceil_log2(unsigned int n)
+{
+    return (n <= 1) ? 0 : floor_log2(n - 1) + 1;
+}
+
+static
+void list_init(epc_list_t *list)
+{
+    list->head = EPC_NIL;
+    list->tail = EPC_NIL;
+}
+
+static
+void list_append(epc_list_t *list, int idx)
+{
+    g_epc_next[idx] = EPC_NIL;
+    g_epc_prev[idx] = list->tail;
+    if (list->tail != EPC_NIL)
+        g_epc_next[list->tail] = idx;
+    else
+        list->head = idx;
+    list->tail = idx;
+}
+
+static
+void list_remove(epc_list_t *list, int idx)
+{
+    if (g_epc_prev[idx] != EPC_NIL)
+        g_epc_next[g_epc_prev[idx]] = g_epc_next[idx];
+    else
+        list->head = g_epc_next[idx];
+    if (g_epc_next[idx] != EPC_NIL)
+        g_epc_prev[g_epc_next[idx]] = g_epc_prev[idx];
+    else
+        list->tail = g_epc_prev[idx];
+}
+
+static
+epc_key_t *epc_key(int key)
+{
+    assert(key >= 0);
+
+    if (key >= g_num_keys) {
+        int nkeys = (key + 1 > g_num_keys * 2) ? key + 1 : g_num_keys * 2;
+        g_keys = realloc(g_keys, nkeys * sizeof(epc_key_t));
+        if (!g_keys)
+            err(1, "failed to allocate EPC key map");
+        for (int i = g_num_keys; i < nkeys; i++) {
+            list_init(&g_keys[i].reserved);
+            list_init(&g_keys[i].used);
+        }
+        g_num_keys = nkeys;
+    }
+    return &g_keys[key];
+}
+
+static
+void extent_insert(int beg, int len)
+{
+    int bin = floor_log2(len);
+
+    g_ext_len[beg] = len;
+    g_ext_head[beg + len - 1] = beg;
+    list_append(&g_bins[bin], beg);
+    g_bin_map |= 1u << bin;
+}
+
+static
+void extent_remove(int beg)
+{
+    int bin = floor_log2(g_ext_len[beg]);
+
+    list_remove(&g_bins[bin], beg);
+    if (g_bins[bin].head == EPC_NIL)
+        g_bin_map &= ~(1u << bin);
+    g_ext_len[beg] = 0;
+}
+
+// Take npages contiguous free pages, returns the first index or -1.
+static
+int extent_alloc(int npages)
+{
+    int beg = EPC_NIL;
+    int len;
+
+    if (npages <= 0 || npages > g_num_epc)
+        return -1;
+
+    // any extent in these bins is long enough
+    uint32_t fit = g_bin_map & ~((1u << ceil_log2(npages)) - 1);
+    if (fit) {
+        beg = g_bins[__builtin_ctz(fit)].head;
+    } else {
+        // npages is not a power of two: try the bin just below
+        for (int i = g_bins[floor_log2(npages)].head; i != EPC_NIL; i = g_epc_next[i]) {
+            if (g_ext_len[i] >= npages) {
+                beg = i;
+                break;
+            }
+        }
+        if (beg == EPC_NIL)
+            return -1;
+    }
+
+    len = g_ext_len[beg];
+    extent_remove(beg);
+    if (len > npages)
+        extent_insert(beg + npages, len - npages);
+    return beg;
+}
+
+// Take up to npages free pages from idx on, returns how many. Growing
+// a heap takes the extent right after it, so idx is usually its first
+// page and finding the extent is O(1).
+static
+int extent_alloc_at(int idx, int npages)
+{
+    int beg, len, n;
+
+    if (idx < 0 || npages <= 0 || g_epc_info[idx].type != FREE_PAGE)
+        return 0;
+
+    for (beg = idx; beg > 0 && g_epc_info[beg - 1].type == FREE_PAGE; beg--)
+        ;
+    len = g_ext_len[beg];
+    n = (beg + len - idx < npages) ? beg + len - idx : npages;
+
+    extent_remove(beg);
+    if (idx > beg)
+        extent_insert(beg, idx - beg);
+    if (beg + len > idx + n)
+        extent_insert(idx + n, beg + len - idx - n);
+    return n;
+}
+
+// Return one page to the free extents, merging with its neighbours.
+static
+void extent_free(int idx)
+{
+    int beg = idx;
+    int len = 1;
+
+    g_epc_info[idx].key = 0;
+    g_epc_info[idx].type = FREE_PAGE;
+
+    if (idx > 0 && g_epc_info[idx - 1].type == FREE_PAGE) {
+        int prev = g_ext_head[idx - 1];
+        len += g_ext_len[prev];
+        extent_remove(prev);
+        beg = prev;
+    }
+    if (idx + 1 < g_num_epc && g_epc_info[idx + 1].type == FREE_PAGE) {
+        len += g_ext_len[idx + 1];
+        extent_remove(idx + 1);
+    }
+    extent_insert(beg, len);
+}
+
 void init_epc(int nepc) {
     g_num_epc = nepc;
 
@@ -62,32 +265,48 @@ void init_epc(int nepc) {
     if (!g_epc_info)
         err(1, "failed to allocate EPC map in kernel");
 
+    g_epc_next = malloc(g_num_epc * sizeof(int));
+    g_epc_prev = malloc(g_num_epc * sizeof(int));
+    g_ext_len  = calloc(g_num_epc, sizeof(int));
+    g_ext_head = calloc(g_num_epc, sizeof(int));
+    if (!g_epc_next || !g_epc_prev || !g_ext_len || !g_ext_head)
+        err(1, "failed to allocate EPC free extents");
+
     memset(g_epc, 0, g_num_epc * sizeof(epc_t));
     memset(g_epc_info, 0, g_num_epc * sizeof(epc_info_t));
+
+    for (int i = 0; i < EPC_NBINS; i++)
+        list_init(&g_bins[i]);
+    g_bin_map = 0;
+    extent_insert(0, g_num_epc);
+    g_num_used = 0;
+    g_num_reserved = 0;
 }
 
 static
-int get_epc_index(int key, epc_type_t pt)
+int epc_index(void *addr)
 {
-    static int last = 0;
-    for (int i = 0; i < g_num_epc; i++) {
-        int idx = (i + last) % g_num_epc;
-        if (g_epc_info[idx].key == key
-            && g_epc_info[idx].type == RESERVED) {
-            g_epc_info[idx].type = pt;
-            return idx;
-        }
-    }
-    return -1;
+    uintptr_t off = (uintptr_t)addr - (uintptr_t)&g_epc[0];
+
+    if (off >= (uintptr_t)g_num_epc * sizeof(epc_t) || off % sizeof(epc_t))
+        return -1;
+    return off / sizeof(epc_t);
 }
 
 static
-void put_epc_index(int index)
+int get_epc_index(int key, epc_type_t pt)
 {
-    assert(0 <= index && index < g_num_epc);
-    assert(g_epc_info[index].type != FREE_PAGE);
+    epc_key_t *k = epc_key(key);
+    int idx = k->reserved.head;
+
+    if (idx == EPC_NIL)
+        return -1;
 
-    g_epc_info[index].type = FREE_PAGE;
+    list_remove(&k->reserved, idx);
+    list_append(&k->used, idx);
+    g_epc_info[idx].type = pt;
+    g_num_reserved--;
+    return idx;
 }
 
 epc_t *get_epc(int key, epc_type_t pt)
@@ -98,6 +317,24 @@ epc_t *get_epc(int key, epc_type_t pt)
     return NULL;
 }
 
+// Type the reserved page epc, whichever of its key's it is. Returns
+// NULL if epc is not reserved.
+epc_t *get_epc_at(epc_t *epc, epc_type_t pt)
+{
+    int idx = epc_index(epc);
+    epc_key_t *k;
+
+    if (idx == -1 || g_epc_info[idx].type != RESERVED)
+        return NULL;
+
+    k = epc_key(g_epc_info[idx].key);
+    list_remove(&k->reserved, idx);
+    list_append(&k->used, idx);
+    g_epc_info[idx].type = pt;
+    g_num_reserved--;
+    return epc;
+}
+
 epc_t *get_epc_region_beg(void)
 {
     return &g_epc[0];
@@ -136,58 +373,47 @@ void dbg_dump_epc(void)
     fprintf(stderr, "\n");
 }
 
-// XXX. convert addr to index like free_epc_pages
 int find_epc_type(void *addr)
 {
-    for (int i = 0; i < g_num_epc; i++) {
-        if (addr == &g_epc[i])
-            return g_epc_info[i].type;
-    }
-
+    int idx = epc_index(addr);
+    if (idx != -1)
+        return g_epc_info[idx].type;
     return -1;
 }
 
-static
-int reserve_epc_index(int key)
+int find_epc_key(void *addr)
 {
-    static int last = 0;
-    for (int i = 0; i < g_num_epc; i++) {
-        int idx = (i + last) % g_num_epc;
-        if (g_epc_info[idx].type == FREE_PAGE) {
-            g_epc_info[idx].key = key;
-            g_epc_info[idx].type = RESERVED;
-            return idx;
-        }
-    }
+    int idx = epc_index(addr);
+    if (idx != -1 && g_epc_info[idx].type != FREE_PAGE)
+        return g_epc_info[idx].key;
     return -1;
 }
 
+int get_num_used_epc(void)
+{
+    return g_num_used;
+}
+
+int get_num_reserved_epc(void)
+{
+    return g_num_reserved;
+}
+
 static
 int alloc_epc_index_pages(int npages, int key)
 {
-    int beg = reserve_epc_index(key);
+    epc_key_t *k = epc_key(key);
+    int beg = extent_alloc(npages);
     if (beg == -1)
         return -1;
 
-    // request too many pages
-    if (beg + npages >= g_num_epc) {
-        put_epc_index(beg);
-        return -1;
-    }
-
-    // check if we have npages
-    int i;
-    for (i = beg + 1; i < beg + npages; i++) {
-        if (g_epc_info[i].type != FREE_PAGE) {
-            // restore and return
-            for (int j = beg; j < i; j ++) {
-                put_epc_index(i);
-            }
-            return -1;
-        }
+    for (int i = beg; i < beg + npages; i++) {
         g_epc_info[i].key = key;
         g_epc_info[i].type = RESERVED;
+        list_append(&k->reserved, i);
     }
+    g_num_used += npages;
+    g_num_reserved += npages;
 
     // npages epcs allocated
     return beg;
@@ -203,39 +429,85 @@ epc_t *alloc_epc_pages(int npages, int key)
 
 epc_t *alloc_epc_page(int key)
 {
-    int idx = reserve_epc_index(key);
-    if (idx != -1)
-        return &g_epc[idx];
-    return NULL;
+    return alloc_epc_pages(1, key);
 }
 
-void free_reserved_epc_pages(epc_t *epc)
+// Take up to npages pages from epc on for key, as long as they are
+// free, and type them right away. Returns the number of pages taken.
+int alloc_epc_pages_at(epc_t *epc, int npages, int key, epc_type_t pt)
 {
-    int beg = ((unsigned long)epc - (unsigned long)&g_epc[0]) / sizeof(epc_t);
-    int key = g_epc_info[beg].key;
+    epc_key_t *k = epc_key(key);
+    int beg = epc_index(epc);
+    int n = extent_alloc_at(beg, npages);
 
-    for (int i = beg; i < g_num_epc; i ++) {
-        if (g_epc_info[i].key == key && g_epc_info[i].type == RESERVED) {
-            g_epc_info[i].key = 0;
-            g_epc_info[i].type = FREE_PAGE;
+    for (int i = beg; i < beg + n; i++) {
+        g_epc_info[i].key = key;
+        g_epc_info[i].type = pt;
+        list_append(&k->used, i);
+    }
+    g_num_used += n;
+    return n;
+}
+
+// Free the pages of list at or above beg, returns how many.
+static
+int free_epc_list(epc_list_t *list, int beg)
+{
+    int i = list->head;
+    int n = 0;
+
+    while (i != EPC_NIL) {
+        int next = g_epc_next[i];
+        if (i >= beg) {
+            list_remove(list, i);
+            extent_free(i);
+            g_num_used--;
+            n++;
         }
+        i = next;
     }
+    return n;
 }
 
+// Free the still reserved pages of epc's owner, from epc on.
+void free_reserved_epc_pages(epc_t *epc)
+{
+    int beg = epc_index(epc);
+    assert(beg != -1);
+
+    g_num_reserved -= free_epc_list(&epc_key(g_epc_info[beg].key)->reserved, beg);
+}
+
+// Free the single page epc.
+void free_epc_page(epc_t *epc)
+{
+    int idx = epc_index(epc);
+    assert(idx != -1 && g_epc_info[idx].type != FREE_PAGE);
+
+    epc_key_t *k = epc_key(g_epc_info[idx].key);
+    if (g_epc_info[idx].type == RESERVED) {
+        list_remove(&k->reserved, idx);
+        g_num_reserved--;
+    } else
+        list_remove(&k->used, idx);
+    extent_free(idx);
+    g_num_used--;
+}
+
+// Free all pages of epc's owner, from epc on.
 void free_epc_pages(epc_t *epc)
 {
-    int beg = ((unsigned long)epc - (unsigned long)&g_epc[0]) / sizeof(epc_t);
-    int key = g_epc_info[beg].key;
+    int beg = epc_index(epc);
+    assert(beg != -1);
 
-    for (int i = beg; i < g_num_epc; i ++) {
-        if (g_epc_info[i].key == key) {
-            g_epc_info[i].key = 0;
-            g_epc_info[i].type = FREE_PAGE;
-        }
-    }
+    epc_key_t *k = epc_key(g_epc_info[beg].key);
+    g_num_reserved -= free_epc_list(&k->reserved, beg);
+    free_epc_list(&k->used, beg);
 }
 
 #ifdef UNITTEST
+#include <time.h>
+
 int count_epc(int key)
 {
     int cnt = 0;
@@ -248,15 +520,67 @@ int count_epc(int key)
     return cnt;
 }
 
+// free extents must be maximal and cover exactly the free pages
+static
+void check_extents(void)
+{
+    int nfree = 0, nreserved = 0, covered = 0;
+
+    for (int i = 0; i < g_num_epc; i++) {
+        nfree += (g_epc_info[i].type == FREE_PAGE);
+        nreserved += (g_epc_info[i].type == RESERVED);
+    }
+
+    for (int b = 0; b < EPC_NBINS; b++) {
+        assert(!(g_bin_map & (1u << b)) == (g_bins[b].head == EPC_NIL));
+        for (int i = g_bins[b].head; i != EPC_NIL; i = g_epc_next[i]) {
+            int len = g_ext_len[i];
+            assert(floor_log2(len) == b);
+            assert(g_ext_head[i + len - 1] == i);
+            assert(i == 0 || g_epc_info[i - 1].type != FREE_PAGE);
+            assert(i + len == g_num_epc || g_epc_info[i + len].type != FREE_PAGE);
+            for (int j = i; j < i + len; j++)
+                assert(g_epc_info[j].type == FREE_PAGE);
+            covered += len;
+        }
+    }
+    assert(covered == nfree);
+    assert(get_num_used_epc() == g_num_epc - nfree);
+    assert(get_num_reserved_epc() == nreserved);
+}
+
+static
+double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static
+void reset_epc(void)
+{
+    for (int i = 0; i < g_num_epc; i++)
+        if (g_epc_info[i].type != FREE_PAGE)
+            extent_free(i);
+    for (int key = 0; key < g_num_keys; key++) {
+        list_init(&g_keys[key].reserved);
+        list_init(&g_keys[key].used);
+    }
+    g_num_used = 0;
+    g_num_reserved = 0;
+    check_extents();
+}
+
 int main(int argc, char *argv[])
 {
     init_epc(NUM_EPC);
 
     epc_t *epc = alloc_epc_pages(NUM_EPC/2, 1);
     assert(count_epc(1) == NUM_EPC/2);
-    dbg_dump_epc();
     free_epc_pages(epc);
     assert(count_epc(1) == 0);
+    check_extents();
 
     (void) alloc_epc_pages(2, 2);
     epc =  alloc_epc_pages(3, 3);
@@ -268,11 +592,98 @@ int main(int argc, char *argv[])
     assert(get_epc(2, SECS_PAGE) != 0);
     assert(get_epc(2, SECS_PAGE) == 0);
 
-    dbg_dump_epc();
-
     free_epc_pages(epc);
+    assert(count_epc(3) == 0);
+    check_extents();
+    reset_epc();
+
+    // get_epc() hands out reserved pages in address order
+    epc = alloc_epc_pages(8, 5);
+    for (int i = 0; i < 8; i++)
+        assert(get_epc(5, REG_PAGE) == epc + i);
+    assert(find_epc_type(epc) == REG_PAGE);
+    assert(find_epc_type((char *)epc + 1) == -1);
+    free_epc_pages(epc);
+    check_extents();
+
+    // a run that does not start at the first free page, up to the end
+    epc_t *first = alloc_epc_page(6);
+    assert(first == &g_epc[0]);
+    epc = alloc_epc_pages(NUM_EPC - 1, 7);
+    assert(epc == &g_epc[1]);
+    assert(alloc_epc_page(8) == NULL);
+    free_epc_pages(first);
+    free_epc_pages(epc);
+    check_extents();
 
-    dbg_dump_epc();
+    // fragment: even pages to key 10, odd to 11, except a window of 12
+    for (int i = 0; i < NUM_EPC; i++) {
+        int key = (i % 2 == 0) ? 10 : (101 <= i && i <= 109) ? 12 : 11;
+        assert(alloc_epc_page(key) == &g_epc[i]);
+    }
+    free_epc_pages(&g_epc[0]);
+    assert(count_epc(10) == 0);
+    assert(alloc_epc_pages(2, 13) == NULL);
+    free_epc_pages(&g_epc[101]);
+    check_extents();
+    assert(alloc_epc_pages(11, 13) == &g_epc[100]);
+    assert(alloc_epc_pages(2, 13) == NULL);
+    check_extents();
+    reset_epc();
+
+    // grow a run in place, then give its tail back page by page
+    epc = alloc_epc_pages(4, 14);
+    (void) alloc_epc_pages(1, 15);
+    free_epc_pages(epc + 2);
+    assert(alloc_epc_pages_at(epc + 2, 8, 14, REG_PAGE) == 2);
+    assert(alloc_epc_pages_at(epc + 4, 1, 14, REG_PAGE) == 0);
+    assert(alloc_epc_pages_at(&g_epc[8], 4, 14, REG_PAGE) == 4);
+    check_extents();
+    assert(find_epc_key(&g_epc[9]) == 14 && find_epc_type(&g_epc[9]) == REG_PAGE);
+    for (int i = 11; i >= 9; i--)
+        free_epc_page(&g_epc[i]);
+    free_epc_page(epc + 3);
+    assert(count_epc(14) == 4);
+    check_extents();
+    reset_epc();
+
+    // type reserved pages out of order, as lazily provisioned pages are
+    epc = alloc_epc_pages(8, 16);
+    assert(get_epc(16, SECS_PAGE) == epc);
+    assert(get_epc_at(epc + 5, REG_PAGE) == epc + 5);
+    assert(get_epc_at(epc + 5, REG_PAGE) == NULL);
+    assert(get_epc_at(epc, REG_PAGE) == NULL);
+    assert(get_num_reserved_epc() == 6);
+    check_extents();
+    free_reserved_epc_pages(epc + 4);
+    assert(count_epc(16) == 5 && get_num_reserved_epc() == 3);
+    check_extents();
+    free_epc_pages(epc);
+    check_extents();
+    reset_epc();
+
+    // random create/destroy churn against the invariants
+    srand(0);
+    epc_t *live[64] = { 0 };
+    double beg = now_ns();
+    int nops = 200000;
+    for (int round = 0; round < nops; round++) {
+        int slot = rand() % 64;
+        if (live[slot]) {
+            free_epc_pages(live[slot]);
+            live[slot] = NULL;
+        } else {
+            int npages = 1 + rand() % 64;
+            live[slot] = alloc_epc_pages(npages, 100 + slot);
+            if (live[slot] && rand() % 2)
+                for (int i = 0; i < npages / 2; i++)
+                    get_epc(100 + slot, REG_PAGE);
+        }
+        if (round % 20000 == 0)
+            check_extents();
+    }
+    check_extents();
+    printf("epc churn: %.0f ns/op over %d ops\n", (now_ns() - beg) / nops, nops);
 
     return 0;
 }
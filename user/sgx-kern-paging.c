@@ -0,0 +1,358 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <signal.h>
+#include <time.h>
+#include <err.h>
+
+#define SGX_KERNEL
+#include <sgx-kern.h>
+#include <sgx-kern-epc.h>
+#include <sgx-kern-paging.h>
+#include <sgx-utils.h>
+
+//
+// The pager keeps, per EPC page, where its sealed copy and VA slot are
+// while it is evicted. Victims are REG pages the emulator reports as
+// evictable (valid, unblocked, not executable: translated code is not
+// refetched) and that are not pinned. The clock hand gives a page a
+// second chance if it was accessed since its bits were last read; the
+// bits are read AGE_WINDOW pages at a time.
+//
+#define AGE_WINDOW      64
+#define EVICT_BATCH     16
+#define VA_SLOTS        (PAGE_SIZE / sizeof(uint64_t))
+#define PAGING_STACK    (64 * 1024)
+
+#define PG_EVICTED      (1 << 0)
+#define PG_PINNED       (1 << 1)
+#define PG_EVICTABLE    (1 << 2)        //!< EPC_AGE_EVICTABLE, last read
+#define PG_REFERENCED   (1 << 3)        //!< EPC_AGE_ACCESSED, not yet consumed
+
+// Untrusted copy of an evicted page, laid out for EWB/ELDU alignment
+typedef struct {
+    epc_t      page;
+    pcmd_t     pcmd;
+    pageinfo_t pageinfo;
+} backing_t;
+
+typedef struct {
+    uint8_t    flags;
+    uint64_t  *va_slot;
+    backing_t *backing;                 //!< kept for reuse once reloaded
+} epc_page_t;
+
+extern keid_t *kenclaves;
+
+static int g_num_epc;
+static int g_budget;                    //!< resident pages, 0 if paging is off
+static int g_num_evicted;
+static int g_va_key;
+static epc_page_t *g_pages;
+static int g_hand;
+
+static uint64_t **g_va_free;
+static int g_va_nfree;
+static int g_va_max;
+
+static struct sigaction g_old_segv;
+
+static inline
+uint64_t paging_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Read the bits of the AGE_WINDOW aligned pages around idx
+static
+void age_window_load(int idx)
+{
+    uint8_t ages[AGE_WINDOW];
+    int beg = idx - idx % AGE_WINDOW;
+    int n = (g_num_epc - beg < AGE_WINDOW) ? g_num_epc - beg : AGE_WINDOW;
+
+    EPC_AGE(&get_epc_region_beg()[beg], n, ages);
+    for (int i = 0; i < n; i++) {
+        epc_page_t *pg = &g_pages[beg + i];
+        pg->flags &= ~PG_EVICTABLE;
+        if (ages[i] & EPC_AGE_EVICTABLE)
+            pg->flags |= PG_EVICTABLE;
+        if (ages[i] & EPC_AGE_ACCESSED)
+            pg->flags |= PG_REFERENCED;
+    }
+}
+
+// Pick up to max victims. Two sweeps at most: the first one consumes
+// the referenced bits the second one would stop at.
+static
+int clock_select(int *victims, int max)
+{
+    int n = 0;
+
+    age_window_load(g_hand);
+    for (int scanned = 0; n < max && scanned < 2 * g_num_epc; scanned++) {
+        epc_page_t *pg = &g_pages[g_hand];
+        int idx = g_hand;
+
+        if (++g_hand == g_num_epc)
+            g_hand = 0;
+        if (g_hand % AGE_WINDOW == 0)
+            age_window_load(g_hand);
+
+        if (!(pg->flags & PG_EVICTABLE) || (pg->flags & (PG_PINNED | PG_EVICTED)))
+            continue;
+        if (pg->flags & PG_REFERENCED) {
+            pg->flags &= ~PG_REFERENCED;
+            continue;
+        }
+        victims[n++] = idx;
+    }
+    return n;
+}
+
+static
+uint64_t *va_slot_get(void)
+{
+    if (g_va_nfree == 0) {
+        uint64_t *va = (uint64_t *)EPA(g_va_key);
+        if (!va)
+            return NULL;
+
+        g_va_max += VA_SLOTS;
+        g_va_free = realloc(g_va_free, g_va_max * sizeof(uint64_t *));
+        if (!g_va_free)
+            err(1, "failed to allocate VA slots");
+        for (int i = VA_SLOTS - 1; i >= 0; i--)
+            g_va_free[g_va_nfree++] = &va[i];
+    }
+    return g_va_free[--g_va_nfree];
+}
+
+static
+void va_slot_put(uint64_t *slot)
+{
+    g_va_free[g_va_nfree++] = slot;
+}
+
+static
+backing_t *get_backing(epc_page_t *pg)
+{
+    if (!pg->backing) {
+        pg->backing = memalign(PAGE_SIZE, sizeof(backing_t));
+        if (!pg->backing)
+            err(1, "failed to allocate EPC backing store");
+    }
+    memset(&pg->backing->pageinfo, 0, sizeof(pageinfo_t));
+    pg->backing->pageinfo.srcpge  = (uint64_t)&pg->backing->page;
+    pg->backing->pageinfo.secinfo = (uint64_t)&pg->backing->pcmd;
+    return pg->backing;
+}
+
+// EBLOCK and EWB up to npages victims. Returns the number evicted.
+static
+int paging_evict(int npages)
+{
+    paging_req_t reqs[EVICT_BATCH];
+    int victims[EVICT_BATCH];
+    epc_t *epc = get_epc_region_beg();
+    uint64_t beg, ns;
+    int n, nreqs = 0, nevicted = 0;
+
+    if (npages > EVICT_BATCH)
+        npages = EVICT_BATCH;
+    n = clock_select(victims, npages);
+
+    for (int i = 0; i < n; i++) {
+        epc_page_t *pg = &g_pages[victims[i]];
+        uint64_t *slot = va_slot_get();
+        if (!slot)
+            break;
+
+        EBLOCK((uint64_t)&epc[victims[i]]);
+        pg->va_slot = slot;
+        reqs[nreqs].pageinfo = (uint64_t)&get_backing(pg)->pageinfo;
+        reqs[nreqs].epcpage  = (uint64_t)&epc[victims[i]];
+        reqs[nreqs].vaslot   = (uint64_t)slot;
+        reqs[nreqs].status   = 0;
+        nreqs++;
+    }
+    if (nreqs == 0)
+        return 0;
+
+    beg = paging_now_ns();
+    EWB_N(reqs, nreqs);
+    ns = (paging_now_ns() - beg) / nreqs;
+
+    for (int i = 0; i < nreqs; i++) {
+        epc_page_t *pg = &g_pages[victims[i]];
+        int key = find_epc_key(&epc[victims[i]]);
+
+        if (reqs[i].status) {
+            sgx_dbg(err, "EWB %p failed (%d)",
+                    (void *)reqs[i].epcpage, (int)reqs[i].status);
+            va_slot_put(pg->va_slot);
+            pg->va_slot = NULL;
+            continue;
+        }
+        pg->flags = (pg->flags & PG_PINNED) | PG_EVICTED;
+        kenclaves[key].ewb_n++;
+        kenclaves[key].paging_ns += ns;
+        nevicted++;
+    }
+    g_num_evicted += nevicted;
+    return nevicted;
+}
+
+// Bring the resident set down so that npages more pages fit.
+void paging_reserve(int npages)
+{
+    int over;
+
+    if (!g_budget)
+        return;
+
+    // reserved pages (lazy stack and heap) hold nothing yet
+    while ((over = get_num_used_epc() - get_num_reserved_epc() - g_num_evicted
+                   + npages - g_budget) > 0) {
+        if (paging_evict(over) == 0) {
+            sgx_dbg(warn, "%d EPC pages over %s, nothing to evict",
+                    over, EPC_RESIDENT_ENV);
+            break;
+        }
+    }
+}
+
+// Never evict npages pages from epc
+void paging_pin(epc_t *epc, int npages)
+{
+    int idx = epc - get_epc_region_beg();
+
+    for (int i = idx; i < idx + npages; i++)
+        g_pages[i].flags |= PG_PINNED;
+}
+
+// Reload the page at addr if the pager evicted it
+bool paging_fault(void *addr)
+{
+    epc_t *epc = get_epc_region_beg();
+    uintptr_t off = (uintptr_t)addr - (uintptr_t)epc;
+    paging_req_t req;
+    epc_page_t *pg;
+    backing_t *backing;
+    uint64_t beg;
+    int idx, key;
+
+    if (!g_budget || off >= (uintptr_t)g_num_epc * sizeof(epc_t))
+        return false;
+
+    idx = off / sizeof(epc_t);
+    pg = &g_pages[idx];
+    if (!(pg->flags & PG_EVICTED))
+        return false;
+
+    paging_reserve(1);
+
+    key = find_epc_key(&epc[idx]);
+    backing = pg->backing;
+    backing->pageinfo.secs = (uint64_t)kenclaves[key].secs;
+
+    req.pageinfo = (uint64_t)&backing->pageinfo;
+    req.epcpage  = (uint64_t)&epc[idx];
+    req.vaslot   = (uint64_t)pg->va_slot;
+    req.status   = 0;
+
+    beg = paging_now_ns();
+    if (ELD_N(&req, 1, ENCLS_ELDU)) {
+        sgx_dbg(err, "ELDU %p failed (%d)", (void *)req.epcpage, (int)req.status);
+        return false;
+    }
+    kenclaves[key].paging_ns += paging_now_ns() - beg;
+    kenclaves[key].eldu_n++;
+    kenclaves[key].epc_fault_n++;
+
+    va_slot_put(pg->va_slot);
+    pg->va_slot = NULL;
+    pg->flags = (pg->flags & PG_PINNED) | PG_REFERENCED;
+    g_num_evicted--;
+    return true;
+}
+
+static
+void paging_sigsegv(int sig, siginfo_t *info, void *uctx)
+{
+    if (paging_fault(info->si_addr) || lazy_fault(info->si_addr))
+        return;
+
+    // Neither evicted nor to be provisioned: fault again without us
+    sigaction(SIGSEGV, &g_old_segv, NULL);
+}
+
+bool paging_enabled(void)
+{
+    return g_budget != 0;
+}
+
+void paging_init(int nepc, int va_key)
+{
+    char *env = getenv(EPC_RESIDENT_ENV);
+    struct sigaction sa;
+    stack_t ss;
+    int budget;
+
+    g_num_epc = nepc;
+    g_va_key = va_key;
+    g_pages = calloc(nepc, sizeof(epc_page_t));
+    if (!g_pages)
+        err(1, "failed to allocate EPC page map");
+
+    if (env) {
+        budget = atoi(env);
+        if (budget > 0 && budget < nepc)
+            g_budget = budget;
+        else
+            sgx_dbg(warn, "ignoring %s=%s", EPC_RESIDENT_ENV, env);
+    }
+
+    // Lazily provisioned stack and heap pages fault in the same way
+    if (!g_budget && !lazy_epc())
+        return;
+
+    // The faulting enclave stack may itself be paged out or not there yet
+    ss.ss_sp = malloc(PAGING_STACK);
+    ss.ss_size = PAGING_STACK;
+    ss.ss_flags = 0;
+    if (!ss.ss_sp || sigaltstack(&ss, NULL) < 0)
+        err(1, "failed to set up the EPC fault stack");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = paging_sigsegv;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, &g_old_segv) < 0)
+        err(1, "failed to install the EPC fault handler");
+
+    if (g_budget)
+        sgx_dbg(info, "EPC paging: %d of %d pages resident", g_budget, nepc);
+}
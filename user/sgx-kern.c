@@ -12,11 +12,13 @@
 #include <sgx-kern.h>
 #include <sgx-utils.h>
 #include <sgx-kern-epc.h>
+#include <sgx-kern-paging.h>
 #include <sgx-crypto.h>
 
 #define NUM_THREADS 1
 
-keid_t kenclaves[MAX_ENCLAVES];
+keid_t *kenclaves;
+static int num_kenclaves;
 
 char *empty_page;
 static epc_t *epc_heap_beg;
@@ -105,6 +107,15 @@ void EEXTEND(uint64_t pageChunk)
     encls(ENCLS_EEXTEND, 0x0, pageChunk, 0x0, NULL);
 }
 
+static
+void EADD_N(eadd_req_t *reqs, int nreqs, bool measure)
+{
+    // RBX: eadd_req_t array(In, EA)
+    // RCX: Number of entries(In)
+    // RDX: EEXTEND each page(In)
+    encls(ENCLS_OSGX_EADD_N, (uint64_t)reqs, nreqs, measure, NULL);
+}
+
 static
 void EAUG(pageinfo_t *pageinfo, epc_t *epc)
 {
@@ -116,6 +127,27 @@ void EAUG(pageinfo_t *pageinfo, epc_t *epc)
           0x0, NULL);
 }
 
+static
+int EMODT(secinfo_t *secinfo, epc_t *epc)
+{
+    // RBX: Secinfo Addr(In)
+    // RCX: Destination EPC Addr(In)
+    // EAX: Error Code(Out)
+    out_regs_t out;
+    encls(ENCLS_EMODT, (uint64_t)secinfo, (uint64_t)epc_to_vaddr(epc), 0x0, &out);
+    return (int)(out.oeax);
+}
+
+static
+int EREMOVE(epc_t *epc)
+{
+    // RCX: EPC Addr(In, EA)
+    // EAX: Error Code(Out)
+    out_regs_t out;
+    encls(ENCLS_EREMOVE, 0x0, (uint64_t)epc_to_vaddr(epc), 0x0, &out);
+    return (int)(out.oeax);
+}
+
 static
 void EMODPR(secinfo_t *secinfo, uint64_t epc_addr)
 {
@@ -147,14 +179,54 @@ int EWB(pageinfo_t *pageinfo_addr, epc_t *epc_addr, uint64_t *VA_slot_addr)
     return (int)(out.oeax);
 }
 
-void EPA(int keid)
+// Batched EWB: seals nreqs pages in one ENCLS, returns the number of
+// entries whose status is non-zero.
+int EWB_N(paging_req_t *reqs, int nreqs)
+{
+    // RBX: paging_req_t array(In/Out)
+    // RCX: Number of entries(In)
+    // EAX: Number of failed entries(Out)
+    out_regs_t out;
+    encls(ENCLS_OSGX_EWB_N, (uint64_t)reqs, nreqs, 0x0, &out);
+    return (int)(out.oeax);
+}
+
+// Batched ELDB/ELDU: leaf is ENCLS_ELDB or ENCLS_ELDU.
+int ELD_N(paging_req_t *reqs, int nreqs, int leaf)
+{
+    // RBX: paging_req_t array(In/Out)
+    // RCX: Number of entries(In)
+    // RDX: ELDB/ELDU(In)
+    // EAX: Number of failed entries(Out)
+    out_regs_t out;
+    encls(ENCLS_OSGX_ELD_N, (uint64_t)reqs, nreqs, leaf, &out);
+    return (int)(out.oeax);
+}
+
+epc_t *EPA(int keid)
 {
     // RBX: PT_VA (In, Const)
     // RCX: EPC Addr(In, EA)
-    uint64_t epc_addr = alloc_epc_page(keid);
-    // Assume that we maintain the one Enclave...
-    keid = 0;
-    encls(ENCLS_EPA, PT_VA, epc_addr, NULL, NULL);
+    epc_t *epc = alloc_epc_page(keid);
+    if (!epc)
+        return NULL;
+
+    epc = get_epc(keid, REG_PAGE);
+    encls(ENCLS_EPA, PT_VA, (uint64_t)epc, 0x0, NULL);
+    return epc;
+}
+
+// Fill ages[] with the EPC_AGE_* bits of npages pages from epc, clearing
+// their accessed bits. Returns the number of accessed pages.
+int EPC_AGE(epc_t *epc, int npages, uint8_t *ages)
+{
+    // RBX: First EPC page(In)
+    // RCX: Number of pages(In)
+    // RDX: EPC_AGE_* bits(Out)
+    // EAX: Number of accessed pages(Out)
+    out_regs_t out;
+    encls(ENCLS_OSGX_EPC_AGE, (uint64_t)epc, npages, (uint64_t)ages, &out);
+    return (int)(out.oeax);
 }
 
 static
@@ -356,20 +428,73 @@ bool aug_page_to_epc(epc_t *epc, epc_t *secs)
     return true;
 }
 
-// add multiple pages to epc pages (will be allocated)
+// add (copy) npages pages to epc pages (will be allocated) with a single
+// ENCLS_OSGX_EADD_N. The source advances by src_stride per page, so a
+// zero stride adds the same page npages times. first/last are optional.
 static
-bool add_pages_to_epc(int eid, void *page, int npages,
-                      epc_t *secs, epc_type_t epc_pt, page_type_t pt)
+bool add_range_to_epc(int eid, void *page, size_t src_stride, int npages,
+                      epc_t *secs, epc_type_t epc_pt, page_type_t pt,
+                      epc_t **first, epc_t **last)
 {
+    bool ret = false;
+    epc_t *epc = NULL;
+
+    if (npages <= 0)
+        return true;
+
+    eadd_req_t *reqs = memalign(PAGEINFO_ALIGN_SIZE, npages * sizeof(eadd_req_t));
+    if (!reqs)
+        err(1, "failed to allocate eadd requests");
+    memset(reqs, 0, npages * sizeof(eadd_req_t));
+
+    // EADD only reads secinfo, so one copy serves the whole range
+    secinfo_t *secinfo = alloc_secinfo(true, true, pt == PT_REG, pt);
+    if (!secinfo)
+        err(1, "failed to allocate secinfo");
+
     for (int i = 0; i < npages; i++) {
-        epc_t *epc = get_epc(eid, (uint64_t)epc_pt);
+        epc = get_epc(eid, (uint64_t)epc_pt);
         if (!epc)
-            return false;
-        if (!add_page_to_epc(page, epc, secs, pt))
-            return false;
-        page = (void *)((uintptr_t)page + PAGE_SIZE);
+            goto out;
+
+        if (pt == PT_REG) {
+            // change permissions of a page table entry
+            sgx_dbg(ttrace, "+x to %p", (void *)epc);
+            if (mprotect(epc, PAGE_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC) == -1)
+                err(1, "failed to add executable permission");
+        }
+
+        reqs[i].pageinfo.srcpge  = (uint64_t)page;
+        reqs[i].pageinfo.secinfo = (uint64_t)secinfo;
+        reqs[i].pageinfo.secs    = (uint64_t)epc_to_vaddr(secs);
+        reqs[i].pageinfo.linaddr = (uint64_t)epc_to_vaddr(epc);
+        reqs[i].epcpage          = (uint64_t)epc_to_vaddr(epc);
+
+        sgx_dbg(eadd, "add/copy %p -> %p", page, epc_to_vaddr(epc));
+
+        if (i == 0 && first)
+            *first = epc;
+        page = (void *)((uintptr_t)page + src_stride);
     }
-    return true;
+    if (last)
+        *last = epc;
+
+    EADD_N(reqs, npages, true);
+    ret = true;
+
+ out:
+    free(reqs);
+    free(secinfo);
+    return ret;
+}
+
+// add multiple pages to epc pages (will be allocated)
+static
+bool add_pages_to_epc(int eid, void *page, int npages,
+                      epc_t *secs, epc_type_t epc_pt, page_type_t pt)
+{
+    return add_range_to_epc(eid, page, PAGE_SIZE, npages,
+                            secs, epc_pt, pt, NULL, NULL);
 }
 
 // add multiple empty pages to epc pages (will be allocated)
@@ -377,24 +502,21 @@ static
 bool add_empty_pages_to_epc(int eid, int npages, epc_t *secs,
                             epc_type_t epc_pt, page_type_t pt, mem_type_t mt)
 {
-    for (int i = 0; i < npages; i ++) {
-        epc_t *epc = get_epc(eid, epc_pt);
-        if (!epc)
-            return false;
-        if (!add_page_to_epc(empty_page, epc, secs, pt))
-            return false;
-        if (i == 0 && mt == MT_HEAP) {
-            epc_heap_beg = epc;
-            printf("DEBUG epc heap beg is set as %p\n",(void *)epc_heap_beg);
-        }
-        if ((i == npages - 1) && mt == MT_HEAP) {
-            epc_heap_end = (epc_t *)((char *)epc + PAGE_SIZE - 1);
-            printf("DEBUG epc heap end is set as %p\n",(void *)epc_heap_end);
-        }
-        if ((i == npages - 1) && mt == MT_STACK) {
-            epc_stack_end = epc;
-            printf("DEBUG eps stack end is set as %p\n", (void *)epc_stack_end);
-        }
+    epc_t *first, *last;
+
+    if (!add_range_to_epc(eid, empty_page, 0, npages,
+                          secs, epc_pt, pt, &first, &last))
+        return false;
+
+    if (npages > 0 && mt == MT_HEAP) {
+        epc_heap_beg = first;
+        printf("DEBUG epc heap beg is set as %p\n",(void *)epc_heap_beg);
+        epc_heap_end = (epc_t *)((char *)last + PAGE_SIZE - 1);
+        printf("DEBUG epc heap end is set as %p\n",(void *)epc_heap_end);
+    }
+    if (npages > 0 && mt == MT_STACK) {
+        epc_stack_end = last;
+        printf("DEBUG eps stack end is set as %p\n", (void *)epc_stack_end);
     }
     return true;
 }
@@ -407,21 +529,43 @@ unsigned long get_epc_heap_end() {
     return (unsigned long)epc_heap_end;
 }
 
+// EPC size requested with qemu -epc-pages (or QEMU_EPC_PAGES)
+static
+int get_num_epc(void)
+{
+    char *env = getenv(EPC_PAGES_ENV);
+    if (env) {
+        int nepc = atoi(env);
+        if (nepc > 0 && nepc <= MAX_EPC)
+            return nepc;
+        sgx_dbg(warn, "ignoring %s=%s", EPC_PAGES_ENV, env);
+    }
+    return NUM_EPC;
+}
+
 // init custom data structures for qemu-sgx
 bool sys_sgx_init(void)
 {
+    int nepc = get_num_epc();
+
     // enclave map
-    for (int i = 0; i < MAX_ENCLAVES; i ++) {
-        memset(&(kenclaves[i]), 0, sizeof(keid_t));
+    num_kenclaves = max_enclaves(nepc);
+    kenclaves = calloc(num_kenclaves, sizeof(keid_t));
+    if (!kenclaves)
+        err(1, "failed to allocate enclave map");
+    for (int i = 0; i < num_kenclaves; i ++) {
         kenclaves[i].keid = -1;
     }
 
-    init_epc(NUM_EPC);
+    init_epc(nepc);
 
     // QEMU Setup initialization for SGX
     encls_qemu_init((uint64_t)get_epc_region_beg(),
                     (uint64_t)get_epc_region_end());
 
+    // VA pages are owned by the key past the last enclave
+    paging_init(nepc, num_kenclaves);
+
     // Set default cpu svn
     set_cpusvn(CPU_SVN);
 
@@ -436,7 +580,7 @@ bool sys_sgx_init(void)
 static
 int alloc_keid(void)
 {
-    for (int i = 0; i < MAX_ENCLAVES; i ++) {
+    for (int i = 0; i < num_kenclaves; i ++) {
         if (kenclaves[i].keid == -1) {
             kenclaves[i].keid = i;
             return i;
@@ -476,10 +620,14 @@ int sys_create_enclave(void *base, unsigned int code_pages,
     int ssa_npages  = 2; // XXX: Temperily set
     int stack_npages = STACK_PAGE_FRAMES_PER_THREAD;
     int heap_npages = HEAP_PAGE_FRAMES;
-    int npages = sec_npages + tcs_npages + tls_npages \
-        + code_pages + ssa_npages + stack_npages + heap_npages;
+    int core_npages = sec_npages + tcs_npages + tls_npages \
+        + code_pages + ssa_npages;
+    int npages = core_npages + stack_npages + heap_npages;
     npages = rop2(npages);
 
+    // Lazily, ELRANGE is reserved in full but only the core is EADDed
+    bool lazy = lazy_epc();
+    paging_reserve(lazy ? core_npages : npages);
     epc_t *enclave = alloc_epc_pages(npages, eid);
     if (!enclave)
         goto err;
@@ -521,8 +669,12 @@ int sys_create_enclave(void *base, unsigned int code_pages,
     // allocate code pages
     sgx_dbg(info, "add target code/data: %p (%d pages)",
             base, code_pages);
-    if (!add_pages_to_epc(eid, base, code_pages, secs, REG_PAGE, PT_REG))
+    epc_t *code_epc;
+    if (!add_range_to_epc(eid, base, PAGE_SIZE, code_pages, secs, REG_PAGE, PT_REG,
+                          &code_epc, NULL))
         err(1, "failed to add pages");
+    kenclaves[eid].code_addr = (uint64_t)epc_to_vaddr(code_epc);
+    kenclaves[eid].code_npages = code_pages;
 
     // allocate SSA pages
     sgx_dbg(info, "add ssa pages: %p (%d pages)",
@@ -531,19 +683,37 @@ int sys_create_enclave(void *base, unsigned int code_pages,
         err(1, "failed to add pages");
     kenclaves[eid].prealloc_ssa = ssa_npages * PAGE_SIZE;
 
-	// allocate stack pages
-    sgx_dbg(info, "add stack pages: %p (%d pages)",
-            empty_page, stack_npages);
-    if (!add_empty_pages_to_epc(eid, stack_npages, secs, REG_PAGE, PT_REG, MT_STACK))
-        err(1, "failed to add pages");
-    kenclaves[eid].prealloc_stack = stack_npages * PAGE_SIZE;
-
-    // allocate heap pages
-    sgx_dbg(info, "add heap pages: %p (%d pages)",
-            empty_page, heap_npages);
-    if (!add_empty_pages_to_epc(eid, heap_npages, secs, REG_PAGE, PT_REG, MT_HEAP))
-        err(1, "failed to add pages");
-    kenclaves[eid].prealloc_heap = heap_npages * PAGE_SIZE;
+    // SSA frames are written by the emulator on enclave exits
+    paging_pin(enclave + ssa_page_offset, ssa_npages);
+
+    epc_t *resv = enclave;
+    kenclaves[eid].lazy_n = 0;
+    if (lazy) {
+        // stack and heap pages stay reserved until lazy_fault() EAUGs them
+        epc_t *stack = enclave + ssa_page_offset + ssa_npages;
+        epc_stack_end = stack + stack_npages - 1;
+        epc_heap_beg = stack + stack_npages;
+        epc_heap_end = (epc_t *)((char *)(epc_heap_beg + heap_npages) - 1);
+        resv = epc_heap_beg + heap_npages;
+        sgx_dbg(info, "lazy stack/heap pages: %p (%d pages)",
+                (void *)stack, stack_npages + heap_npages);
+        kenclaves[eid].prealloc_stack = 0;
+        kenclaves[eid].prealloc_heap = 0;
+    } else {
+        // allocate stack pages
+        sgx_dbg(info, "add stack pages: %p (%d pages)",
+                empty_page, stack_npages);
+        if (!add_empty_pages_to_epc(eid, stack_npages, secs, REG_PAGE, PT_REG, MT_STACK))
+            err(1, "failed to add pages");
+        kenclaves[eid].prealloc_stack = stack_npages * PAGE_SIZE;
+
+        // allocate heap pages
+        sgx_dbg(info, "add heap pages: %p (%d pages)",
+                empty_page, heap_npages);
+        if (!add_empty_pages_to_epc(eid, heap_npages, secs, REG_PAGE, PT_REG, MT_HEAP))
+            err(1, "failed to add pages");
+        kenclaves[eid].prealloc_heap = heap_npages * PAGE_SIZE;
+    }
 
 #if 0
     // dump sig structure
@@ -566,11 +736,16 @@ int sys_create_enclave(void *base, unsigned int code_pages,
 //    dbg_dump_epc();
 
     // remove reserved pages
-    free_reserved_epc_pages(enclave);
+    if (resv < enclave + npages)
+        free_reserved_epc_pages(resv);
+
+    // page out what does not fit any more
+    paging_reserve(0);
 
     // update per-enclave info
     kenclaves[eid].tcs = epc_to_vaddr(tcs_epc);
     kenclaves[eid].enclave = (uint64_t)enclave;
+    kenclaves[eid].enclave_size = enclave_size;
 
     kenclaves[eid].kout_n++;
     return ret;
@@ -583,7 +758,7 @@ int sys_create_enclave(void *base, unsigned int code_pages,
 
 int sys_stat_enclave(int keid, keid_t *stat)
 {
-    if (keid < 0 || keid >= MAX_ENCLAVES) {
+    if (keid < 0 || keid >= num_kenclaves) {
         return -1;
     }
     //*stat = kenclaves[keid];
@@ -599,30 +774,156 @@ int sys_stat_enclave(int keid, keid_t *stat)
 	return 0;
 }
 
-unsigned long sys_add_epc(int keid) {
-    kenclaves[keid].kin_n++;
-    epc_t *secs = kenclaves[keid].secs; 
-    printf("DEBUG passed keid is %d\n", keid);
+// Record the heap stats an enclave reported through FUNC_MALLOC
+int sys_stat_heap(int keid, heapstat_t *stat)
+{
+    if (keid < 0 || keid >= num_kenclaves || stat == NULL) {
+        return -1;
+    }
+
+    memcpy(&kenclaves[keid].heapstat, stat, sizeof(heapstat_t));
+    return 0;
+}
+
+// EAUG up to npages pages at addr, which the enclave then EACCEPTs.
+// The heap grows in place, so only the free pages right at addr and
+// within the enclave range are taken. Returns the number of pages added.
+int sys_add_epc(int keid, unsigned long addr, int npages)
+{
+    epc_t *secs = kenclaves[keid].secs;
+    unsigned long end = kenclaves[keid].enclave + kenclaves[keid].enclave_size;
+    int n;
 
-    epc_t *free_epc_page = alloc_epc_page(keid);
-    if (free_epc_page == NULL) {
+    kenclaves[keid].kin_n++;
+    if (addr < kenclaves[keid].enclave || addr >= end || npages <= 0) {
         kenclaves[keid].kout_n++;
         return 0;
     }
+    if (npages > (end - addr) / PAGE_SIZE)
+        npages = (end - addr) / PAGE_SIZE;
+
+    paging_reserve(npages);
+    n = alloc_epc_pages_at((epc_t *)addr, npages, keid, REG_PAGE);
+    for (int i = 0; i < n; i++) {
+        epc_t *epc = (epc_t *)addr + i;
+        if (!aug_page_to_epc(epc, secs)) {
+            for (int j = i; j < n; j++)
+                free_epc_page((epc_t *)addr + j);
+            n = i;
+            break;
+        }
+    }
 
-    epc_t *epc = get_epc(keid, (uint64_t)REG_PAGE);
-    if (!epc) {
-        kenclaves[keid].kout_n++;
-        return 0;
+    kenclaves[keid].augged_heap += n * PAGE_SIZE;
+    kenclaves[keid].kout_n++;
+    return n;
+}
+
+// EAUG the page at addr if it is one of the stack or heap pages that
+// sys_create_enclave() left reserved for its enclave. Called on an
+// enclave #PF; the access is restarted on the fresh, zeroed page.
+// Returns false if the page could not be added, so the fault is not
+// retried forever.
+//
+// Unlike SGX2, the page is never EACCEPTed: the enclave has no #PF
+// handler, so it stays PENDING and the emulator lets the enclave use it
+// as is. Nothing in the enclave checks that the page is one it asked
+// for, so it has to trust the host with the contents of its lazily
+// added stack and heap. Such pages can never be trimmed either.
+bool lazy_fault(void *addr)
+{
+    epc_t *epc = (epc_t *)((uintptr_t)addr & ~(uintptr_t)(PAGE_SIZE - 1));
+    int keid = find_epc_key(epc);
+    bool ok = false;
+
+    if (keid < 0 || find_epc_type(epc) != RESERVED)
+        return false;
+
+    kenclaves[keid].kin_n++;
+    paging_reserve(1);
+    if (get_epc_at(epc, REG_PAGE)) {
+        ok = aug_page_to_epc(epc, kenclaves[keid].secs);
+        if (ok)
+            kenclaves[keid].lazy_n++;
+        else
+            free_epc_page(epc);
     }
-    printf("DEBUG get epc works\n");
-    if (!aug_page_to_epc(epc, secs)) {
-        kenclaves[keid].kout_n++;
-        return 0;
+    kenclaves[keid].kout_n++;
+    return ok;
+}
+
+// Heap trimming, in two steps around the enclave's EACCEPTs:
+// sys_trim_epc() EMODTs npages pages at addr to PT_TRIM from the top
+// down, so that on a partial failure the trimmed pages are the top n.
+// Once they are accepted sys_remove_epc() EREMOVEs them and frees the
+// EPC pages.
+int sys_trim_epc(int keid, unsigned long addr, int npages)
+{
+    secinfo_t *secinfo = memalign(SECINFO_ALIGN_SIZE, sizeof(secinfo_t));
+    int n;
+
+    if (!secinfo)
+        err(1, "failed to allocate secinfo");
+    memset(secinfo, 0, sizeof(secinfo_t));
+    secinfo->flags.page_type = PT_TRIM;
+
+    kenclaves[keid].kin_n++;
+    for (n = 0; n < npages; n++) {
+        epc_t *epc = (epc_t *)addr + (npages - 1 - n);
+
+        if (find_epc_key(epc) != keid || find_epc_type(epc) != REG_PAGE)
+            break;
+        // EMODT needs the page valid
+        paging_fault(epc);
+        if (EMODT(secinfo, epc))
+            break;
     }
-    kenclaves[keid].augged_heap += PAGE_SIZE;
     kenclaves[keid].kout_n++;
-    return (unsigned long)epc;
+
+    free(secinfo);
+    return n;
+}
+
+int sys_remove_epc(int keid, unsigned long addr, int npages)
+{
+    int n;
+
+    kenclaves[keid].kin_n++;
+    for (n = 0; n < npages; n++) {
+        epc_t *epc = (epc_t *)addr + n;
+
+        if (find_epc_key(epc) != keid || find_epc_type(epc) != REG_PAGE)
+            break;
+        if (EREMOVE(epc))
+            break;
+        free_epc_page(epc);
+    }
+    kenclaves[keid].trimmed_heap += n * PAGE_SIZE;
+    kenclaves[keid].kout_n++;
+    return n;
+}
+
+// Name the enclave's code for the emulator's -sgx-profile: it was
+// EADDed from binary, where it starts at link_addr (ENCT_START)
+int sys_profile_enclave(int keid, char *binary, uint64_t link_addr)
+{
+    profile_map_t map;
+
+    if (keid < 0 || keid >= num_kenclaves || !binary)
+        return -1;
+
+    memset(&map, 0, sizeof(map));
+    map.load_addr = kenclaves[keid].code_addr;
+    map.link_addr = link_addr;
+    map.size = (uint64_t)kenclaves[keid].code_npages * PAGE_SIZE;
+    if (strlen(binary) >= sizeof(map.path))
+        return -1;
+    strcpy(map.path, binary);
+
+    kenclaves[keid].kin_n++;
+    encls(ENCLS_OSGX_PROFILE, keid, (uint64_t)&map, 0x0, NULL);
+    kenclaves[keid].kout_n++;
+    return 0;
 }
 
 // For unit test
@@ -676,7 +977,7 @@ void test_eaug(pageinfo_t *pageinfo, epc_t *epc)
 // allocate keid
 int test_alloc_keid(void)
 {
-    for (int i = 0; i < MAX_ENCLAVES; i ++) {
+    for (int i = 0; i < num_kenclaves; i ++) {
         if (kenclaves[i].keid == -1) {
             kenclaves[i].keid = i;
             return i;
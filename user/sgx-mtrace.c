@@ -0,0 +1,285 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decoder for the enclave memory traces written by qemu -sgx-mtrace.
+//
+// Without -d it prints, per enclave, the accesses, the pages they
+// touched and the EWB/ELD paging events, then the LRU reuse distance
+// of the accesses: the number of distinct pages touched since the
+// previous access to the same page. An access hits in an LRU-managed
+// EPC of N resident pages iff its distance is below N.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/stat.h>
+
+#include <sgx.h>
+
+#define CHUNK           4096            //!< records read at a time
+#define NO_EID          0xffff
+#define DIST_BUCKETS    33
+
+typedef struct {
+    uint64_t n[MTRACE_RELOAD + 1];      //!< records, by MTRACE_* type
+    uint64_t pages;                     //!< distinct pages accessed
+} eid_stat_t;
+
+typedef struct {
+    uint64_t key;                       //!< eid << 48 | page number
+    uint64_t last;                      //!< time of the last access, 0 if free
+} page_ent_t;
+
+static const char *type_names[] = {
+    [MTRACE_READ]   = "read",
+    [MTRACE_WRITE]  = "write",
+    [MTRACE_EXEC]   = "exec",
+    [MTRACE_EVICT]  = "evict",
+    [MTRACE_RELOAD] = "reload",
+};
+
+static eid_stat_t *eid_stats;
+static page_ent_t *pages;
+static uint64_t pages_cap, pages_n;
+static uint32_t *fenwick;               //!< 1 at the last access time of each page
+static uint64_t fenwick_n;
+static uint64_t dist_hist[DIST_BUCKETS];
+static uint64_t cold_n;
+
+static
+void fenwick_add(uint64_t i, int v)
+{
+    for (; i <= fenwick_n; i += i & -i)
+        fenwick[i] += v;
+}
+
+static
+uint64_t fenwick_sum(uint64_t i)
+{
+    uint64_t s = 0;
+    for (; i > 0; i -= i & -i)
+        s += fenwick[i];
+    return s;
+}
+
+static
+uint64_t page_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static
+page_ent_t *page_find(uint64_t key)
+{
+    uint64_t i = page_hash(key) & (pages_cap - 1);
+
+    while (pages[i].last && pages[i].key != key)
+        i = (i + 1) & (pages_cap - 1);
+    return &pages[i];
+}
+
+static
+void pages_grow(void)
+{
+    page_ent_t *old = pages;
+    uint64_t old_cap = pages_cap;
+
+    pages_cap = pages_cap ? 2 * pages_cap : 4096;
+    pages = calloc(pages_cap, sizeof(page_ent_t));
+    if (!pages)
+        err(1, "failed to allocate the page table");
+    for (uint64_t i = 0; i < old_cap; i++) {
+        if (old[i].last)
+            *page_find(old[i].key) = old[i];
+    }
+    free(old);
+}
+
+// Account the access at time t (1-based, accesses only)
+static
+void reuse_access(mtrace_rec_t *rec, uint64_t t)
+{
+    uint64_t key = ((uint64_t)rec->eid << 48)
+                 | ((rec->addr / PAGE_SIZE) & ((1ULL << 48) - 1));
+    page_ent_t *ent;
+
+    if (2 * (pages_n + 1) > pages_cap)
+        pages_grow();
+
+    ent = page_find(key);
+    if (!ent->last) {
+        ent->key = key;
+        pages_n++;
+        eid_stats[rec->eid].pages++;
+        cold_n++;
+    } else {
+        uint64_t d = fenwick_sum(t - 1) - fenwick_sum(ent->last);
+        int b = d ? 64 - __builtin_clzll(d) : 0;
+
+        dist_hist[b < DIST_BUCKETS ? b : DIST_BUCKETS - 1]++;
+        fenwick_add(ent->last, -1);
+    }
+    fenwick_add(t, 1);
+    ent->last = t;
+}
+
+static
+void dump_rec(mtrace_rec_t *rec)
+{
+    const char *type = rec->type <= MTRACE_RELOAD ? type_names[rec->type] : "?";
+
+    printf("%14" PRIu64 " cpu%-2u ", rec->icount, rec->cpu);
+    if (rec->eid == NO_EID)
+        printf("eid -    ");
+    else
+        printf("eid %-4u ", rec->eid);
+    printf("%-6s 0x%016" PRIx64 " epc %d\n", type, rec->addr, rec->epc_index);
+}
+
+static
+void print_summary(const char *path, uint64_t nrecs, uint64_t naccess)
+{
+    uint64_t hits = 0;
+
+    printf("%s: %" PRIu64 " records, %" PRIu64 " accesses, %" PRIu64 " pages\n\n",
+           path, nrecs, naccess, pages_n);
+
+    printf("%-5s %12s %12s %12s %8s %8s %8s\n",
+           "eid", "read", "write", "exec", "pages", "evict", "reload");
+    for (int e = 0; e <= NO_EID; e++) {
+        eid_stat_t *s = &eid_stats[e];
+        uint64_t any = 0;
+
+        for (int t = 0; t <= MTRACE_RELOAD; t++)
+            any |= s->n[t];
+        if (!any)
+            continue;
+        if (e == NO_EID)
+            printf("%-5s ", "-");
+        else
+            printf("%-5d ", e);
+        printf("%12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %8" PRIu64
+               " %8" PRIu64 " %8" PRIu64 "\n",
+               s->n[MTRACE_READ], s->n[MTRACE_WRITE], s->n[MTRACE_EXEC],
+               s->pages, s->n[MTRACE_EVICT], s->n[MTRACE_RELOAD]);
+    }
+
+    if (!naccess)
+        return;
+
+    // Bucket b holds distances in [2^(b-1), 2^b): all of them hit with
+    // 2^b pages resident
+    printf("\n%-20s %12s %8s\n", "reuse distance", "accesses", "LRU hit");
+    printf("%-20s %12" PRIu64 "\n", "cold", cold_n);
+    for (int b = 0; b < DIST_BUCKETS; b++) {
+        char range[32];
+
+        if (!dist_hist[b])
+            continue;
+        hits += dist_hist[b];
+        if (b == 0)
+            snprintf(range, sizeof(range), "0");
+        else if (b == DIST_BUCKETS - 1)
+            snprintf(range, sizeof(range), "%" PRIu64 "-", (uint64_t)1 << (b - 1));
+        else
+            snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64,
+                     (uint64_t)1 << (b - 1), ((uint64_t)1 << b) - 1);
+        printf("%-20s %12" PRIu64 " %7.2f%%\n",
+               range, dist_hist[b], 100.0 * hits / naccess);
+    }
+}
+
+static
+void usage(void)
+{
+    fprintf(stderr, "[usage] sgx-mtrace [-d] trace\n"
+            "  summarize a trace written by qemu -sgx-mtrace (QEMU_SGX_MTRACE)\n"
+            "  -d: print every record instead\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    mtrace_rec_t recs[CHUNK];
+    mtrace_hdr_t hdr;
+    struct stat st;
+    uint64_t nrecs = 0, naccess = 0;
+    bool dump = false;
+    size_t n;
+    FILE *fp;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dh")) != -1) {
+        if (opt == 'd')
+            dump = true;
+        else
+            usage();
+    }
+    if (optind != argc - 1)
+        usage();
+
+    fp = fopen(argv[optind], "rb");
+    if (!fp)
+        err(1, "failed to open %s", argv[optind]);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+        || memcmp(hdr.magic, MTRACE_MAGIC, sizeof(hdr.magic)))
+        errx(1, "%s is not an sgx-mtrace file", argv[optind]);
+    if (hdr.version != MTRACE_VERSION || hdr.rec_size != sizeof(mtrace_rec_t))
+        errx(1, "%s: unsupported version %u (record size %u)",
+             argv[optind], hdr.version, hdr.rec_size);
+
+    if (!dump) {
+        if (fstat(fileno(fp), &st) < 0)
+            err(1, "failed to stat %s", argv[optind]);
+        fenwick_n = (st.st_size - sizeof(hdr)) / sizeof(mtrace_rec_t);
+        fenwick = calloc(fenwick_n + 1, sizeof(uint32_t));
+        eid_stats = calloc(NO_EID + 1, sizeof(eid_stat_t));
+        if (!fenwick || !eid_stats)
+            err(1, "failed to allocate %" PRIu64 " records", fenwick_n);
+        pages_grow();
+    }
+
+    while ((n = fread(recs, sizeof(mtrace_rec_t), CHUNK, fp)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            mtrace_rec_t *rec = &recs[i];
+
+            nrecs++;
+            if (dump) {
+                dump_rec(rec);
+                continue;
+            }
+            if (rec->type > MTRACE_RELOAD)
+                continue;
+            eid_stats[rec->eid].n[rec->type]++;
+            if (rec->type <= MTRACE_EXEC)
+                reuse_access(rec, ++naccess);
+        }
+    }
+    fclose(fp);
+
+    if (!dump)
+        print_summary(argv[optind], nrecs, naccess);
+    return 0;
+}
@@ -34,45 +34,49 @@
 
 int main(int argc, char **argv)
 {
+    enclave_layout_t layout;
     char *binary;
-    char *size;
-    char *offset;
-    char *code_start;
-    char *code_end;
-    char *data_start;
-    char *data_end;
-    char *entry;
+    char *conf;
     char *base_addr;
 
-    binary     = argv[1];
-    size       = argv[2];
-    offset     = argv[3];
-    code_start = argv[4];
-    code_end   = argv[5];
-    data_start = argv[6];
-    data_end   = argv[7];
-    entry      = argv[8];
+    if (argc < 2)
+        errx(1, "usage: %s binary [conf]", argv[0]);
+    binary = argv[1];
 
-    long ecode_size = strtol(code_end, NULL, 16) - strtol(code_start, NULL, 16);
-    long edata_size = strtol(data_end, NULL, 16) - strtol(data_start, NULL, 16);
+    // Older scripts pass the layout they dug out with readelf and nm
+    if (argc >= 9) {
+        OpenSGX_layout_args(&argv[2], &layout);
+        conf = argv[9];
+    } else {
+        if (!OpenSGX_layout(binary, &layout))
+            errx(1, "failed to read the enclave layout of %s", binary);
+        conf = argv[2];
+    }
+
+    long ecode_size = layout.code_end - layout.code_start;
+    long edata_size = layout.data_end - layout.data_start;
     int ecode_page_n = ((ecode_size - 1) / PAGE_SIZE) + 1;
     int edata_page_n = ((edata_size - 1) / PAGE_SIZE) + 1;
     int n_of_pages = ecode_page_n + edata_page_n;
-    long entry_offset = strtol(entry, NULL, 16) - strtol(code_start, NULL, 16);
+    long entry_offset = layout.entry - layout.code_start;
 
     printf("ecode_size: %ld edata_size: %ld entry_offset: %lx\n", ecode_size,
                                                                   edata_size, entry_offset);
 
-    long code_offset = strtol(offset, NULL, 16);
-    int binary_size = atoi(size);
+    long code_offset = layout.offset;
+    int binary_size = layout.size;
 
     if(!sgx_init())
         err(1, "failed to init sgx");
     base_addr = OpenSGX_loader(binary, binary_size, code_offset, n_of_pages);
+    if (!base_addr)
+        err(1, "failed to load %s", binary);
 
-    tcs_t *tcs = init_enclave(base_addr, entry_offset, n_of_pages, argv[9]);
+    tcs_t *tcs = init_enclave(base_addr, entry_offset, n_of_pages, conf);
     if (!tcs)
         err(1, "failed to run enclave");
+    OpenSGX_unload(base_addr, n_of_pages);
+    sys_profile_enclave(cur_keid, binary, layout.code_start);
 
     void (*aep)() = exception_handler;
     sgx_enter(tcs, aep);
@@ -79,34 +79,15 @@ void cmd_pkg(char *bin)
     // TODO
 }
 
-void cmd_measure(char *binary, char *size, char *offset, char *code_start, char *code_end,
-                 char *data_start, char *data_end, char *entry)
+void cmd_measure(char *binary, enclave_layout_t *layout)
 {
-    FILE *fp = NULL;
-    unsigned char *buffer;
-    long nbytes;
-    int n;
-
-    nbytes = atoi(size);
-    buffer = malloc(nbytes);
-    memset(buffer, 0, nbytes);
-
-    fp = fopen(binary, "rb");
-    if (fp == NULL)
-        return;
-
-    n = fread(buffer, nbytes, 1, fp);
-    // XXX: fread will return 0 when MAX_BUFFER_SIZE > BINARY SIZE
-	if (n < 0)
-        return;
-
-    long ecode_size = strtol(code_end, NULL, 16) - strtol(code_start, NULL, 16);
-    long edata_size = strtol(data_end, NULL, 16) - strtol(data_start, NULL, 16);
+    long ecode_size = layout->code_end - layout->code_start;
+    long edata_size = layout->data_end - layout->data_start;
     int ecode_page_n = ((ecode_size - 1) / PAGE_SIZE) + 1;
     int edata_page_n = ((edata_size - 1) / PAGE_SIZE) + 1;
     int n_of_pages = ecode_page_n + edata_page_n;
-    long code_offset = strtol(offset, NULL, 16);
-    long entry_offset = strtol(entry, NULL, 16) -  strtol(code_start, NULL, 16);
+    long code_offset = layout->offset;
+    long entry_offset = layout->entry - layout->code_start;
 
     printf("ecode_size: %ld edata_size: %ld offset: %ld entry_offset: %ld\n", ecode_size,
                                                                               edata_size, code_offset, entry_offset);
@@ -114,9 +95,9 @@ void cmd_measure(char *binary, char *size, char *offset, char *code_start, char
     unsigned char *code;
     unsigned char hash[32];
 
-    code = (unsigned char *)malloc(n_of_pages * PAGE_SIZE);
-    memset(code, 0, n_of_pages * PAGE_SIZE);
-    memcpy(code, buffer + code_offset, n_of_pages * PAGE_SIZE);
+    code = OpenSGX_loader(binary, layout->size, code_offset, n_of_pages);
+    if (!code)
+        err(1, "failed to load %s", binary);
 
     generate_enclavehash(hash, code, n_of_pages, entry_offset);
 
@@ -137,6 +118,9 @@ void cmd_measure(char *binary, char *size, char *offset, char *code_start, char
     char *hash_str = fmt_bytes(hash, 32);
     printf("# generated measurement\n");
     printf("MEASUREMENT: %s\n", hash_str);
+
+    free(hash_str);
+    OpenSGX_unload(code, n_of_pages);
 }
 
 void cmd_gen_sigstruct(char *conf)
@@ -514,8 +498,8 @@ void cmd_help()
     printf("  -k|--keygen       : generate RSA key with given bits (-k BITS)\n");
     printf("  -h|--help         : help message\n");
     printf("  -p|--pkg          : package a static binary\n");
-    printf("  -m|--measure      : measure a binary with given region\n");
-    printf("                      (-m BINARY --begin=START_ADDR --size=BINARY_SIZE --entry=ENTRY_ADDR)\n");
+    printf("  -m|--measure      : measure the enclave in a binary\n");
+    printf("                      (-m BINARY)\n");
     printf("  -s|--sign         : generate rsa sign on a sigstruct with private key\n");
     printf("                      (-s SIGSTRUECT --key=KEYFILE)\n");
     printf("  -M|--mac          : generate mac on a einittoken with Launch Key\n");
@@ -566,24 +550,23 @@ int main(int argc, char *argv[])
             cmd_help();
             break;
         case 'm': {
-            char *binary, *size, *offset, *code_start, *code_end, \
-                 *data_start, *data_end, *entry;
-            binary = optarg;
-            c = getopt_long(argc, argv, "z:", options, &optind);
-            size = optarg;
-            c = getopt_long(argc, argv, "o:", options, &optind);
-            offset = optarg;
-            c = getopt_long(argc, argv, "a:", options, &optind);
-            code_start = optarg;
-            c = getopt_long(argc, argv, "b:", options, &optind);
-            code_end = optarg;
-            c = getopt_long(argc, argv, "c:", options, &optind);
-            data_start = optarg;
-            c = getopt_long(argc, argv, "d:", options, &optind);
-            data_end = optarg;
-            c = getopt_long(argc, argv, "e:", options, &optind);
-            entry = optarg;
-            cmd_measure(binary, size, offset, code_start, code_end, data_start, data_end, entry);
+            char *binary = optarg;
+            enclave_layout_t layout;
+
+            // --size= ... --entry= from older scripts, in that order
+            if (argc > 3) {
+                char *args[7];
+                static const char *opts[] = { "z:", "o:", "a:", "b:", "c:", "d:", "e:" };
+                for (int i = 0; i < 7; i++) {
+                    c = getopt_long(argc, argv, opts[i], options, &optind);
+                    args[i] = (c == -1) ? NULL : optarg;
+                }
+                if (!OpenSGX_layout_args(args, &layout))
+                    errx(1, "incomplete layout for %s", binary);
+            } else if (!OpenSGX_layout(binary, &layout)) {
+                errx(1, "failed to read the enclave layout of %s", binary);
+            }
+            cmd_measure(binary, &layout);
             break;
         }
         case 's': {
@@ -0,0 +1,311 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Pretty-printer for the sgx_dbg() records written by qemu -sgx-trace.
+//
+// Each record is printed as the message sgx_dbg() would have written
+// to stderr, prefixed with its time and host thread. Threads write
+// their records in chunks, so pipe through sort for a single timeline.
+// With -s, the number of hits of each call site is printed instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <err.h>
+
+#include <sgx.h>
+
+typedef struct {
+    trace_def_t def;
+    const char *func;
+    const char *fmt;
+    uint64_t hits;
+} site_t;
+
+static const char *cat_names[] = {
+#define CAT_NAME(c) #c,
+    SGX_DBG_CATEGORIES(CAT_NAME)
+#undef CAT_NAME
+};
+#define NR_CATS ((int)(sizeof(cat_names) / sizeof(cat_names[0])))
+
+static site_t *sites;
+static int nsites;
+
+static
+uint32_t parse_cats(char *cats)
+{
+    uint32_t mask = 0;
+
+    for (char *c = strtok(cats, ","); c; c = strtok(NULL, ",")) {
+        int i;
+
+        for (i = 0; i < NR_CATS; i++) {
+            if (!strcmp(c, cat_names[i]))
+                break;
+        }
+        if (i == NR_CATS)
+            errx(1, "unknown filter %s", c);
+        mask |= 1u << i;
+    }
+    return mask;
+}
+
+static
+void add_site(trace_rec_t *rec, uint8_t *payload)
+{
+    trace_def_t *def = (trace_def_t *)payload;
+    char *func = (char *)(def + 1);
+    size_t len = rec->size - sizeof(*rec) - sizeof(*def);
+
+    if (rec->size < sizeof(*rec) + sizeof(*def) + 2 || payload[len + sizeof(*def) - 1])
+        errx(1, "bad definition of call site %d", rec->site);
+
+    if (rec->site >= nsites) {
+        sites = realloc(sites, (rec->site + 1) * sizeof(site_t));
+        if (!sites)
+            err(1, "failed to allocate call sites");
+        memset(&sites[nsites], 0, (rec->site + 1 - nsites) * sizeof(site_t));
+        nsites = rec->site + 1;
+    }
+    sites[rec->site].def = *def;
+    sites[rec->site].func = strdup(func);
+    sites[rec->site].fmt = strdup(func + strlen(func) + 1);
+}
+
+// Print one conversion spec (flags, width and precision already
+// resolved) with the next argument
+static
+void print_arg(char *spec, size_t len, char conv, int type,
+               const uint8_t **p, const uint8_t *end)
+{
+    uint64_t v = 0;
+    double d;
+
+    if (type == TRACE_ARG_STR) {
+        uint16_t slen;
+        char buf[1024];
+
+        if (*p + sizeof(slen) > end)
+            return;
+        memcpy(&slen, *p, sizeof(slen));
+        if (slen >= sizeof(buf) || *p + sizeof(slen) + slen > end)
+            return;
+        memcpy(buf, *p + sizeof(slen), slen);
+        buf[slen] = '\0';
+        *p += sizeof(slen) + slen;
+        spec[len++] = 's';
+        spec[len] = '\0';
+        printf(spec, buf);
+        return;
+    }
+
+    if (*p + sizeof(v) > end)
+        return;
+    memcpy(&v, *p, sizeof(v));
+    *p += sizeof(v);
+
+    switch (type) {
+    case TRACE_ARG_DBL:
+        memcpy(&d, &v, sizeof(d));
+        spec[len++] = conv;
+        spec[len] = '\0';
+        printf(spec, d);
+        break;
+    case TRACE_ARG_LONG:
+        if (conv == 'p') {
+            spec[len++] = 'p';
+            spec[len] = '\0';
+            printf(spec, (void *)(uintptr_t)v);
+            break;
+        }
+        spec[len++] = 'l';
+        spec[len++] = 'l';
+        spec[len++] = conv;
+        spec[len] = '\0';
+        printf(spec, (long long)v);
+        break;
+    default:
+        spec[len++] = conv;
+        spec[len] = '\0';
+        printf(spec, (int)v);
+        break;
+    }
+}
+
+// Print fmt, taking the arguments from the record the way printf()
+// would have taken them from its va_list
+static
+void print_msg(site_t *site, const uint8_t *p, const uint8_t *end)
+{
+    const char *f = site->fmt;
+    int arg = 0;
+
+    while (*f) {
+        char spec[64];
+        size_t len = 0;
+
+        if (*f != '%') {
+            putchar(*f++);
+            continue;
+        }
+        if (f[1] == '%') {
+            putchar('%');
+            f += 2;
+            continue;
+        }
+
+        // copy flags, width and precision, resolving '*' and dropping
+        // length modifiers: print_arg() adds its own
+        spec[len++] = *f++;
+        while (*f && strchr("-+ #0123456789.*hlLqjzt", *f) && len < sizeof(spec) - 24) {
+            if (*f == '*') {
+                int64_t star = 0;
+                if (arg < site->def.nargs && p + 8 <= end) {
+                    memcpy(&star, p, 8);
+                    p += 8;
+                    arg++;
+                }
+                len += sprintf(&spec[len], "%d", (int)star);
+            } else if (!strchr("hlLqjzt", *f)) {
+                spec[len++] = *f;
+            }
+            f++;
+        }
+        if (!*f)
+            break;
+        if (arg >= site->def.nargs) {
+            spec[len] = '\0';
+            printf("%s%c", spec, *f++);
+            continue;
+        }
+        print_arg(spec, len, *f++, site->def.args[arg++], &p, end);
+    }
+}
+
+static
+int cmp_hits(const void *a, const void *b)
+{
+    const site_t *s1 = *(const site_t **)a;
+    const site_t *s2 = *(const site_t **)b;
+
+    if (s1->hits != s2->hits)
+        return s1->hits < s2->hits ? 1 : -1;
+    return 0;
+}
+
+static
+void print_hits(void)
+{
+    site_t **order = malloc(nsites * sizeof(site_t *));
+    int n = 0;
+
+    if (!order)
+        err(1, "failed to allocate call sites");
+    for (int i = 0; i < nsites; i++) {
+        if (sites[i].fmt)
+            order[n++] = &sites[i];
+    }
+    qsort(order, n, sizeof(site_t *), cmp_hits);
+
+    printf("%12s %-7s %s\n", "hits", "filter", "call site");
+    for (int i = 0; i < n; i++) {
+        site_t *s = order[i];
+        printf("%12" PRIu64 " %-7s %s(%u): %s\n", s->hits,
+               s->def.cat < NR_CATS ? cat_names[s->def.cat] : "?",
+               s->func, s->def.line, s->fmt);
+    }
+    free(order);
+}
+
+static
+void usage(void)
+{
+    fprintf(stderr, "[usage] sgx-trace [-c filter[,...]] [-s] trace\n"
+            "  print a trace written by qemu -sgx-trace (QEMU_SGX_TRACE)\n"
+            "  -c: only these sgx_dbg() filters\n"
+            "  -s: hits per call site instead\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t payload[UINT16_MAX];
+    trace_hdr_t hdr;
+    trace_rec_t rec;
+    uint32_t mask = ~0u;
+    bool summary = false;
+    FILE *fp;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:sh")) != -1) {
+        if (opt == 'c')
+            mask = parse_cats(optarg);
+        else if (opt == 's')
+            summary = true;
+        else
+            usage();
+    }
+    if (optind != argc - 1)
+        usage();
+
+    fp = fopen(argv[optind], "rb");
+    if (!fp)
+        err(1, "failed to open %s", argv[optind]);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+        || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)))
+        errx(1, "%s is not an sgx-trace file", argv[optind]);
+    if (hdr.version != TRACE_VERSION)
+        errx(1, "%s: unsupported version %u", argv[optind], hdr.version);
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        size_t len = rec.size - sizeof(rec);
+        site_t *site;
+
+        if (rec.size < sizeof(rec) || fread(payload, 1, len, fp) != len)
+            errx(1, "%s: truncated record", argv[optind]);
+
+        if (rec.tid == 0) {
+            add_site(&rec, payload);
+            continue;
+        }
+        if (rec.site >= nsites || !sites[rec.site].fmt)
+            errx(1, "%s: undefined call site %d", argv[optind], rec.site);
+
+        site = &sites[rec.site];
+        if (!(mask & (1u << site->def.cat)))
+            continue;
+        site->hits++;
+        if (summary)
+            continue;
+
+        printf("[%6" PRIu64 ".%06" PRIu64 "] %5u Q> %s(%u): ",
+               rec.ns / 1000000000, rec.ns / 1000 % 1000000, rec.tid,
+               site->func, site->def.line);
+        print_msg(site, payload, payload + len);
+        putchar('\n');
+    }
+    fclose(fp);
+
+    if (summary)
+        print_hits();
+    return 0;
+}
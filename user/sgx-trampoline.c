@@ -29,6 +29,14 @@
 #include <sgx-malloc.h>
 #include <stdarg.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+
+static pthread_mutex_t ocall_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool ocall_wanted;               // OCALL_RING_ENV was set
+static pthread_t ocall_thread;
+static bool ocall_running;
+static volatile int ocall_stopping;     // worker exits once the ring is empty
 
 const char *fcode_to_str(fcode_t fcode)
 {
@@ -40,6 +48,7 @@ const char *fcode_to_str(fcode_t fcode)
     case FUNC_WRITE       : return "WRITE";
     case FUNC_CLOSE       : return "CLOSE";
     case FUNC_PUTCHAR     : return "PUTCHAR";
+    case FUNC_PRINT       : return "PRINT";
     case FUNC_TIME        : return "TIME";
     case FUNC_SOCKET      : return "SOCKET";
     case FUNC_BIND        : return "BIND";
@@ -214,22 +223,15 @@ void clear_abi_out_fields(sgx_stub_info *stub)  //from enclave to non-enclave
     }
 }
 
-//Trampoline code for stub handling in user
-void sgx_trampoline()
+// Run the call described by stub. Shared by the exit path and the
+// switchless worker; returns false on an unknown function code.
+static
+bool sgx_dispatch(sgx_stub_info *stub)
 {
     unsigned long epc_heap_beg = 0;
     unsigned long epc_heap_end = 0;
     unsigned long pending_page = 0;
 
-    sgx_msg(info, "Trampoline Entered");
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
-    clear_abi_in_fields(stub);
-
-    
-    fprintf(stderr, "++++++ Function code: %s\n",
-            fcode_to_str(stub->fcode));
-    //dbg_dump_stub_out(stub);
-
     switch (stub->fcode) {
     case FUNC_PUTS:
         //sgx_puts(srcData)
@@ -243,14 +245,24 @@ void sgx_trampoline()
             stub->heap_end = epc_heap_end;
         }
         else if (stub->mcode == REQUEST_EAUG) {
-            pending_page = sys_add_epc(cur_keid);
-            if (!pending_page)
-                printf("DEBUG failed in EAUG\n");
-            else{
-                printf("DEBUG succeed in EAUG\n");
-                printf("DEBUG pending page is %p\n", (void *)pending_page);
-                stub->pending_page = pending_page;
-            }
+            // out_arg1 pages at addr, the number added is in ret
+            sys_stat_heap(cur_keid, (heapstat_t *)stub->out_data1);
+            pending_page = (unsigned long)stub->addr;
+            stub->ret = sys_add_epc(cur_keid, pending_page, stub->out_arg1);
+            if (stub->ret == 0)
+                sgx_dbg(warn, "failed in EAUG at %p", (void *)pending_page);
+            stub->pending_page = pending_page;
+        }
+        else if (stub->mcode == REQUEST_EMODT) {
+            stub->ret = sys_trim_epc(cur_keid, (unsigned long)stub->addr,
+                                     stub->out_arg1);
+        }
+        else if (stub->mcode == REQUEST_EREMOVE) {
+            stub->ret = sys_remove_epc(cur_keid, (unsigned long)stub->addr,
+                                       stub->out_arg1);
+        }
+        else if (stub->mcode == MALLOC_STAT) {
+            sys_stat_heap(cur_keid, (heapstat_t *)stub->out_data1);
         }
         else{
             sgx_msg(warn, "Incorrect malloc code");
@@ -261,6 +273,11 @@ void sgx_trampoline()
     case FUNC_PUTCHAR:
         putchar(stub->out_arg1);
         break;
+    case FUNC_PRINT:
+        fwrite(stub->out_data1, 1, (size_t)stub->out_arg1, stdout);
+        // FUNC_WRITE bypasses stdio: keep the order on a file or pipe
+        fflush(stdout);
+        break;
     case FUNC_TIME:
         stub->in_arg3 = sgx_time_tramp(stub->out_data1);
         break;
@@ -301,9 +318,144 @@ void sgx_trampoline()
 */
     default:
         sgx_msg(warn, "Incorrect function code");
+        return false;
+    }
+    return true;
+}
+
+// Serve one posted slot, if any. Called with ocall_lock held.
+static
+bool ocall_serve_one(sgx_ocall_ring *ring)
+{
+    sgx_ocall_slot *slot = &ring->slot[ring->tail % OCALL_RING_SLOTS];
+
+    if (slot->state != OCALL_POSTED)
+        return false;
+
+    // results must be visible before the state flips
+    __sync_synchronize();
+    slot->call.ret = 0;
+    sgx_dispatch(&slot->call);
+    __sync_synchronize();
+
+    slot->state = slot->wait ? OCALL_DONE : OCALL_FREE;
+    ring->tail++;
+    ring->served++;
+    return true;
+}
+
+// Calls posted before an EEXIT must run before it (e.g. buffered puts).
+static
+void ocall_drain(void)
+{
+    sgx_ocall_ring *ring = (sgx_ocall_ring *)OCALL_RING_ADDR;
+
+    if (!ring->enabled)
+        return;
+
+    pthread_mutex_lock(&ocall_lock);
+    while (ocall_serve_one(ring))
+        ;
+    pthread_mutex_unlock(&ocall_lock);
+}
+
+static
+void *ocall_worker(void *arg)
+{
+    sgx_ocall_ring *ring = arg;
+    int idle = 0;
+
+    for (;;) {
+        bool served;
+
+        pthread_mutex_lock(&ocall_lock);
+        served = ocall_serve_one(ring);
+        pthread_mutex_unlock(&ocall_lock);
+
+        if (served) {
+            idle = 0;
+        } else if (ocall_stopping) {
+            // slots are served in order: nothing is left behind
+            break;
+        } else if (++idle > 1024) {
+            // nothing for a while: stop burning a host cpu
+            usleep(50);
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static
+bool ocall_ring_init(void)
+{
+    sgx_ocall_ring *ring;
+
+    ring = mmap((void *)OCALL_RING_ADDR, sizeof(sgx_ocall_ring),
+                PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+    memset(ring, 0, sizeof(sgx_ocall_ring));
+
+    if (!getenv(OCALL_RING_ENV))
+        return true;
+
+    ocall_wanted = true;
+    sgx_msg(info, "switchless ocalls enabled");
+    return true;
+}
+
+// The worker runs while the enclave does: sgx_enter() starts it before
+// EENTER and stops it once the last EEXIT returns.
+void ocall_start(void)
+{
+    sgx_ocall_ring *ring = (sgx_ocall_ring *)OCALL_RING_ADDR;
+
+    if (!ocall_wanted || ocall_running)
+        return;
+
+    ocall_stopping = 0;
+    if (pthread_create(&ocall_thread, NULL, ocall_worker, ring) != 0) {
+        sgx_msg(warn, "failed to start the switchless worker");
         return;
-        break;
     }
+    ocall_running = true;
+    ring->enabled = 1;
+}
+
+// Serve what the enclave posted before its last EEXIT, then stop the
+// worker so that nothing is lost or left polling when main() returns.
+void ocall_stop(void)
+{
+    sgx_ocall_ring *ring = (sgx_ocall_ring *)OCALL_RING_ADDR;
+
+    if (!ocall_running)
+        return;
+
+    ocall_stopping = 1;
+    pthread_join(ocall_thread, NULL);
+    ocall_running = false;
+    ocall_drain();
+    ring->enabled = 0;
+}
+
+//Trampoline code for stub handling in user
+void sgx_trampoline()
+{
+    sgx_msg(info, "Trampoline Entered");
+    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    clear_abi_in_fields(stub);
+
+    ocall_drain();
+
+    fprintf(stderr, "++++++ Function code: %s\n",
+            fcode_to_str(stub->fcode));
+    //dbg_dump_stub_out(stub);
+
+    if (!sgx_dispatch(stub))
+        return;
 
     clear_abi_out_fields(stub);
     //dbg_dump_stub_in(stub);
@@ -314,6 +466,7 @@ void sgx_trampoline()
 int sgx_init(void)
 {
     assert(sizeof(struct sgx_stub_info) < PAGE_SIZE);
+    assert(sizeof(sgx_ocall_slot) == PAGE_SIZE);
 
     sgx_stub_info *stub = mmap((void *)STUB_ADDR, PAGE_SIZE,
                                PROT_READ|PROT_WRITE,
@@ -327,5 +480,8 @@ int sgx_init(void)
     stub->abi = OPENSGX_ABI_VERSION;
     stub->trampoline = (void *)(uintptr_t)sgx_trampoline;
 
+    if (!ocall_ring_init())
+        return 0;
+
     return sys_sgx_init();
 }
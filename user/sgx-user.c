@@ -27,6 +27,9 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
 #include <sgx-malloc.h>
 #include <stdarg.h>
 #include <malloc.h>
@@ -71,7 +74,11 @@ void sgx_enter(tcs_t *tcs, void (*aep)())
 {
     // RBX: TCS (In, EA)
     // RCX: AEP (In, EA)
+    ocall_start();
     enclu(ENCLU_EENTER, (uint64_t)tcs, (uint64_t)aep, 0, NULL);
+
+    // the last EEXIT returns here: serve what the enclave posted before it
+    ocall_stop();
 }
 
 void sgx_resume(tcs_t *tcs, void (*aep)()) {
@@ -275,6 +282,7 @@ tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, ch
     int keid = sys_create_enclave(base, n_of_pages, tcs, sigstruct, token, false);
     if (keid < 0)
         err(1, "failed to create enclave");
+    cur_keid = keid;
 
     keid_t stat;
     if (sys_stat_enclave(keid, &stat) < 0)
@@ -296,6 +304,39 @@ tcs_t *init_enclave(void *base, unsigned int offset, unsigned int n_of_pages, ch
 //   - execute entry
 //   - return upon exit
 
+static const char *encls_leaf_names[STAT_ENCLS_LEAVES] = {
+    "ecreate", "eadd", "einit", "eremove", "edbgrd", "edbgwr", "eextend",
+    "eldb", "eldu", "eblock", "epa", "ewb", "etrack", "eaug", "emodpr", "emodt",
+};
+
+static const char *enclu_leaf_names[STAT_ENCLU_LEAVES] = {
+    "ereport", "egetkey", "eenter", "eresume", "eexit", "eaccept", "emodpe",
+    "eacceptcopy",
+};
+
+// Two lines per histogram: count, mean and max, then the non-empty
+// buckets as "<upper bound>:count"
+static
+void print_hist(const char *name, const stat_hist_t *hist, const char *unit)
+{
+    if (hist->n == 0)
+        return;
+
+    printf("%-12s: n %lu, mean %lu %s, max %lu %s\n", name,
+           (unsigned long)hist->n, (unsigned long)(hist->sum / hist->n), unit,
+           (unsigned long)hist->max, unit);
+    printf("             ");
+    for (int i = 0; i < STAT_HIST_BUCKETS; i++) {
+        if (!hist->bucket[i])
+            continue;
+        if (i == STAT_HIST_BUCKETS - 1)
+            printf(" >=%lu:%u", 1UL << (i - 1), hist->bucket[i]);
+        else
+            printf(" <%lu:%u", 1UL << i, hist->bucket[i]);
+    }
+    printf("\n");
+}
+
 static
 void print_eid_stat(keid_t stat) {
      printf("--------------------------------------------\n");
@@ -318,12 +359,44 @@ void print_eid_stat(keid_t stat) {
      printf("eaccept count\t: %d\n",stat.qstat.eaccept_n);
      printf("--------------------------------------------\n");
      printf("mode switch count : %d\n",stat.qstat.mode_switch);
-     printf("tlb flush count\t: %d\n",stat.qstat.tlbflush_n);
+     printf("tlb entries flushed : %d\n",stat.qstat.tlbflush_n);
+     printf("--------------------------------------------\n");
+     for (int i = 0; i < STAT_ENCLS_LEAVES; i++)
+         print_hist(encls_leaf_names[i], &stat.qstat.encls_ns[i], "ns");
+     for (int i = 0; i < STAT_ENCLU_LEAVES; i++)
+         print_hist(enclu_leaf_names[i], &stat.qstat.enclu_ns[i], "ns");
+     print_hist("inside", &stat.qstat.inside_ns, "ns");
+     print_hist("inside", &stat.qstat.inside_insn, "insns");
+     print_hist("outside", &stat.qstat.outside_ns, "ns");
+     print_hist("outside", &stat.qstat.outside_insn, "insns");
+     printf("--------------------------------------------\n");
+     printf("ewb count\t: %d\n",stat.ewb_n);
+     printf("eldu count\t: %d\n",stat.eldu_n);
+     printf("epc fault count\t: %d\n",stat.epc_fault_n);
+     printf("paging time\t: %lu ns\n",stat.paging_ns);
+     printf("--------------------------------------------\n");
+     printf("malloc count\t: %u\n",stat.heapstat.malloc_n);
+     printf("free count\t: %u\n",stat.heapstat.free_n);
+     printf("realloc count\t: %u (in place %u, 0x%lx copied)\n",
+            stat.heapstat.realloc_n, stat.heapstat.realloc_inplace_n,
+            stat.heapstat.realloc_copied);
+     printf("malloc failures\t: %u\n",stat.heapstat.fail_n);
+     printf("heap in use\t: 0x%lx (peak 0x%lx)\n",
+            stat.heapstat.in_use, stat.heapstat.peak_in_use);
+     printf("heap slabs\t: %u (0x%lx)\n",
+            stat.heapstat.slab_n, stat.heapstat.slab_bytes);
+     printf("heap large blocks : %u\n",stat.heapstat.large_n);
+     printf("heap top\t: 0x%lx of 0x%lx\n",
+            stat.heapstat.heap_top, stat.heapstat.heap_size);
+     printf("heap pages augged : %u (trimmed %u)\n",
+            stat.heapstat.eaug_n, stat.heapstat.trim_n);
      printf("--------------------------------------------\n");
      printf("Pre-allocated EPC SSA region\t: 0x%lx\n",stat.prealloc_ssa);
      printf("Pre-allocated EPC Heap region\t: 0x%lx\n",stat.prealloc_heap);
      printf("Later-Augmented EPC Heap region\t: 0x%lx\n",stat.augged_heap);
-     long total_epc_heap = stat.prealloc_heap + stat.augged_heap;
+     printf("Trimmed EPC Heap region\t: 0x%lx\n",stat.trimmed_heap);
+     printf("Lazily EAUGed stack/heap pages\t: %u\n",stat.lazy_n);
+     long total_epc_heap = stat.prealloc_heap + stat.augged_heap - stat.trimmed_heap;
      printf("Total EPC Heap region\t: 0x%lx\n",total_epc_heap);
 }
 
@@ -442,28 +515,204 @@ int sgx_host_write(void *buf, int len)
     return len;
 }
 
-void *OpenSGX_loader(char *binary, int size, long offset, int n_of_pages)
+static const struct {
+    const char *name;
+    size_t off;
+} layout_syms[] = {
+    { "ENCT_START",    offsetof(enclave_layout_t, code_start) },
+    { "ENCT_END",      offsetof(enclave_layout_t, code_end)   },
+    { "ENCD_START",    offsetof(enclave_layout_t, data_start) },
+    { "ENCD_END",      offsetof(enclave_layout_t, data_end)   },
+    { "enclave_start", offsetof(enclave_layout_t, entry)      },
+};
+
+#define N_LAYOUT_SYMS (sizeof(layout_syms) / sizeof(layout_syms[0]))
+
+// Section i of the image if it lies within the file, NULL otherwise
+static
+Elf64_Shdr *elf_section(unsigned char *img, size_t size, int i)
+{
+    Elf64_Ehdr *eh = (Elf64_Ehdr *)img;
+    Elf64_Shdr *sh;
+
+    if (i <= 0 || i >= eh->e_shnum)
+        return NULL;
+    sh = (Elf64_Shdr *)(img + eh->e_shoff) + i;
+    if (sh->sh_type != SHT_NOBITS
+        && (sh->sh_offset > size || sh->sh_size > size - sh->sh_offset))
+        return NULL;
+    return sh;
+}
+
+// String tables must end in a NUL for strcmp() to stay inside them
+static
+const char *elf_strtab(unsigned char *img, Elf64_Shdr *sh)
+{
+    if (!sh || sh->sh_type != SHT_STRTAB || sh->sh_size == 0
+        || img[sh->sh_offset + sh->sh_size - 1] != '\0')
+        return NULL;
+    return (const char *)img + sh->sh_offset;
+}
+
+// Read the enclave layout straight from binary's section headers and
+// symbol table, as readelf -S and nm would show it
+bool OpenSGX_layout(char *binary, enclave_layout_t *layout)
+{
+    Elf64_Ehdr *eh;
+    Elf64_Shdr *sh, *shstrtab, *symtab = NULL, *strtab;
+    Elf64_Sym *sym;
+    const char *shstr, *str;
+    unsigned char *img;
+    size_t size, nsyms;
+    off_t end;
+    unsigned found = 0;
+    int fd;
+
+    fd = open(binary, O_RDONLY);
+    if (fd < 0)
+        return false;
+    end = lseek(fd, 0, SEEK_END);
+    if (end < (off_t)sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return false;
+    }
+    size = end;
+    img = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (img == MAP_FAILED)
+        return false;
+
+    eh = (Elf64_Ehdr *)img;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG)
+        || eh->e_ident[EI_CLASS] != ELFCLASS64
+        || eh->e_shentsize != sizeof(Elf64_Shdr)
+        || eh->e_shoff > size
+        || (size_t)eh->e_shnum * sizeof(Elf64_Shdr) > size - eh->e_shoff) {
+        sgx_dbg(err, "%s: not an ELF64 binary", binary);
+        goto fail;
+    }
+
+    memset(layout, 0, sizeof(*layout));
+    layout->size = size;
+    layout->offset = -1;
+
+    shstrtab = elf_section(img, size, eh->e_shstrndx);
+    shstr = elf_strtab(img, shstrtab);
+    if (!shstr)
+        goto fail;
+    for (int i = 1; i < eh->e_shnum; i++) {
+        sh = elf_section(img, size, i);
+        if (!sh)
+            continue;
+        if (sh->sh_name < shstrtab->sh_size
+            && !strcmp(shstr + sh->sh_name, ".enc_text"))
+            layout->offset = sh->sh_offset;
+        if (sh->sh_type == SHT_SYMTAB)
+            symtab = sh;
+    }
+    if (layout->offset < 0 || !symtab) {
+        sgx_dbg(err, "%s: no .enc_text or symbol table", binary);
+        goto fail;
+    }
+
+    strtab = elf_section(img, size, symtab->sh_link);
+    str = elf_strtab(img, strtab);
+    if (!str)
+        goto fail;
+
+    sym = (Elf64_Sym *)(img + symtab->sh_offset);
+    nsyms = symtab->sh_size / sizeof(Elf64_Sym);
+    for (size_t i = 0; i < nsyms; i++) {
+        if (sym[i].st_name == 0 || sym[i].st_name >= strtab->sh_size)
+            continue;
+        for (unsigned k = 0; k < N_LAYOUT_SYMS; k++) {
+            if (!strcmp(str + sym[i].st_name, layout_syms[k].name)) {
+                *(uint64_t *)((char *)layout + layout_syms[k].off) = sym[i].st_value;
+                found |= 1 << k;
+            }
+        }
+    }
+    if (found != (1 << N_LAYOUT_SYMS) - 1) {
+        sgx_dbg(err, "%s: missing enclave symbols", binary);
+        goto fail;
+    }
+
+    munmap(img, size);
+    return true;
+
+fail:
+    munmap(img, size);
+    return false;
+}
+
+// The same layout given on the command line as the old opensgx script
+// did: size (decimal), then offset, ENCT_START, ENCT_END, ENCD_START,
+// ENCD_END and enclave_start (hex)
+bool OpenSGX_layout_args(char **args, enclave_layout_t *layout)
 {
-    FILE *fp = NULL;
-    unsigned char *buffer;
-    int n;
-    unsigned char *base_addr;
+    for (int i = 0; i < 7; i++) {
+        if (!args[i])
+            return false;
+    }
 
-    buffer = malloc(size);
-    memset(buffer, 0, size);
+    layout->size       = atol(args[0]);
+    layout->offset     = strtol(args[1], NULL, 16);
+    layout->code_start = strtoull(args[2], NULL, 16);
+    layout->code_end   = strtoull(args[3], NULL, 16);
+    layout->data_start = strtoull(args[4], NULL, 16);
+    layout->data_end   = strtoull(args[5], NULL, 16);
+    layout->entry      = strtoull(args[6], NULL, 16);
+    return true;
+}
 
-    fp = fopen(binary, "rb");
-    if (fp == NULL)
-        return 0;
+// Map the n_of_pages enclave pages (.enc_text, then .enc_data) found
+// at offset in binary, so that EADD copies them straight out of the
+// page cache. Pages past the end of the file read as zeros. Release
+// with OpenSGX_unload() once the enclave is created.
+void *OpenSGX_loader(char *binary, int size, long offset, int n_of_pages)
+{
+    size_t len = (size_t)n_of_pages * PAGE_SIZE;
+    size_t flen = 0;
+    void *base_addr;
+    int fd;
 
-    n = fread(buffer, size, 1, fp);
-    // XXX: fread will return 0 when MAX_BUFFER_SIZE > BINARY SIZE
-    if (n < 0)
-        return 0;
+    fd = open(binary, O_RDONLY);
+    if (fd < 0)
+        return NULL;
 
-    base_addr = (unsigned char *)memalign(PAGE_SIZE, n_of_pages * PAGE_SIZE);
-    memset(base_addr, 0, n_of_pages * PAGE_SIZE);
-    memcpy(base_addr, buffer + offset, n_of_pages * PAGE_SIZE);
+    if (offset >= 0 && offset < size)
+        flen = ((size_t)(size - offset) < len) ? (size_t)(size - offset) : len;
+
+    // zero pages, with the file mapped over as much as it covers
+    base_addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base_addr == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (flen > 0) {
+        bool ok;
+        if (offset % PAGE_SIZE == 0) {
+            ok = mmap(base_addr, flen, PROT_READ, MAP_PRIVATE|MAP_FIXED,
+                      fd, offset) != MAP_FAILED;
+        } else {
+            // sgx.lds page-aligns .enc_text; anything else takes one copy
+            ok = mprotect(base_addr, len, PROT_READ|PROT_WRITE) == 0
+                && pread(fd, base_addr, flen, offset) == (ssize_t)flen
+                && mprotect(base_addr, len, PROT_READ) == 0;
+        }
+        if (!ok) {
+            munmap(base_addr, len);
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
 
     return base_addr;
 }
+
+void OpenSGX_unload(void *base_addr, int n_of_pages)
+{
+    if (base_addr)
+        munmap(base_addr, (size_t)n_of_pages * PAGE_SIZE);
+}
@@ -1115,6 +1115,12 @@ int rop2(int val)
     return n;
 }
 
+bool lazy_epc(void)
+{
+    char *env = getenv(EPC_LAZY_ENV);
+    return env && atoi(env) > 0;
+}
+
 void load_bytes_from_str(uint8_t *key, char *bytes, size_t size)
 {
     if (bytes && (bytes[0] == '\n' || bytes[0] == '\0')) {
@@ -20,14 +20,6 @@
 #include <sgx-lib.h>
 #include <stdarg.h>
 
-// one 4k page : enclave page & offset
-
-static unsigned long cur_heap_ptr = 0x0;
-static unsigned long heap_end = 0x0;
-static int has_initialized = 0;
-static void *managed_memory_start = 0;
-static int g_total_chunk = 0;
-
 void _enclu(enclu_cmd_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
            out_regs_t *out_regs)
 {
@@ -59,6 +51,600 @@ void _enclu(enclu_cmd_t leaf, uint64_t rbx, uint64_t rcx, uint64_t rdx,
     }
 }
 
+// Switchless ocalls (see sgx-trampoline.h). Only this enclave thread
+// posts, so the head index lives here.
+static unsigned int ocall_head = 0;
+
+static inline
+sgx_ocall_slot *ocall_slot(sgx_stub_info *stub)
+{
+    return (sgx_ocall_slot *)((char *)stub - offsetof(sgx_ocall_slot, call));
+}
+
+// Stub to fill for the next ocall: a free ring slot, or the exit stub
+// when switchless mode is off or the ring is full.
+static
+sgx_stub_info *ocall_begin(void)
+{
+    sgx_ocall_ring *ring = (sgx_ocall_ring *)OCALL_RING_ADDR;
+    sgx_ocall_slot *slot;
+
+    if (!ring->enabled)
+        return (sgx_stub_info *)STUB_ADDR;
+
+    slot = &ring->slot[ocall_head % OCALL_RING_SLOTS];
+    if (slot->state != OCALL_FREE) {
+        ring->fallback++;
+        return (sgx_stub_info *)STUB_ADDR;
+    }
+    return &slot->call;
+}
+
+// Run the ocall in stub. Without wait a ring call returns at once and
+// its results are dropped; with wait they are in stub->in_* until
+// ocall_end().
+static
+void ocall_issue(sgx_stub_info *stub, bool wait)
+{
+    sgx_ocall_slot *slot;
+
+    if (stub == (sgx_stub_info *)STUB_ADDR) {
+        // Enclave exit & jump into user-space trampoline
+        sgx_exit(stub->trampoline);
+        return;
+    }
+
+    slot = ocall_slot(stub);
+    slot->wait = wait;
+    asm volatile("" ::: "memory");
+    slot->state = OCALL_POSTED;
+    ocall_head++;
+
+    if (!wait)
+        return;
+    while (slot->state != OCALL_DONE)
+        asm volatile("pause" ::: "memory");
+}
+
+static
+void ocall_end(sgx_stub_info *stub)
+{
+    if (stub != (sgx_stub_info *)STUB_ADDR) {
+        asm volatile("" ::: "memory");
+        ocall_slot(stub)->state = OCALL_FREE;
+    }
+}
+
+//
+// Enclave heap.
+//
+// Requests of up to SLAB_MAX bytes are served from slabs: SLAB_SIZE
+// chunks cut into equal objects of one size class. Each class keeps its
+// slabs with free objects on a list and each slab a free list of its
+// objects, so small sgx_malloc()/sgx_free() calls are O(1). Larger
+// requests, and the slabs themselves, are boundary-tagged chunks: free
+// chunks sit on power-of-two bins and are merged with their free
+// neighbours when freed, and a free chunk that reaches the top of the
+// heap is given back to it. The heap grows at the top, with EAUG pages
+// once the pre-allocated heap is used up.
+//
+// Freed memory is scrubbed, so sgx_malloc() keeps returning zeroed
+// memory: only allocator metadata is ever left behind in the heap, and
+// it is cleared when it stops being metadata.
+//
+typedef struct chunk {
+    unsigned long prev_size;            // size of the previous chunk if it is
+                                        // free; offset to its slab if CHUNK_SLAB
+    unsigned long size;                 // chunk size | CHUNK_* flags
+} chunk_t;
+
+#define CHUNK_INUSE      0x1
+#define CHUNK_PREV_INUSE 0x2
+#define CHUNK_SLAB       0x4
+#define CHUNK_FLAGS      0xfUL
+#define CHUNK_ALIGN      16
+#define CHUNK_MIN        64
+
+typedef struct free_chunk {
+    chunk_t hdr;
+    struct free_chunk *next;
+    struct free_chunk *prev;
+} free_chunk_t;
+
+typedef struct slab {
+    struct slab *next;
+    struct slab *prev;
+    chunk_t *free;                      // linked through the object payloads
+    unsigned short cls;
+    unsigned short nfree;
+    unsigned short nobjs;
+} __attribute__((aligned(CHUNK_ALIGN))) slab_t;
+
+#define SLAB_SIZE        PAGE_SIZE
+#define SLAB_MAX         512
+#define SLAB_CLASSES     20
+#define HEAP_BINS        64
+#define HEAP_MAX_REQUEST (1UL << 40)
+#define HEAP_GROW_MIN    16             // pages per EAUG request
+#define HEAP_GROW_MAX    256
+
+#define ALIGN_UP(x, a)   (((x) + (a) - 1) & ~((unsigned long)(a) - 1))
+
+// 16 to 256 by 16, then by 64
+static const unsigned short slab_class_size[SLAB_CLASSES] = {
+     16,  32,  48,  64,  80,  96, 112, 128,
+    144, 160, 176, 192, 208, 224, 240, 256,
+    320, 384, 448, 512,
+};
+
+static unsigned long heap_beg;
+static unsigned long heap_top;          // untouched memory starts here
+static unsigned long heap_end;          // exclusive
+static int has_initialized = 0;
+
+static slab_t *slab_partial[SLAB_CLASSES];
+static free_chunk_t *heap_bins[HEAP_BINS];
+static uint64_t heap_binmap;
+static heapstat_t heap_stat;
+
+static unsigned long heap_aug_beg;     // first page that was EAUGed
+static int heap_grow_npages = HEAP_GROW_MIN;
+
+// EACCEPT wants these in EPC
+static secinfo_t heap_aug_secinfo __attribute__((aligned(SECINFO_ALIGN_SIZE))) = {
+    .flags = { .r = 1, .w = 1, .pending = 1, .page_type = PT_REG },
+};
+static secinfo_t heap_trim_secinfo __attribute__((aligned(SECINFO_ALIGN_SIZE))) = {
+    .flags = { .modified = 1, .page_type = PT_TRIM },
+};
+
+static inline
+unsigned long chunk_size(chunk_t *c)
+{
+    return c->size & ~CHUNK_FLAGS;
+}
+
+static inline
+chunk_t *chunk_next(chunk_t *c)
+{
+    return (chunk_t *)((char *)c + chunk_size(c));
+}
+
+static inline
+int slab_class(size_t size)
+{
+    if (size <= 256)
+        return size ? (size - 1) / 16 : 0;
+    return 16 + (size - 257) / 64;
+}
+
+static inline
+int heap_bin(unsigned long size)
+{
+    return 63 - __builtin_clzl(size);
+}
+
+static inline
+void heap_stat_add(long bytes)
+{
+    heap_stat.in_use += bytes;
+    if (heap_stat.in_use > heap_stat.peak_in_use)
+        heap_stat.peak_in_use = heap_stat.in_use;
+}
+
+static
+void bin_insert(free_chunk_t *f)
+{
+    int idx = heap_bin(chunk_size(&f->hdr));
+
+    f->prev = NULL;
+    f->next = heap_bins[idx];
+    if (f->next)
+        f->next->prev = f;
+    heap_bins[idx] = f;
+    heap_binmap |= 1UL << idx;
+}
+
+static
+void bin_remove(free_chunk_t *f)
+{
+    int idx = heap_bin(chunk_size(&f->hdr));
+
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        heap_bins[idx] = f->next;
+    if (f->next)
+        f->next->prev = f->prev;
+    if (!heap_bins[idx])
+        heap_binmap &= ~(1UL << idx);
+    f->next = f->prev = NULL;
+}
+
+// Pass the stats to the host with the next FUNC_MALLOC call
+static
+void heap_stat_out(sgx_stub_info *stub)
+{
+    heap_stat.heap_size = heap_end - heap_beg;
+    heap_stat.heap_top = heap_top - heap_beg;
+    sgx_memcpy(stub->out_data1, &heap_stat, sizeof(heapstat_t));
+}
+
+// Ask the host for npages pages at the end of the heap and accept
+// them. Returns the number of pages the heap grew by.
+static
+int heap_aug(int npages)
+{
+    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    out_regs_t out;
+    int n;
+
+    heap_stat_out(stub);
+    stub->fcode = FUNC_MALLOC;
+    stub->mcode = REQUEST_EAUG;
+    stub->addr = (unsigned long *)heap_end;
+    stub->out_arg1 = npages;
+    stub->ret = 0;
+    // Enclave exit & jump into user-space trampoline
+    sgx_exit(stub->trampoline);
+
+    // The heap has to stay contiguous
+    if (stub->pending_page != heap_end || stub->ret < 0 || stub->ret > npages)
+        return 0;
+
+    n = stub->ret;
+    for (int i = 0; i < n; i++) {
+        // EACCEPT should be called with [RBX:the address of secinfo, RCX:the adress of pending page]
+        _enclu(ENCLU_EACCEPT, (uint64_t)&heap_aug_secinfo, heap_end, 0, &out);
+        if (out.oeax != 0)
+            return i;
+        heap_end += PAGE_SIZE;
+        heap_stat.eaug_n++;
+    }
+    return n;
+}
+
+// Grow the heap to cover bytes more. Each request asks for at least
+// heap_grow_npages pages, which doubles up to HEAP_GROW_MAX, so a heap
+// that keeps growing costs a logarithmic number of enclave exits.
+static
+bool heap_grow(unsigned long bytes)
+{
+    int need = ALIGN_UP(bytes, PAGE_SIZE) / PAGE_SIZE;
+
+    while (need > 0) {
+        int n = heap_aug((need > heap_grow_npages) ? need : heap_grow_npages);
+        if (n == 0)
+            return false;
+        need -= n;
+        if (heap_grow_npages < HEAP_GROW_MAX)
+            heap_grow_npages *= 2;
+    }
+    return true;
+}
+
+// Give EAUGed pages at the end of the heap back once the top leaves
+// more than twice the growth step unused, keeping one step of slack.
+// The host trims from the top down, so whatever it manages to trim is
+// the tail of the heap and the rest stays contiguous.
+static
+void heap_trim(void)
+{
+    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    unsigned long keep = ALIGN_UP(heap_top, PAGE_SIZE) + heap_grow_npages * PAGE_SIZE;
+    unsigned long trim;
+    out_regs_t out;
+    int npages, n;
+
+    if (keep < heap_aug_beg)
+        keep = heap_aug_beg;
+    if (heap_end < keep + 2 * heap_grow_npages * PAGE_SIZE)
+        return;
+    npages = (heap_end - keep) / PAGE_SIZE;
+
+    stub->fcode = FUNC_MALLOC;
+    stub->mcode = REQUEST_EMODT;
+    stub->addr = (unsigned long *)keep;
+    stub->out_arg1 = npages;
+    stub->ret = 0;
+    // Enclave exit & jump into user-space trampoline
+    sgx_exit(stub->trampoline);
+
+    n = (stub->ret > 0 && stub->ret <= npages) ? stub->ret : 0;
+    if (n == 0)
+        return;
+
+    // PT_TRIM pages are unusable whether or not they get accepted, so
+    // the heap ends below all of them and all of them are removed
+    trim = heap_end - n * PAGE_SIZE;
+    heap_end = trim;
+    for (unsigned long page = trim; page < trim + n * PAGE_SIZE; page += PAGE_SIZE) {
+        _enclu(ENCLU_EACCEPT, (uint64_t)&heap_trim_secinfo, page, 0, &out);
+        if (out.oeax != 0)
+            break;
+    }
+
+    stub->fcode = FUNC_MALLOC;
+    stub->mcode = REQUEST_EREMOVE;
+    stub->addr = (unsigned long *)trim;
+    stub->out_arg1 = n;
+    stub->ret = 0;
+    // Enclave exit & jump into user-space trampoline
+    sgx_exit(stub->trampoline);
+    heap_stat.trim_n += (stub->ret > 0) ? stub->ret : 0;
+}
+
+static
+chunk_t *chunk_from_top(unsigned long size)
+{
+    chunk_t *c;
+
+    if (heap_top + size > heap_end && !heap_grow(heap_top + size - heap_end))
+        return NULL;
+
+    // the chunk below the top is never free
+    c = (chunk_t *)heap_top;
+    c->size = size | CHUNK_INUSE | CHUNK_PREV_INUSE;
+    heap_top += size;
+    return c;
+}
+
+// c is not in use and its payload is scrubbed: merge it with its free
+// neighbours and bin it, or give it back to the top.
+static
+void chunk_release(chunk_t *c)
+{
+    unsigned long size = chunk_size(c);
+    chunk_t *next = chunk_next(c);
+
+    if (!(c->size & CHUNK_PREV_INUSE)) {
+        chunk_t *prev = (chunk_t *)((char *)c - c->prev_size);
+        bin_remove((free_chunk_t *)prev);
+        size += chunk_size(prev);
+        sgx_memset(c, 0, sizeof(chunk_t));
+        c = prev;
+    }
+
+    if ((unsigned long)next == heap_top) {
+        sgx_memset(c, 0, sizeof(free_chunk_t));
+        heap_top = (unsigned long)c;
+        if (heap_end > heap_aug_beg)
+            heap_trim();
+        return;
+    }
+
+    // a free chunk never borders the top, so what follows is in use
+    if (!(next->size & CHUNK_INUSE)) {
+        bin_remove((free_chunk_t *)next);
+        size += chunk_size(next);
+        sgx_memset(next, 0, sizeof(free_chunk_t));
+        next = (chunk_t *)((char *)c + size);
+    }
+
+    c->size = size | CHUNK_PREV_INUSE;
+    next->prev_size = size;
+    next->size &= ~CHUNK_PREV_INUSE;
+    bin_insert((free_chunk_t *)c);
+}
+
+// Give the tail of the in-use chunk c beyond size back to the heap
+static
+void chunk_trim(chunk_t *c, unsigned long size)
+{
+    unsigned long rest = chunk_size(c) - size;
+    chunk_t *r;
+
+    if (rest < CHUNK_MIN)
+        return;
+
+    c->size = size | (c->size & CHUNK_FLAGS);
+    r = (chunk_t *)((char *)c + size);
+    r->size = rest | CHUNK_PREV_INUSE;
+    chunk_release(r);
+}
+
+static
+chunk_t *chunk_alloc(unsigned long size)
+{
+    int idx = heap_bin(size);
+    uint64_t map;
+    free_chunk_t *f;
+    chunk_t *c;
+
+    // first fit in the bin of size, then anything from a larger one
+    for (f = heap_bins[idx]; f; f = f->next) {
+        if (chunk_size(&f->hdr) >= size)
+            break;
+    }
+    if (!f) {
+        map = (idx < HEAP_BINS - 1) ? heap_binmap & (~0UL << (idx + 1)) : 0;
+        if (!map)
+            return chunk_from_top(size);
+        f = heap_bins[__builtin_ctzl(map)];
+    }
+
+    bin_remove(f);
+    c = &f->hdr;
+    c->size |= CHUNK_INUSE;
+    chunk_next(c)->size |= CHUNK_PREV_INUSE;
+    chunk_trim(c, size);
+    return c;
+}
+
+static
+void chunk_free(chunk_t *c)
+{
+    c->size &= ~CHUNK_INUSE;
+    sgx_memset(c + 1, 0, chunk_size(c) - sizeof(chunk_t));
+    chunk_release(c);
+}
+
+static
+slab_t *slab_new(int cls)
+{
+    unsigned long objsize = sizeof(chunk_t) + slab_class_size[cls];
+    chunk_t *c = chunk_alloc(SLAB_SIZE);
+    slab_t *s;
+    char *obj;
+
+    if (!c)
+        return NULL;
+
+    s = (slab_t *)(c + 1);
+    s->cls = cls;
+    s->nobjs = (SLAB_SIZE - sizeof(chunk_t) - sizeof(slab_t)) / objsize;
+    s->nfree = s->nobjs;
+
+    obj = (char *)(s + 1) + (s->nobjs - 1) * objsize;
+    for (int i = 0; i < s->nobjs; i++, obj -= objsize) {
+        chunk_t *o = (chunk_t *)obj;
+        o->prev_size = obj - (char *)s;
+        o->size = slab_class_size[cls] | CHUNK_SLAB;
+        *(chunk_t **)(o + 1) = s->free;
+        s->free = o;
+    }
+
+    heap_stat.slab_n++;
+    heap_stat.slab_bytes += SLAB_SIZE;
+    return s;
+}
+
+static
+void slab_link(slab_t *s)
+{
+    s->prev = NULL;
+    s->next = slab_partial[s->cls];
+    if (s->next)
+        s->next->prev = s;
+    slab_partial[s->cls] = s;
+}
+
+static
+void slab_unlink(slab_t *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        slab_partial[s->cls] = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+static
+void *slab_alloc(int cls)
+{
+    slab_t *s = slab_partial[cls];
+    chunk_t *o;
+
+    if (!s) {
+        s = slab_new(cls);
+        if (!s)
+            return NULL;
+        slab_link(s);
+    }
+
+    o = s->free;
+    s->free = *(chunk_t **)(o + 1);
+    *(chunk_t **)(o + 1) = NULL;
+    o->size |= CHUNK_INUSE;
+    if (--s->nfree == 0)
+        slab_unlink(s);
+
+    heap_stat_add(slab_class_size[cls]);
+    return o + 1;
+}
+
+static
+void slab_free(chunk_t *o)
+{
+    slab_t *s = (slab_t *)((char *)o - o->prev_size);
+
+    o->size &= ~CHUNK_INUSE;
+    sgx_memset(o + 1, 0, slab_class_size[s->cls]);
+    *(chunk_t **)(o + 1) = s->free;
+    s->free = o;
+    heap_stat.in_use -= slab_class_size[s->cls];
+
+    if (s->nfree++ == 0)
+        slab_link(s);
+
+    // keep the last partial slab of a class to avoid thrashing
+    if (s->nfree == s->nobjs && (s->prev || s->next)) {
+        slab_unlink(s);
+        heap_stat.slab_n--;
+        heap_stat.slab_bytes -= SLAB_SIZE;
+        chunk_free((chunk_t *)s - 1);
+    }
+}
+
+static inline
+unsigned long chunk_request(size_t numbytes)
+{
+    unsigned long size = ALIGN_UP(numbytes + sizeof(chunk_t), CHUNK_ALIGN);
+    return (size < CHUNK_MIN) ? CHUNK_MIN : size;
+}
+
+static
+void *large_alloc(unsigned long size)
+{
+    chunk_t *c = chunk_alloc(size);
+
+    if (!c)
+        return NULL;
+    heap_stat.large_n++;
+    heap_stat_add(chunk_size(c) - sizeof(chunk_t));
+    return c + 1;
+}
+
+// Resize the in-use chunk c to size without moving it: shrink by giving
+// the tail back, grow into a free next chunk or into the top. Returns
+// false if there is no room after c.
+static
+bool chunk_resize(chunk_t *c, unsigned long size)
+{
+    unsigned long cur = chunk_size(c);
+    chunk_t *next = chunk_next(c);
+
+    if (size <= cur) {
+        if (cur - size >= CHUNK_MIN) {
+            sgx_memset((char *)c + size, 0, cur - size);
+            chunk_trim(c, size);
+        }
+        return true;
+    }
+
+    if ((unsigned long)next == heap_top) {
+        if (heap_top + size - cur > heap_end &&
+            !heap_grow(heap_top + size - cur - heap_end))
+            return false;
+        c->size = size | (c->size & CHUNK_FLAGS);
+        heap_top = (unsigned long)c + size;
+        return true;
+    }
+
+    if (!(next->size & CHUNK_INUSE) && cur + chunk_size(next) >= size) {
+        bin_remove((free_chunk_t *)next);
+        c->size += chunk_size(next);
+        sgx_memset(next, 0, sizeof(free_chunk_t));
+        chunk_next(c)->size |= CHUNK_PREV_INUSE;
+        chunk_trim(c, size);
+        return true;
+    }
+    return false;
+}
+
+// Usable bytes of an allocated block
+static
+size_t heap_usable_size(void *ptr)
+{
+    chunk_t *c = (chunk_t *)ptr - 1;
+
+    if (c->size & CHUNK_SLAB)
+        return chunk_size(c);
+    return chunk_size(c) - sizeof(chunk_t);
+}
+
 void sgx_malloc_init() {
      sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
      stub->fcode = FUNC_MALLOC;
@@ -66,100 +652,64 @@ void sgx_malloc_init() {
      // Enclave exit & jump into user-space trampoline
      sgx_exit(stub->trampoline);
 
-     cur_heap_ptr = (unsigned long)stub->heap_beg;
-     heap_end = (unsigned long)stub->heap_end;
-
-     ////
-     managed_memory_start = (unsigned long)stub->heap_beg;
+     // heap_end from the host is the last byte of the heap
+     heap_beg = (unsigned long)stub->heap_beg;
+     heap_top = heap_beg;
+     heap_end = (unsigned long)stub->heap_end + 1;
+     heap_aug_beg = heap_end;
      has_initialized = 1;
-     g_total_chunk = 0;
 }
 
 void sgx_free(void *ptr) {
-     struct mem_control_block *mcb;
-     mcb = ptr - sizeof(struct mem_control_block);
-     mcb->is_available = 1;
-     unsigned int chunk_size = mcb->size - sizeof(struct mem_control_block);
-     sgx_memset(ptr,0,chunk_size); 
-     return;
+     chunk_t *c;
+
+     if (!ptr)
+          return;
+
+     c = (chunk_t *)ptr - 1;
+     if (!(c->size & CHUNK_INUSE))
+          return;
+
+     heap_stat.free_n++;
+     if (c->size & CHUNK_SLAB) {
+          slab_free(c);
+          return;
+     }
+     heap_stat.large_n--;
+     heap_stat.in_use -= chunk_size(c) - sizeof(chunk_t);
+     chunk_free(c);
 }
 
 void *sgx_malloc(size_t numbytes) {
-     //the below mechanism is largely from "Inside memory management from IBM"
-     void *current_location;
-     struct mem_control_block *current_location_mcb;
-     void *memory_location;
-     sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+     void *ptr;
 
      if (!has_initialized) {
           sgx_malloc_init();
      }
-     numbytes = numbytes + sizeof(struct mem_control_block);
-     memory_location = 0;
-
-     current_location = managed_memory_start;
-
-     int total_chunk = g_total_chunk;
-     while (total_chunk) {
-          current_location_mcb = (struct mem_control_block *)current_location;
-          if (current_location_mcb->is_available) {
-               if (current_location_mcb->size >= numbytes) {
-                    current_location_mcb->is_available = 0;
-                    memory_location = current_location;
-                    break;
-               }
-          }
-          current_location = current_location + current_location_mcb->size;
-          total_chunk--;
-     }
-     if (!memory_location) {
-          void *last_heap_ptr = (void *)cur_heap_ptr;
-          unsigned long extra_secinfo_size = sizeof(secinfo_t) + (SECINFO_ALIGN_SIZE - 1);
-
-          if ((cur_heap_ptr + extra_secinfo_size + numbytes ) > heap_end) {
-             secinfo_t *secinfo = sgx_memalign(SECINFO_ALIGN_SIZE, sizeof(secinfo_t));
-
-             secinfo->flags.r = 1;
-             secinfo->flags.w = 1;
-             secinfo->flags.x = 0;
-             secinfo->flags.pending = 1;
-             secinfo->flags.modified = 0;
-             secinfo->flags.reserved1 = 0;
-             secinfo->flags.page_type = PT_REG;
-             int i = 0;
-             for (i = 0 ; i< 6; i++) {
-                 secinfo->flags.reserved2[i] = 0;
-             }
-
-             stub->fcode = FUNC_MALLOC;
-             stub->mcode = REQUEST_EAUG;
-             // Enclave exit & jump into user-space trampoline
-             sgx_exit(stub->trampoline);
-             unsigned long pending_page = stub->pending_page;
-
-             // EACCEPT should be called with [RBX:the address of secinfo, RCX:the adress of pending page]
-             out_regs_t out;
-             _enclu(ENCLU_EACCEPT, (uint64_t)secinfo, (uint64_t)pending_page, 0, &out);  // Check whether OS-provided pending page is legitimate for EPC heap area
-             if (out.oeax == 0) {   // No error occurred in EACCEPT
-                 heap_end += PAGE_SIZE;
-             } else {
-                 return NULL;
-             }
-          }
-          cur_heap_ptr = (unsigned long)last_heap_ptr + numbytes;
-          memory_location = last_heap_ptr;
-
-          current_location_mcb = memory_location;
-          current_location_mcb->is_available = 0;
-          current_location_mcb->size = numbytes;
-          g_total_chunk++; //g_total_chunk is added only when a new chunk is allocted (excluding the case of a using previously used chunk)
-     }
-     memory_location = memory_location + sizeof(struct mem_control_block);
-     return memory_location;
+
+     if (numbytes <= SLAB_MAX)
+          ptr = slab_alloc(slab_class(numbytes));
+     else if (numbytes <= HEAP_MAX_REQUEST)
+          ptr = large_alloc(chunk_request(numbytes));
+     else
+          ptr = NULL;
+
+     if (ptr)
+          heap_stat.malloc_n++;
+     else
+          heap_stat.fail_n++;
+     return ptr;
 }
 
+// Blocks are resized in place when they can be: slab objects within
+// their size class, large blocks by trimming or by growing into a free
+// neighbour or the top. Otherwise the block moves and only the bytes it
+// held are copied.
 void *sgx_realloc(void *ptr, size_t size){
     void *new;
+    size_t old;
+    chunk_t *c;
+
     if (ptr == NULL) {
         return sgx_malloc(size);
     } else {
@@ -167,12 +717,31 @@ void *sgx_realloc(void *ptr, size_t size){
              sgx_free(ptr);
              return NULL;
         }
+
+        c = (chunk_t *)ptr - 1;
+        old = heap_usable_size(ptr);
+        heap_stat.realloc_n++;
+
+        if (c->size & CHUNK_SLAB) {
+            // stay unless a smaller class would do
+            if (size <= old && slab_class(size) == slab_class(old)) {
+                heap_stat.realloc_inplace_n++;
+                return ptr;
+            }
+        } else if (size > SLAB_MAX && size <= HEAP_MAX_REQUEST &&
+                   chunk_resize(c, chunk_request(size))) {
+            heap_stat.in_use += heap_usable_size(ptr);
+            heap_stat.in_use -= old;
+            heap_stat_add(0);
+            heap_stat.realloc_inplace_n++;
+            return ptr;
+        }
+
         new = sgx_malloc(size);
         if (new != NULL) {
-            //if new size > old size, old_size+alpha is written to new. Thus, some of garbage values would be copied
-            //if old size > new size, new_size is written to new. Thus, some of old values would be lossed
-            //sgx_print_hex(new);
-            sgx_memcpy(new, ptr, size);
+            sgx_memcpy(new, ptr, (old < size) ? old : size);
+            heap_stat.realloc_copied += (old < size) ? old : size;
+            sgx_free(ptr);
             return new;
         } else {
             return NULL;
@@ -180,100 +749,175 @@ void *sgx_realloc(void *ptr, size_t size){
     }
 }
 
+// The aligned block is a chunk of its own, so it can be sgx_free()d
 void *sgx_memalign(size_t align, size_t size) {
+    chunk_t *c, *a;
+    unsigned long mem, lead;
 
-    void *mem = sgx_malloc(size + (align - 1));
-    void *ptr = (void *)(((unsigned long)mem + ((unsigned long)align - 1)) & ~ ((unsigned long)align - 1));
+    if (align <= CHUNK_ALIGN)
+        return sgx_malloc(size);
+    if (align & (align - 1))
+        return NULL;
 
-    return ptr;
-}
+    if (!has_initialized) {
+        sgx_malloc_init();
+    }
 
-void sgx_puts(char buf[]) {
+    if (size > HEAP_MAX_REQUEST)
+        return NULL;
 
-    size_t size = sgx_strlen(buf);
+    // room for a free chunk in front of the aligned one
+    c = chunk_alloc(chunk_request(size) + align + CHUNK_MIN);
+    if (!c) {
+        heap_stat.fail_n++;
+        return NULL;
+    }
+
+    mem = (unsigned long)(c + 1);
+    if (mem & (align - 1)) {
+        lead = ALIGN_UP(mem + CHUNK_MIN, align) - mem;
+        a = (chunk_t *)((char *)c + lead);
+        a->size = (chunk_size(c) - lead) | CHUNK_INUSE;
+        c->size = lead | (c->size & CHUNK_PREV_INUSE);
+        chunk_release(c);
+        c = a;
+    }
+    chunk_trim(c, chunk_request(size));
+
+    heap_stat.malloc_n++;
+    heap_stat.large_n++;
+    heap_stat_add(chunk_size(c) - sizeof(chunk_t));
+    return c + 1;
+}
+
+// Fill stat and hand a copy to the host (see sys_stat_heap())
+void sgx_malloc_stat(heapstat_t *stat) {
     sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
 
-    // puts
-    stub->fcode = FUNC_PUTS;
-    sgx_memcpy(stub->out_data1, buf, size);
+    if (!has_initialized) {
+        sgx_malloc_init();
+    }
 
+    heap_stat_out(stub);
+    stub->fcode = FUNC_MALLOC;
+    stub->mcode = MALLOC_STAT;
     // Enclave exit & jump into user-space trampoline
     sgx_exit(stub->trampoline);
+
+    if (stat)
+        sgx_memcpy(stat, &heap_stat, sizeof(heapstat_t));
 }
 
-void *sgx_memcpy (void *dest, const void *src, size_t size)
+// Console output. sgx_putchar() and sgx_printf() format into out_buf
+// in the enclave, which goes out in one FUNC_PRINT call per line, when
+// it fills up, or on sgx_flush(), instead of one exit per character.
+static char out_buf[SGXLIB_MAX_ARG];
+static int out_len = 0;
+
+static
+void print_ocall(const char *buf, int len)
 {
-    asm volatile("" ::: "memory");
-    asm volatile("movq %0, %%rdi\n\t"
-                 "movq %1, %%rsi\n\t"
-                 "movl %2, %%ecx\n\t"
-                 "rep movsb \n\t"
-                 :
-                 :"a"((uint64_t)dest),
-                  "b"((uint64_t)src),
-                  "c"((uint32_t)size));
+    sgx_stub_info *stub = ocall_begin();
+
+    stub->fcode = FUNC_PRINT;
+    stub->out_arg1 = len;
+    sgx_memcpy(stub->out_data1, buf, len);
 
-    return dest;
+    ocall_issue(stub, false);
 }
 
-void *sgx_memmove(void *dest, const void *src, size_t size)
-{
-    asm volatile("" ::: "memory");
-    asm volatile("movq %0, %%rdi\n\t"
-                 "movq %1, %%rsi\n\t"
-                 "movl %2, %%ecx\n\t"
-                 "rep movsb \n\t"
-                 :
-                 :"a"((uint64_t)dest),
-                  "b"((uint64_t)src),
-                  "c"((uint32_t)size));
+void sgx_flush(void) {
+    if (out_len > 0) {
+        print_ocall(out_buf, out_len);
+        out_len = 0;
+    }
+}
+
+void sgx_puts(char buf[]) {
+
+    size_t size = sgx_strlen(buf);
+    sgx_stub_info *stub;
+
+    // keep the order with what is still buffered
+    sgx_flush();
+
+    // what does not fit in one call goes out in raw chunks first
+    while (size > SGXLIB_MAX_ARG - 1) {
+        print_ocall(buf, SGXLIB_MAX_ARG);
+        buf += SGXLIB_MAX_ARG;
+        size -= SGXLIB_MAX_ARG;
+    }
+
+    // puts
+    stub = ocall_begin();
+    stub->fcode = FUNC_PUTS;
+    sgx_memcpy(stub->out_data1, buf, size);
+    stub->out_data1[size] = '\0';
 
-    return dest;
+    ocall_issue(stub, false);
 }
 
 time_t sgx_time(time_t *t)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    time_t ret;
 
     stub->fcode = FUNC_TIME;
 
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
     if (t != NULL)
         sgx_memcpy(t, stub->out_data1, sizeof(time_t));
+    ret = stub->in_arg3;
 
-    return stub->in_arg3;
+    ocall_end(stub);
+    return ret;
 }
 
 
 ssize_t sgx_write(int fd, const void *buf, size_t count)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub;
     int tmp_len;
+    ssize_t ret = 0;
+
+    if (fd == 1 || fd == 2)
+        sgx_flush();
 
     for(int i=0;i<count/SGXLIB_MAX_ARG+1;i++) {
+        // like before, only the last chunk's result is returned, so
+        // the others are posted without waiting
+        bool last = (i == count/SGXLIB_MAX_ARG);
+
+        stub = ocall_begin();
         stub->fcode = FUNC_WRITE;
         stub->out_arg1 = fd;
 
-        if(i == count/SGXLIB_MAX_ARG)
+        if(last)
             tmp_len = (int)count % SGXLIB_MAX_ARG;
         else
             tmp_len = SGXLIB_MAX_ARG;
 
         stub->out_arg2 = tmp_len;
         sgx_memcpy(stub->out_data1, buf+i*SGXLIB_MAX_ARG, tmp_len);
-        sgx_exit(stub->trampoline);
+        ocall_issue(stub, last);
+        if (last) {
+            ret = stub->in_arg1;
+            ocall_end(stub);
+        }
     }
 
-    return stub->in_arg1;
+    return ret;
 }
 
 ssize_t sgx_read(int fd, void *buf, size_t count)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub;
     int tmp_len;
+    ssize_t ret = 0;
 
     for(int i=0;i<count/SGXLIB_MAX_ARG+1;i++) {
+        stub = ocall_begin();
         stub->fcode = FUNC_READ;
         stub->out_arg1 = fd;
 
@@ -283,97 +927,118 @@ ssize_t sgx_read(int fd, void *buf, size_t count)
             tmp_len = SGXLIB_MAX_ARG;
 
         stub->out_arg2 = tmp_len;
-        sgx_exit(stub->trampoline);
+        ocall_issue(stub, true);
         sgx_memcpy(buf+i*SGXLIB_MAX_ARG, stub->in_data1, tmp_len);
+        ret = stub->in_arg1;
+        ocall_end(stub);
     }
 
-    return stub->in_arg1;
+    return ret;
 }
 
 int sgx_close(int fd)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    int ret;
 
     stub->fcode = FUNC_CLOSE;
     stub->out_arg1 = fd;
 
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
-    return stub->in_arg1;
+    ret = stub->in_arg1;
+    ocall_end(stub);
+    return ret;
 }
 
 int sgx_socket(int domain, int type, int protocol)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    int ret;
 
     stub->fcode = FUNC_SOCKET;
     stub->out_arg1 = domain;
     stub->out_arg2 = type;
     stub->out_arg3 = protocol;
 
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
-    return stub->in_arg1;
+    ret = stub->in_arg1;
+    ocall_end(stub);
+    return ret;
 }
 
 int sgx_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    int ret;
 
     stub->fcode = FUNC_BIND;
     stub->out_arg1 = sockfd;
     sgx_memcpy(stub->out_data1, addr, addrlen);
     stub->out_arg2 = addrlen;
 
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
-    return stub->in_arg1;
+    ret = stub->in_arg1;
+    ocall_end(stub);
+    return ret;
 }
 
 int sgx_listen(int sockfd, int backlog)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    int ret;
 
     stub->fcode = FUNC_LISTEN;
     stub->out_arg1 = sockfd;
     stub->out_arg2 = backlog;
 
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
-    return stub->in_arg1;
+    ret = stub->in_arg1;
+    ocall_end(stub);
+    return ret;
 }
 
 int sgx_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    int ret;
 
     stub->fcode = FUNC_ACCEPT;
     stub->out_arg1 = sockfd;
 
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
     sgx_memcpy(addr, stub->out_data1, sizeof(struct sockaddr));
     sgx_memcpy(addrlen, stub->out_data2, sizeof(socklen_t));
-    return stub->in_arg1;
+    ret = stub->in_arg1;
+    ocall_end(stub);
+    return ret;
 }
 
 int sgx_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    int ret;
 
     stub->fcode = FUNC_CONNECT;
     stub->out_arg1 = sockfd;
     sgx_memcpy(stub->out_data1, addr, addrlen);
     stub->out_arg2 = addrlen;
 
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
-    return stub->in_arg1;
+    ret = stub->in_arg1;
+    ocall_end(stub);
+    return ret;
 }
 
 ssize_t sgx_send(int fd, const void *buf, size_t len, int flags)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    ssize_t ret;
 
     stub->fcode = FUNC_SEND;
     sgx_memcpy(stub->out_data1, buf, len);
@@ -381,27 +1046,30 @@ ssize_t sgx_send(int fd, const void *buf, size_t len, int flags)
     stub->out_arg2 = (int)len;
     stub->out_arg3 = flags;
 
-    // Enclave exit & jump into user-space trampoline
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
-    return stub->in_arg1;
+    ret = stub->in_arg1;
+    ocall_end(stub);
+    return ret;
 }
 
 ssize_t sgx_recv(int fd, void *buf, size_t len, int flags)
 {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
+    sgx_stub_info *stub = ocall_begin();
+    ssize_t ret;
 
     stub->fcode = FUNC_RECV;
     stub->out_arg1 = fd;
     stub->out_arg2 = (int)len;
     stub->out_arg3 = flags;
 
-    // Enclave exit & jump into user-space trampoline
-    sgx_exit(stub->trampoline);
+    ocall_issue(stub, true);
 
     sgx_memcpy(buf, stub->in_data1, len);
 
-    return stub->in_arg1;
+    ret = stub->in_arg1;
+    ocall_end(stub);
+    return ret;
 }
 
 int sgx_enclave_read(void *buf, int len)
@@ -431,11 +1099,9 @@ int sgx_enclave_write(void *buf, int len)
 }
 
 void sgx_putchar(char c) {
-    sgx_stub_info *stub = (sgx_stub_info *)STUB_ADDR;
-    stub->out_arg1 = (int)c;
-    stub->fcode = FUNC_PUTCHAR;
-
-    sgx_exit(stub->trampoline);
+    out_buf[out_len++] = c;
+    if (c == '\n' || out_len == SGXLIB_MAX_ARG)
+        sgx_flush();
 }
 
 static
@@ -11,6 +11,7 @@ print_usage() {
 -i|--instuct-test : run an instruction test
 -ai|--all-instruction-tests : run all instruction test cases
 --perf|--performance-measure : measure SGX emulator performance metrics 
+-b|--bench [arg]... : run the benchmarks in bench/ (see bench/bench.py -h)
 [test]    : run a test case
 EOF
   for f in test/*.c; do
@@ -132,6 +133,10 @@ case "$1" in
       printf "%-30s: %s\n" "$OUT" "$(run_instruct_test $OUT)"
     done
     ;;
+  -b|--bench)
+    shift
+    $PYTHON $(dirname "$0")/bench/bench.py "$@"
+    ;;
   --perf|--performance-measure)
     MATCH=0
     for f in test/*.c; do
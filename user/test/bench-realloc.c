@@ -0,0 +1,97 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// sgx_realloc microbenchmark: a buffer appended to in RECORD byte
+// steps, grown either by doubling its capacity or by exactly one record
+// each time, against a realloc that always moves (malloc, copy, free).
+// Prints cycles per append and the bytes sgx_realloc had to copy.
+// See sgx/user/sgxLib.c for detail.
+
+#include "test.h"
+
+#define RECORD     64
+#define DOUBLE_MAX (256 * 1024)
+#define STEP_MAX   (128 * 1024)
+
+static inline
+unsigned long rdtsc(void)
+{
+    unsigned int lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+}
+
+static
+void *move_realloc(void *ptr, size_t old, size_t size)
+{
+    void *new = sgx_malloc(size);
+    if (new && ptr) {
+        sgx_memcpy(new, ptr, (old < size) ? old : size);
+        sgx_free(ptr);
+    }
+    return new;
+}
+
+// Returns cycles per append, or 0 if the heap ran out
+static
+unsigned int append(size_t max, int doubling, int moving)
+{
+    char *buf = NULL;
+    size_t cap = 0;
+    unsigned long beg = rdtsc();
+
+    for (size_t len = 0; len < max; len += RECORD) {
+        if (len + RECORD > cap) {
+            size_t new_cap = doubling ? (cap ? cap * 2 : RECORD) : len + RECORD;
+            buf = moving ? move_realloc(buf, cap, new_cap) : sgx_realloc(buf, new_cap);
+            if (!buf)
+                return 0;
+            cap = new_cap;
+        }
+        sgx_memset(buf + len, (int)(len / RECORD), RECORD);
+    }
+    sgx_free(buf);
+
+    return (unsigned int)((rdtsc() - beg) / (max / RECORD));
+}
+
+static
+void run(const char *name, size_t max, int doubling)
+{
+    heapstat_t beg, end;
+    unsigned int moved, realloc;
+
+    moved = append(max, doubling, 1);
+    sgx_malloc_stat(&beg);
+    realloc = append(max, doubling, 0);
+    sgx_malloc_stat(&end);
+
+    sgx_printf("%s: %u appends, move %u cycles/op, realloc %u cycles/op, "
+               "%u in place, %u KB copied\n",
+               name, (unsigned int)(max / RECORD), moved, realloc,
+               end.realloc_inplace_n - beg.realloc_inplace_n,
+               (unsigned int)((end.realloc_copied - beg.realloc_copied) / 1024));
+}
+
+void enclave_main()
+{
+    run("doubling", DOUBLE_MAX, 1);
+    run("step", STEP_MAX, 0);
+    sgx_exit(NULL);
+}
@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Lazy stack and heap test.
+// Run with OPENSGX_EPC_LAZY=1 (for sgx-tool too) so that only the code,
+// TLS and SSA pages are added at creation; the stack and heap pages
+// below are EAUGed as they are first touched. The output is the same
+// either way, and print_eid_stat() shows how many pages were faulted in.
+// See sgx/user/include/sgx-utils.h for detail.
+
+#include "test.h"
+
+#define DEPTH   32
+#define FRAME   2048
+
+// Each frame touches its own part of the stack
+static
+int descend(int depth)
+{
+    volatile unsigned char frame[FRAME];
+
+    for (int i = 0; i < FRAME; i += 256)
+        frame[i] = (unsigned char)(depth + i);
+    if (depth == 0)
+        return 0;
+    return descend(depth - 1) + (frame[FRAME - 256] == (unsigned char)(depth + FRAME - 256));
+}
+
+void enclave_main()
+{
+    unsigned char *buf = sgx_malloc(16 * PAGE_SIZE);
+    int bad = 0;
+
+    if (descend(DEPTH) != DEPTH)
+        bad++;
+
+    for (int i = 0; i < 16 * PAGE_SIZE; i++) {
+        if (buf[i] != 0)
+            bad++;
+    }
+    for (int i = 0; i < 16 * PAGE_SIZE; i += 64)
+        buf[i] = (unsigned char)i;
+    for (int i = 0; i < 16 * PAGE_SIZE; i += 64) {
+        if (buf[i] != (unsigned char)i)
+            bad++;
+    }
+
+    if (bad)
+        sgx_puts("lazy UNMATCH");
+    else
+        sgx_puts("lazy MATCH");
+
+    sgx_free(buf);
+    sgx_exit(NULL);
+}
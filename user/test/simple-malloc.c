@@ -0,0 +1,73 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Enclave heap test: slab objects, large blocks and aligned blocks are
+// all freed and reused, a block larger than the pre-allocated heap is
+// served by EAUGed pages, and the heap stats end up with nothing in use.
+// The host prints the last reported stats with the enclave stats.
+// See sgx/user/sgxLib.c for detail.
+
+#include "test.h"
+
+#define NOBJS 256
+#define BIG   (HEAP_PAGE_FRAMES * PAGE_SIZE + 64 * 1024)
+
+void enclave_main()
+{
+    static char *objs[NOBJS];
+    heapstat_t stat;
+    int bad = 0;
+
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < NOBJS; i++) {
+            // mostly slab sizes, every 8th one a large block
+            size_t size = (i % 8) ? (size_t)(i * 2 + 1) : (size_t)(1024 + i * 16);
+            objs[i] = (i % 32 == 31) ? sgx_memalign(256, size) : sgx_malloc(size);
+            if (!objs[i] || objs[i][0] != 0 || objs[i][size - 1] != 0)
+                bad++;
+            else
+                sgx_memset(objs[i], round + 1, size);
+        }
+        // free every other one first so that large blocks get merged
+        for (int i = 0; i < NOBJS; i += 2)
+            sgx_free(objs[i]);
+        for (int i = 1; i < NOBJS; i += 2)
+            sgx_free(objs[i]);
+    }
+
+    char *big = sgx_malloc(BIG);
+    if (!big)
+        bad++;
+    else {
+        for (int i = 0; i < BIG; i += PAGE_SIZE)
+            big[i] = 1;
+        sgx_free(big);
+    }
+
+    sgx_malloc_stat(&stat);
+    if (stat.in_use != 0 || stat.large_n != 0 || stat.eaug_n == 0)
+        bad++;
+
+    if (bad)
+        sgx_puts("malloc UNMATCH");
+    else
+        sgx_puts("malloc MATCH");
+
+    sgx_exit(NULL);
+}
@@ -0,0 +1,54 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// EPC paging test.
+// Run with OPENSGX_EPC_RESIDENT set below the size of the enclave (e.g.
+// 256) so that the buffer is paged out with EWB and faulted back in with
+// ELDU while it is swept; the output is the same either way.
+// See sgx/user/include/sgx-kern-paging.h for detail.
+
+#include "test.h"
+
+#define NPAGES  64
+#define NPASSES 3
+
+void enclave_main()
+{
+    unsigned char *buf = sgx_malloc(NPAGES * PAGE_SIZE);
+    int bad = 0;
+
+    for (int pass = 0; pass < NPASSES; pass++) {
+        for (int i = 0; i < NPAGES * PAGE_SIZE; i += 64)
+            buf[i] = (unsigned char)(i / 64 + pass);
+
+        // read back, reloading whatever was paged out meanwhile
+        for (int i = 0; i < NPAGES * PAGE_SIZE; i += 64) {
+            if (buf[i] != (unsigned char)(i / 64 + pass))
+                bad++;
+        }
+    }
+
+    if (bad)
+        sgx_puts("paging UNMATCH");
+    else
+        sgx_puts("paging MATCH");
+
+    sgx_free(buf);
+    sgx_exit(NULL);
+}
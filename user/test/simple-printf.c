@@ -4,6 +4,9 @@
 
 #include "test.h"
 
+// longer than one ocall argument, so sgx_puts() has to split it
+static char long_line[3 * SGXLIB_MAX_ARG + 16];
+
 void enclave_main()
 {
     char *ptr = "Hello world!";
@@ -24,5 +27,10 @@ void enclave_main()
     sgx_print_hex((unsigned long)ptr);
     sgx_printf("\n");
 
+    for (int j = 0; j < sizeof(long_line) - 1; j++)
+        long_line[j] = 'a' + j % 26;
+    sgx_printf("long line of %d: ", (int)sizeof(long_line) - 1);
+    sgx_puts(long_line);
+
     sgx_exit(NULL);
 }
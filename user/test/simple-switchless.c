@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2015, OpenSGX team, Georgia Tech & KAIST, All Rights Reserved
+ *
+ *  This file is part of OpenSGX (https://github.com/sslab-gatech/opensgx).
+ *
+ *  OpenSGX is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  OpenSGX is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with OpenSGX.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Switchless ocall test.
+// Run with OPENSGX_SWITCHLESS=1 to service the calls below from the host
+// worker thread through the ring at OCALL_RING_ADDR; without it every
+// call takes the EEXIT/ERESUME path. The output is the same either way.
+// See sgx/user/include/sgx-trampoline.h for detail.
+
+#include "test.h"
+
+#define NCALLS 256
+
+void enclave_main()
+{
+    sgx_ocall_ring *ring = (sgx_ocall_ring *)OCALL_RING_ADDR;
+    char line[] = "switchless write 000\n";
+    time_t t1, t2;
+
+    t1 = sgx_time(NULL);
+
+    // more posted (unwaited) calls than slots exercises the fallback;
+    // sgx_putchar() is buffered, so flush each one out as its own call
+    for (int i = 0; i < NCALLS; i++) {
+        sgx_putchar(i % 64 == 63 ? '\n' : '.');
+        sgx_flush();
+    }
+
+    for (int i = 0; i < 10; i++) {
+        line[17] = '0' + (i / 100) % 10;
+        line[18] = '0' + (i / 10) % 10;
+        line[19] = '0' + i % 10;
+        sgx_write(1, line, sgx_strlen(line));
+    }
+
+    t2 = sgx_time(NULL);
+    if (t2 >= t1)
+        sgx_puts("time MATCH");
+    else
+        sgx_puts("time UNMATCH");
+
+    sgx_printf("switchless %s, ring full %u times\n",
+               ring->enabled ? "on" : "off", (unsigned int)ring->fallback);
+
+    sgx_exit(NULL);
+}